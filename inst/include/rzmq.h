@@ -0,0 +1,64 @@
+/*
+ * C API of the rzmq package.
+ *
+ * Packages using it add rzmq to LinkingTo and Imports and include this
+ * header.  The functions work on socket handles returned by init.socket(),
+ * without going through R, so they can be called from native loops.  Like
+ * the socket itself, they must only be used from the thread that created
+ * it.  They follow libzmq's conventions: a negative return value is an
+ * error whose number rzmq_errno() returns.
+ *
+ *   void* rzmq_socket(SEXP socket)
+ *     the underlying libzmq socket, or NULL if socket is not an open rzmq
+ *     socket; valid until the socket is closed
+ *   int rzmq_send(SEXP socket, const void* buf, size_t len, int flags)
+ *     sends len bytes as one frame, as zmq_send()
+ *   int rzmq_recv(SEXP socket, void* buf, size_t len, int flags)
+ *     receives one frame into buf, as zmq_recv(); a frame longer than len
+ *     is truncated and the full length returned
+ *   int rzmq_errno(void)
+ *     the error number of the last failed call on this thread
+ *
+ * The flags are libzmq's, for example ZMQ_DONTWAIT (1) and ZMQ_SNDMORE (2).
+ */
+
+#ifndef RZMQ_H
+#define RZMQ_H
+
+#include <stddef.h>
+#include <Rinternals.h>
+#include <R_ext/Rdynload.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+static R_INLINE void* rzmq_socket(SEXP socket) {
+  static void* (*fun)(SEXP) = NULL;
+  if(fun == NULL) fun = (void* (*)(SEXP)) R_GetCCallable("rzmq", "rzmq_socket");
+  return fun(socket);
+}
+
+static R_INLINE int rzmq_send(SEXP socket, const void* buf, size_t len, int flags) {
+  static int (*fun)(SEXP, const void*, size_t, int) = NULL;
+  if(fun == NULL) fun = (int (*)(SEXP, const void*, size_t, int)) R_GetCCallable("rzmq", "rzmq_send");
+  return fun(socket, buf, len, flags);
+}
+
+static R_INLINE int rzmq_recv(SEXP socket, void* buf, size_t len, int flags) {
+  static int (*fun)(SEXP, void*, size_t, int) = NULL;
+  if(fun == NULL) fun = (int (*)(SEXP, void*, size_t, int)) R_GetCCallable("rzmq", "rzmq_recv");
+  return fun(socket, buf, len, flags);
+}
+
+static R_INLINE int rzmq_errno(void) {
+  static int (*fun)(void) = NULL;
+  if(fun == NULL) fun = (int (*)(void)) R_GetCCallable("rzmq", "rzmq_errno");
+  return fun();
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,239 @@
+///////////////////////////////////////////////////////////////////////////
+// Copyright (C) 2011  Whit Armstrong                                    //
+//                                                                       //
+// This program is free software: you can redistribute it and/or modify  //
+// it under the terms of the GNU General Public License as published by  //
+// the Free Software Foundation, either version 3 of the License, or     //
+// (at your option) any later version.                                   //
+//                                                                       //
+// This program is distributed in the hope that it will be useful,       //
+// but WITHOUT ANY WARRANTY; without even the implied warranty of        //
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         //
+// GNU General Public License for more details.                          //
+//                                                                       //
+// You should have received a copy of the GNU General Public License     //
+// along with this program.  If not, see <http://www.gnu.org/licenses/>. //
+///////////////////////////////////////////////////////////////////////////
+
+// Batched receive with the parsing spread over worker threads.
+//
+// The calling thread drains a batch of messages from the socket, then
+// worker threads check the compact and columnar messages in it and index
+// the columnar ones, without touching R.  The R thread is left to build
+// the objects.  A message that fails its check comes back as NULL instead
+// of stopping the whole batch halfway.  Messages in R's serialize format
+// can only be parsed by R itself and are unserialized on the R thread.
+
+#include <zmq.hpp>
+#include <atomic>
+#include <thread>
+#include "interface.h"
+
+// batches smaller than this are parsed on the calling thread
+static const size_t BATCH_PARALLEL_MIN = 64;
+
+enum batchKind { BATCH_FRAMES, BATCH_SERIALIZED, BATCH_COMPACT, BATCH_COLUMNAR };
+
+struct batchItem {
+  batchItem() : kind(BATCH_FRAMES), table(NULL), ok(true) {}
+  ~batchItem() {
+    delete table;
+    for(size_t i = 0; i < frames.size(); i++) delete frames[i];
+  }
+  std::vector<zmq::message_t*> frames;
+  batchKind kind;
+  // columnar messages move their frames here
+  columnarTable* table;
+  bool ok;
+  std::string error;
+};
+
+struct messageBatch {
+  ~messageBatch() {
+    for(size_t i = 0; i < items.size(); i++) delete items[i];
+  }
+  std::vector<batchItem*> items;
+};
+
+static void messageBatchFinalizer(SEXP batch_) {
+  messageBatch* batch = reinterpret_cast<messageBatch*>(R_ExternalPtrAddr(batch_));
+  if(batch) {
+    delete batch;
+    R_ClearExternalPtr(batch_);
+  }
+}
+
+// receives up to max messages, waiting only for the first; false if not
+// even one arrived
+static bool drainBatch(zmq::socket_t* socket, int flags, size_t max, messageBatch* batch) {
+  while(batch->items.size() < max) {
+    batchItem* item = new batchItem;
+    zmq::message_t* msg = new zmq::message_t;
+    batch->items.push_back(item);
+    item->frames.push_back(msg);
+    if(!receiveMessage(socket, msg, batch->items.size() == 1 ? flags : ZMQ_DONTWAIT)) {
+      batch->items.pop_back();
+      delete item;
+      break;
+    }
+    // multipart messages are atomic, so the rest is already here
+    while(msg->more()) {
+      msg = new zmq::message_t;
+      item->frames.push_back(msg);
+      if(!receiveMessage(socket, msg, 0)) {
+        item->ok = false;
+        item->error = "incomplete multipart message.";
+        break;
+      }
+    }
+  }
+  return !batch->items.empty();
+}
+
+// runs on the worker threads, so it must not use R
+static void parseItem(batchItem* item) {
+  if(!item->ok)
+    return;
+  try {
+    zmq::message_t* first = item->frames[0];
+    const unsigned char* data = reinterpret_cast<const unsigned char*>(first->data());
+    if(isColumnar(data, first->size())) {
+      item->kind = BATCH_COLUMNAR;
+      item->table = new columnarTable;
+      item->table->frames.swap(item->frames);
+      item->ok = parseColumnar(item->table, &item->error);
+    } else if(item->frames.size() > 1) {
+      item->kind = BATCH_FRAMES;
+    } else if(isCompact(data, first->size())) {
+      item->kind = BATCH_COMPACT;
+      item->ok = checkCompact(data, first->size(), &item->error);
+    } else {
+      item->kind = BATCH_SERIALIZED;
+    }
+  } catch(std::exception& e) {
+    item->ok = false;
+    item->error = e.what();
+  }
+}
+
+static void parseBatch(messageBatch* batch, int threads) {
+  std::vector<batchItem*>& items = batch->items;
+  std::atomic<size_t> next(0);
+  // every thread, the caller included, takes the next unparsed item
+  auto work = [&items, &next]() {
+    for(size_t i = next++; i < items.size(); i = next++) parseItem(items[i]);
+  };
+
+  std::vector<std::thread> workers;
+  if(items.size() >= BATCH_PARALLEL_MIN) {
+    try {
+      for(int i = 1; i < threads; i++) workers.push_back(std::thread(work));
+    } catch(std::exception& e) {
+      // the threads already started and this one finish the batch
+    }
+  }
+  work();
+  for(size_t i = 0; i < workers.size(); i++) workers[i].join();
+}
+
+// a raw vector, or a list of raw vectors for a multipart message
+static SEXP framesPayload(const std::vector<zmq::message_t*>& frames) {
+  if(frames.size() == 1) {
+    SEXP ans = Rf_allocVector(RAWSXP, frames[0]->size());
+    memcpy(RAW(ans), frames[0]->data(), frames[0]->size());
+    return ans;
+  }
+  SEXP ans = PROTECT(Rf_allocVector(VECSXP, frames.size()));
+  for(size_t i = 0; i < frames.size(); i++) {
+    SEXP frame = Rf_allocVector(RAWSXP, frames[i]->size());
+    SET_VECTOR_ELT(ans, i, frame);
+    memcpy(RAW(frame), frames[i]->data(), frames[i]->size());
+  }
+  UNPROTECT(1);
+  return ans;
+}
+
+struct unserializeCall {
+  const unsigned char* data;
+  size_t size;
+  SEXP result;
+};
+
+static void unserializeFn(void* data) {
+  unserializeCall* call = reinterpret_cast<unserializeCall*>(data);
+  call->result = unserializeBytes(call->data, call->size);
+}
+
+// the R object of an item; NULL, with the error printed, if it is malformed
+static SEXP materializeItem(batchItem* item) {
+  if(!item->ok) {
+    REprintf("%s\n", item->error.c_str());
+    return R_NilValue;
+  }
+  switch(item->kind) {
+  case BATCH_COLUMNAR:
+    return materializeColumnar(*item->table);
+  case BATCH_FRAMES:
+    return framesPayload(item->frames);
+  default: {
+    // R's own format may still be corrupt, and R reports that as an error
+    unserializeCall call = { reinterpret_cast<const unsigned char*>(item->frames[0]->data()),
+                             item->frames[0]->size(), R_NilValue };
+    if(!R_ToplevelExec(unserializeFn, &call))
+      return R_NilValue;
+    return call.result;
+  }
+  }
+}
+
+SEXP receiveBatch(SEXP socket_, SEXP max_, SEXP unserialize_, SEXP threads_, SEXP dont_wait_) {
+  int max = Rf_asInteger(max_);
+  if(max == NA_INTEGER || max < 1) {
+    REprintf("max must be a positive integer.\n");
+    return R_NilValue;
+  }
+  int threads = Rf_asInteger(threads_);
+  if(threads == NA_INTEGER || threads < 1) {
+    REprintf("threads must be a positive integer.\n");
+    return R_NilValue;
+  }
+  if(TYPEOF(unserialize_) != LGLSXP) {
+    REprintf("unserialize type must be logical (LGLSXP).\n");
+    return R_NilValue;
+  }
+  if(TYPEOF(dont_wait_) != LGLSXP) {
+    REprintf("dont_wait type must be logical (LGLSXP).\n");
+    return R_NilValue;
+  }
+  bool unserialize = LOGICAL(unserialize_)[0];
+
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
+  if(!socket) {
+    REprintf("bad socket object.\n");
+    return R_NilValue;
+  }
+
+  messageBatch* batch = new messageBatch;
+  if(!drainBatch(socket, LOGICAL(dont_wait_)[0] ? ZMQ_DONTWAIT : 0, max, batch)) {
+    delete batch;
+    return R_NilValue;
+  }
+  if(unserialize)
+    parseBatch(batch, threads);
+
+  // an error while building the objects leaves the batch to the garbage
+  // collector
+  SEXP batch_ = PROTECT(R_MakeExternalPtr(batch, R_NilValue, R_NilValue));
+  R_RegisterCFinalizerEx(batch_, messageBatchFinalizer, TRUE);
+  std::vector<batchItem*>& items = batch->items;
+  SEXP ans = PROTECT(Rf_allocVector(VECSXP, items.size()));
+  for(size_t i = 0; i < items.size(); i++) {
+    SET_VECTOR_ELT(ans, i, unserialize ? materializeItem(items[i]) : framesPayload(items[i]->frames));
+    // release each message as soon as it has been copied out
+    delete items[i];
+    items[i] = NULL;
+  }
+  messageBatchFinalizer(batch_);
+  UNPROTECT(2);
+  return ans;
+}
@@ -0,0 +1,585 @@
+///////////////////////////////////////////////////////////////////////////
+// Copyright (C) 2011  Whit Armstrong                                    //
+//                                                                       //
+// This program is free software: you can redistribute it and/or modify  //
+// it under the terms of the GNU General Public License as published by  //
+// the Free Software Foundation, either version 3 of the License, or     //
+// (at your option) any later version.                                   //
+//                                                                       //
+// This program is distributed in the hope that it will be useful,       //
+// but WITHOUT ANY WARRANTY; without even the implied warranty of        //
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         //
+// GNU General Public License for more details.                          //
+//                                                                       //
+// You should have received a copy of the GNU General Public License     //
+// along with this program.  If not, see <http://www.gnu.org/licenses/>. //
+///////////////////////////////////////////////////////////////////////////
+
+// Load balancing broker for a pool of workers, run on its own thread.
+//
+// R talks to the broker thread over an inproc PAIR: tasks go in as
+// [id][payload] and results come back the same way, a lone empty frame
+// stops the thread.  Workers connect to the ROUTER backend and speak,
+// after the usual [empty] delimiter (added for free by REQ sockets):
+//
+//   [READY][credits]     announce capacity, credits defaults to 1
+//   [RESULT][id][data]   return a result, which frees one credit
+//   [HEARTBEAT]          nothing but proof of life
+//
+// and receive tasks as [id][payload].  Each task goes to the worker with
+// the most spare credits relative to its capacity.  The broker keeps every
+// task until its result is back: a worker that vanishes, or that stays
+// silent for longer than the worker timeout while it holds tasks, has them
+// put back at the front of the queue.  A task may then run twice, but only
+// the first result to come back is forwarded to R.
+
+#include <zmq.hpp>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "interface.h"
+
+typedef std::chrono::steady_clock Clock;
+
+struct brokerTask {
+  zmq::message_t id;
+  zmq::message_t payload;
+};
+
+struct brokerWorker {
+  int credits;
+  double completed;
+  Clock::time_point since;
+  Clock::time_point seen;
+  std::map<std::string, brokerTask*> tasks;  // in flight, by id
+};
+
+struct broker {
+  broker(zmq::context_t& context) :
+    pipe(context, ZMQ_PAIR), inner(context, ZMQ_PAIR), backend(context, ZMQ_ROUTER),
+    next_id(1), expires(false), queued(0), submitted(0), completed(0), requeued(0) {}
+  zmq::socket_t pipe;     // R side of the PAIR
+  zmq::socket_t inner;    // broker side of the PAIR, owned by the thread
+  zmq::socket_t backend;  // owned by the thread
+  std::thread thread;
+  double next_id;
+  bool expires;
+  Clock::duration timeout;
+
+  // shared with the thread
+  std::mutex lock;
+  std::map<std::string, brokerWorker> workers;
+  size_t queued;
+  double submitted;
+  double completed;
+  double requeued;
+};
+
+static std::string messageString(const zmq::message_t& msg) {
+  return std::string(reinterpret_cast<const char*>(msg.data()), msg.size());
+}
+
+static void forwardResult(broker* b, zmq::message_t& id, zmq::message_t& payload) {
+  b->inner.send(id, ZMQ_SNDMORE);
+  b->inner.send(payload);
+}
+
+// tasks of a lost worker go back to the front of the queue
+static void requeueTasks(broker* b, std::deque<brokerTask*>& queue, brokerWorker& w) {
+  for(std::map<std::string, brokerTask*>::iterator it = w.tasks.begin(); it != w.tasks.end(); ++it) {
+    queue.push_front(it->second);
+    b->requeued++;
+  }
+  w.tasks.clear();
+}
+
+static void expireWorkers(broker* b, std::deque<brokerTask*>& queue) {
+  if(!b->expires)
+    return;
+  Clock::time_point now = Clock::now();
+  std::map<std::string, brokerWorker>::iterator it = b->workers.begin();
+  while(it != b->workers.end()) {
+    if(!it->second.tasks.empty() && now - it->second.seen > b->timeout) {
+      requeueTasks(b, queue, it->second);
+      b->workers.erase(it++);
+    } else {
+      ++it;
+    }
+  }
+}
+
+// milliseconds until the next busy worker could expire, or -1
+static long expiryWait(broker* b) {
+  if(!b->expires)
+    return -1;
+  Clock::time_point now = Clock::now();
+  long wait = -1;
+  for(std::map<std::string, brokerWorker>::iterator it = b->workers.begin(); it != b->workers.end(); ++it) {
+    if(it->second.tasks.empty())
+      continue;
+    long left = std::chrono::duration_cast<std::chrono::milliseconds>(it->second.seen + b->timeout - now).count() + 1;
+    left = std::max(0L, left);
+    if(wait < 0 || left < wait) wait = left;
+  }
+  return wait;
+}
+
+// take a task out of the broker for its result, looking first at the
+// worker that answered, then at the others and the queue in case the task
+// was requeued; NULL when the result is a duplicate
+static brokerTask* claimTask(broker* b, std::deque<brokerTask*>& queue, const std::string& identity, const std::string& id) {
+  std::map<std::string, brokerWorker>::iterator owner = b->workers.find(identity);
+  if(owner != b->workers.end()) {
+    std::map<std::string, brokerTask*>::iterator it = owner->second.tasks.find(id);
+    if(it != owner->second.tasks.end()) {
+      brokerTask* task = it->second;
+      owner->second.tasks.erase(it);
+      return task;
+    }
+  }
+  for(std::map<std::string, brokerWorker>::iterator w = b->workers.begin(); w != b->workers.end(); ++w) {
+    std::map<std::string, brokerTask*>::iterator it = w->second.tasks.find(id);
+    if(it != w->second.tasks.end()) {
+      brokerTask* task = it->second;
+      w->second.tasks.erase(it);
+      return task;
+    }
+  }
+  for(std::deque<brokerTask*>::iterator it = queue.begin(); it != queue.end(); ++it) {
+    if(messageString((*it)->id) == id) {
+      brokerTask* task = *it;
+      queue.erase(it);
+      return task;
+    }
+  }
+  return NULL;
+}
+
+static void dispatchTasks(broker* b, std::deque<brokerTask*>& queue) {
+  while(!queue.empty()) {
+    std::map<std::string, brokerWorker>::iterator best = b->workers.end();
+    double best_load = 1;
+    for(std::map<std::string, brokerWorker>::iterator it = b->workers.begin(); it != b->workers.end(); ++it) {
+      double load = static_cast<double>(it->second.tasks.size()) / it->second.credits;
+      if(load < best_load) {
+        best = it;
+        best_load = load;
+      }
+    }
+    if(best == b->workers.end())
+      return;
+
+    // the backend is ROUTER_MANDATORY, so a vanished worker fails the
+    // identity frame, the task stays queued for someone else and the
+    // worker's own tasks are queued again
+    brokerTask* task = queue.front();
+    zmq::message_t identity(best->first.size());
+    memcpy(identity.data(), best->first.data(), best->first.size());
+    try {
+      if(!b->backend.send(identity, ZMQ_SNDMORE))
+        return;
+    } catch(zmq::error_t& e) {
+      if(e.num() != EHOSTUNREACH)
+        throw;
+      requeueTasks(b, queue, best->second);
+      b->workers.erase(best);
+      continue;
+    }
+    queue.pop_front();
+    // send copies, the task is kept until its result is back
+    zmq::message_t delimiter(0), id, payload;
+    id.copy(&task->id);
+    payload.copy(&task->payload);
+    b->backend.send(delimiter, ZMQ_SNDMORE);
+    b->backend.send(id, ZMQ_SNDMORE);
+    b->backend.send(payload);
+    // an idle worker has had no reason to talk, its clock starts now
+    if(best->second.tasks.empty())
+      best->second.seen = Clock::now();
+    best->second.tasks[messageString(task->id)] = task;
+  }
+}
+
+// frames of the current multipart message, read up to the last one
+static std::vector<zmq::message_t*> receiveParts(zmq::socket_t& socket) {
+  std::vector<zmq::message_t*> parts;
+  bool more = true;
+  while(more) {
+    zmq::message_t* part = new zmq::message_t;
+    socket.recv(part);
+    more = part->more();
+    parts.push_back(part);
+  }
+  return parts;
+}
+
+static void brokerLoop(broker* b) {
+  std::deque<brokerTask*> queue;
+  zmq_pollitem_t items[] = {
+    { (void*)b->inner, 0, ZMQ_POLLIN, 0 },
+    { (void*)b->backend, 0, ZMQ_POLLIN, 0 }
+  };
+  bool running = true;
+
+  try {
+    while(running) {
+      try {
+        long wait;
+        {
+          std::lock_guard<std::mutex> guard(b->lock);
+          wait = expiryWait(b);
+        }
+        zmq::poll(items, 2, wait);
+      } catch(zmq::error_t& e) {
+        if(e.num() != EINTR)
+          throw;
+        continue;
+      }
+
+      if(items[0].revents & ZMQ_POLLIN) {
+        std::vector<zmq::message_t*> parts = receiveParts(b->inner);
+        if(parts.size() == 2) {
+          brokerTask* task = new brokerTask;
+          task->id.move(parts[0]);
+          task->payload.move(parts[1]);
+          queue.push_back(task);
+        } else {
+          running = false;
+        }
+        for(size_t i = 0; i < parts.size(); i++) delete parts[i];
+      }
+
+      if(items[1].revents & ZMQ_POLLIN) {
+        std::vector<zmq::message_t*> parts = receiveParts(b->backend);
+        if(parts.size() >= 3 && parts[1]->size() == 0) {
+          std::string identity = messageString(*parts[0]);
+          std::string command = messageString(*parts[2]);
+          std::lock_guard<std::mutex> guard(b->lock);
+          std::map<std::string, brokerWorker>::iterator it = b->workers.find(identity);
+          if(it != b->workers.end())
+            it->second.seen = Clock::now();
+          if(command == "READY") {
+            int credits = 1;
+            if(parts.size() >= 4) {
+              credits = std::max(1, atoi(messageString(*parts[3]).c_str()));
+            }
+            // READY states the capacity, repeating it must not inflate it
+            if(it == b->workers.end()) {
+              brokerWorker& w = b->workers[identity];
+              w.completed = 0;
+              w.since = w.seen = Clock::now();
+              it = b->workers.find(identity);
+            }
+            it->second.credits = credits;
+          } else if(command == "RESULT" && parts.size() == 5) {
+            brokerTask* task = claimTask(b, queue, identity, messageString(*parts[3]));
+            if(task) {
+              forwardResult(b, *parts[3], *parts[4]);
+              delete task;
+              if(it != b->workers.end())
+                it->second.completed++;
+              b->completed++;
+            }
+          }
+        }
+        for(size_t i = 0; i < parts.size(); i++) delete parts[i];
+      }
+
+      std::lock_guard<std::mutex> guard(b->lock);
+      expireWorkers(b, queue);
+      dispatchTasks(b, queue);
+      b->queued = queue.size();
+    }
+  } catch(std::exception& e) {
+    // context terminated underneath us
+  }
+  std::lock_guard<std::mutex> guard(b->lock);
+  for(std::map<std::string, brokerWorker>::iterator it = b->workers.begin(); it != b->workers.end(); ++it)
+    requeueTasks(b, queue, it->second);
+  for(size_t i = 0; i < queue.size(); i++) delete queue[i];
+}
+
+static void brokerFinalizer(SEXP broker_) {
+  broker* b = reinterpret_cast<broker*>(R_ExternalPtrAddr(broker_));
+  if(b) {
+    unregisterHandle(broker_);
+    try {
+      zmq::message_t stop(0);
+      b->pipe.send(stop);
+    } catch(std::exception& e) {
+    }
+    b->thread.join();
+    delete b;
+    R_ClearExternalPtr(broker_);
+  }
+}
+
+SEXP initBroker(SEXP context_, SEXP address_, SEXP timeout_) {
+  SEXP broker_;
+
+  if(TYPEOF(address_) != STRSXP) {
+    REprintf("address type must be a string.\n");
+    return R_NilValue;
+  }
+  double timeout = Rf_asReal(timeout_);
+  if(ISNAN(timeout) || timeout <= 0) {
+    REprintf("worker timeout must be a positive number of seconds.\n");
+    return R_NilValue;
+  }
+
+  zmq::context_t* context = reinterpret_cast<zmq::context_t*>(checkExternalPointer(context_,rzmq_context_tag));
+  if(!context) {
+    REprintf("bad context object.\n");
+    return R_NilValue;
+  }
+
+  broker* b(NULL);
+  try {
+    b = new broker(*context);
+    if(R_FINITE(timeout)) {
+      b->expires = true;
+      b->timeout = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(timeout));
+    }
+    // neither end of the pipe may block the other
+    int hwm = 0, linger = 0;
+    b->pipe.setsockopt(ZMQ_SNDHWM, &hwm, sizeof(int));
+    b->pipe.setsockopt(ZMQ_RCVHWM, &hwm, sizeof(int));
+    b->inner.setsockopt(ZMQ_SNDHWM, &hwm, sizeof(int));
+    b->inner.setsockopt(ZMQ_RCVHWM, &hwm, sizeof(int));
+    b->pipe.setsockopt(ZMQ_LINGER, &linger, sizeof(int));
+    b->inner.setsockopt(ZMQ_LINGER, &linger, sizeof(int));
+    b->backend.setsockopt(ZMQ_LINGER, &linger, sizeof(int));
+    int mandatory = 1;
+    b->backend.setsockopt(ZMQ_ROUTER_MANDATORY, &mandatory, sizeof(int));
+
+    std::stringstream endpoint;
+    endpoint << "inproc://rzmq-broker-" << reinterpret_cast<void*>(b);
+    b->pipe.bind(endpoint.str().c_str());
+    b->inner.connect(endpoint.str().c_str());
+    b->backend.bind(CHAR(STRING_ELT(address_,0)));
+    b->thread = std::thread(brokerLoop, b);
+  } catch(std::exception& e) {
+    reportError(e);
+    delete b;
+    return R_NilValue;
+  }
+
+  // the broker keeps its context alive
+  PROTECT(broker_ = R_MakeExternalPtr(reinterpret_cast<void*>(b),rzmq_broker_tag,context_));
+  R_RegisterCFinalizerEx(broker_, brokerFinalizer, TRUE);
+  registerHandle(broker_, brokerFinalizer);
+  UNPROTECT(1);
+  return broker_;
+}
+
+SEXP brokerSubmit(SEXP broker_, SEXP tasks_) {
+  SEXP ans;
+
+  if(TYPEOF(tasks_) != VECSXP) {
+    REprintf("tasks must be a list of raw vectors.\n");
+    return R_NilValue;
+  }
+  for(R_xlen_t i = 0; i < Rf_xlength(tasks_); i++) {
+    if(TYPEOF(VECTOR_ELT(tasks_, i)) != RAWSXP) {
+      REprintf("tasks must be a list of raw vectors.\n");
+      return R_NilValue;
+    }
+  }
+
+  broker* b = reinterpret_cast<broker*>(checkExternalPointer(broker_,rzmq_broker_tag));
+  if(!b) {
+    REprintf("bad broker object.\n");
+    return R_NilValue;
+  }
+
+  PROTECT(ans = Rf_allocVector(REALSXP, Rf_xlength(tasks_)));
+  try {
+    for(R_xlen_t i = 0; i < Rf_xlength(tasks_); i++) {
+      SEXP task = VECTOR_ELT(tasks_, i);
+      double id = b->next_id++;
+      zmq::message_t id_msg(sizeof(double));
+      memcpy(id_msg.data(), &id, sizeof(double));
+      zmq::message_t msg(Rf_xlength(task));
+      memcpy(msg.data(), RAW(task), Rf_xlength(task));
+      b->pipe.send(id_msg, ZMQ_SNDMORE);
+      b->pipe.send(msg);
+      REAL(ans)[i] = id;
+    }
+  } catch(std::exception& e) {
+    reportError(e);
+    UNPROTECT(1);
+    return R_NilValue;
+  }
+  {
+    std::lock_guard<std::mutex> guard(b->lock);
+    b->submitted += Rf_xlength(tasks_);
+  }
+  UNPROTECT(1);
+  return ans;
+}
+
+SEXP brokerCollect(SEXP broker_, SEXP timeout_, SEXP max_) {
+  SEXP ans;
+
+  if(TYPEOF(timeout_) != INTSXP) {
+    Rf_error("broker timeout must be an integer.");
+  }
+
+  broker* b = reinterpret_cast<broker*>(checkExternalPointer(broker_,rzmq_broker_tag));
+  if(!b) {
+    REprintf("bad broker object.\n");
+    return R_NilValue;
+  }
+
+  double max = Rf_asReal(max_);
+  std::vector<double> ids;
+  std::vector<zmq::message_t*> results;
+  try {
+    zmq_pollitem_t item = { (void*)b->pipe, 0, ZMQ_POLLIN, 0 };
+    int rc = -1;
+    do {
+      try {
+        rc = zmq::poll(&item, 1, *INTEGER(timeout_));
+      } catch(zmq::error_t& e) {
+        if(errno != EINTR || pending_interrupt())
+          throw;
+      }
+    } while(rc < 0);
+
+    while(ids.size() < max) {
+      zmq::message_t id_msg;
+      if(!b->pipe.recv(&id_msg, ZMQ_DONTWAIT))
+        break;
+      zmq::message_t* result = new zmq::message_t;
+      b->pipe.recv(result);
+      double id;
+      memcpy(&id, id_msg.data(), sizeof(double));
+      ids.push_back(id);
+      results.push_back(result);
+    }
+  } catch(std::exception& e) {
+    for(size_t i = 0; i < results.size(); i++) delete results[i];
+    Rf_error("%s", e.what());
+  }
+
+  PROTECT(ans = Rf_allocVector(VECSXP, 2));
+  SEXP ids_ = Rf_allocVector(REALSXP, ids.size());
+  SET_VECTOR_ELT(ans, 0, ids_);
+  SEXP results_ = Rf_allocVector(VECSXP, results.size());
+  SET_VECTOR_ELT(ans, 1, results_);
+  for(size_t i = 0; i < results.size(); i++) {
+    REAL(ids_)[i] = ids[i];
+    SEXP result = Rf_allocVector(RAWSXP, results[i]->size());
+    SET_VECTOR_ELT(results_, i, result);
+    memcpy(RAW(result), results[i]->data(), results[i]->size());
+    delete results[i];
+  }
+  SEXP names = PROTECT(Rf_allocVector(STRSXP, 2));
+  SET_STRING_ELT(names, 0, Rf_mkChar("id"));
+  SET_STRING_ELT(names, 1, Rf_mkChar("result"));
+  Rf_setAttrib(ans, R_NamesSymbol, names);
+  UNPROTECT(2);
+  return ans;
+}
+
+// worker identities as strings, hex encoded unless printable
+static std::string identityString(const std::string& identity) {
+  bool printable = !identity.empty();
+  for(size_t i = 0; i < identity.size(); i++) {
+    if(identity[i] < 32 || identity[i] > 126) printable = false;
+  }
+  if(printable)
+    return identity;
+  std::stringstream out;
+  out << std::hex;
+  for(size_t i = 0; i < identity.size(); i++) {
+    out.width(2);
+    out.fill('0');
+    out << static_cast<int>(static_cast<unsigned char>(identity[i]));
+  }
+  return out.str();
+}
+
+struct workerStats {
+  int credits;
+  int inflight;
+  double completed;
+  Clock::time_point since;
+};
+
+SEXP brokerStats(SEXP broker_) {
+  SEXP ans;
+
+  broker* b = reinterpret_cast<broker*>(checkExternalPointer(broker_,rzmq_broker_tag));
+  if(!b) {
+    REprintf("bad broker object.\n");
+    return R_NilValue;
+  }
+
+  // snapshot under the lock, allocate R objects without it
+  std::vector<std::pair<std::string, workerStats> > snapshot;
+  double queued, submitted, completed, requeued;
+  {
+    std::lock_guard<std::mutex> guard(b->lock);
+    for(std::map<std::string, brokerWorker>::iterator it = b->workers.begin(); it != b->workers.end(); ++it) {
+      workerStats w = { it->second.credits, static_cast<int>(it->second.tasks.size()), it->second.completed, it->second.since };
+      snapshot.push_back(std::make_pair(it->first, w));
+    }
+    queued = b->queued;
+    submitted = b->submitted;
+    completed = b->completed;
+    requeued = b->requeued;
+  }
+  int nworkers = snapshot.size();
+  Clock::time_point now = Clock::now();
+
+  PROTECT(ans = Rf_allocVector(VECSXP, 5));
+  SET_VECTOR_ELT(ans, 0, Rf_ScalarReal(queued));
+  SET_VECTOR_ELT(ans, 1, Rf_ScalarReal(submitted));
+  SET_VECTOR_ELT(ans, 2, Rf_ScalarReal(completed));
+  SET_VECTOR_ELT(ans, 3, Rf_ScalarReal(requeued));
+
+  SEXP workers = PROTECT(Rf_allocVector(VECSXP, 5));
+  SEXP identity_ = Rf_allocVector(STRSXP, nworkers);
+  SET_VECTOR_ELT(workers, 0, identity_);
+  SEXP credits_ = Rf_allocVector(INTSXP, nworkers);
+  SET_VECTOR_ELT(workers, 1, credits_);
+  SEXP inflight_ = Rf_allocVector(INTSXP, nworkers);
+  SET_VECTOR_ELT(workers, 2, inflight_);
+  SEXP completed_ = Rf_allocVector(REALSXP, nworkers);
+  SET_VECTOR_ELT(workers, 3, completed_);
+  SEXP throughput_ = Rf_allocVector(REALSXP, nworkers);
+  SET_VECTOR_ELT(workers, 4, throughput_);
+  for(int i = 0; i < nworkers; i++) {
+    const workerStats& w = snapshot[i].second;
+    SET_STRING_ELT(identity_, i, Rf_mkChar(identityString(snapshot[i].first).c_str()));
+    INTEGER(credits_)[i] = w.credits;
+    INTEGER(inflight_)[i] = w.inflight;
+    REAL(completed_)[i] = w.completed;
+    double elapsed = std::chrono::duration_cast<std::chrono::duration<double> >(now - w.since).count();
+    REAL(throughput_)[i] = elapsed > 0 ? w.completed / elapsed : 0;
+  }
+  SEXP worker_names = PROTECT(Rf_allocVector(STRSXP, 5));
+  SET_STRING_ELT(worker_names, 0, Rf_mkChar("identity"));
+  SET_STRING_ELT(worker_names, 1, Rf_mkChar("credits"));
+  SET_STRING_ELT(worker_names, 2, Rf_mkChar("inflight"));
+  SET_STRING_ELT(worker_names, 3, Rf_mkChar("completed"));
+  SET_STRING_ELT(worker_names, 4, Rf_mkChar("throughput"));
+  Rf_setAttrib(workers, R_NamesSymbol, worker_names);
+  SET_VECTOR_ELT(ans, 4, workers);
+
+  SEXP names = PROTECT(Rf_allocVector(STRSXP, 5));
+  SET_STRING_ELT(names, 0, Rf_mkChar("queued"));
+  SET_STRING_ELT(names, 1, Rf_mkChar("submitted"));
+  SET_STRING_ELT(names, 2, Rf_mkChar("completed"));
+  SET_STRING_ELT(names, 3, Rf_mkChar("requeued"));
+  SET_STRING_ELT(names, 4, Rf_mkChar("workers"));
+  Rf_setAttrib(ans, R_NamesSymbol, names);
+  UNPROTECT(4);
+  return ans;
+}
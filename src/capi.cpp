@@ -0,0 +1,58 @@
+///////////////////////////////////////////////////////////////////////////
+// Copyright (C) 2011  Whit Armstrong                                    //
+//                                                                       //
+// This program is free software: you can redistribute it and/or modify  //
+// it under the terms of the GNU General Public License as published by  //
+// the Free Software Foundation, either version 3 of the License, or     //
+// (at your option) any later version.                                   //
+//                                                                       //
+// This program is distributed in the hope that it will be useful,       //
+// but WITHOUT ANY WARRANTY; without even the implied warranty of        //
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         //
+// GNU General Public License for more details.                          //
+//                                                                       //
+// You should have received a copy of the GNU General Public License     //
+// along with this program.  If not, see <http://www.gnu.org/licenses/>. //
+///////////////////////////////////////////////////////////////////////////
+
+// C API for other packages, registered with R_RegisterCCallable and
+// declared for them in inst/include/rzmq.h.  These functions only touch
+// the handle and libzmq, never the R heap, and report errors the way
+// libzmq does: -1 with the error number in rzmq_errno().
+
+#include <zmq.hpp>
+#include "interface.h"
+
+static void* capiSocket(SEXP socket_) {
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
+  return socket ? static_cast<void*>(*socket) : NULL;
+}
+
+static int capiSend(SEXP socket_, const void* buf, size_t len, int flags) {
+  void* socket = capiSocket(socket_);
+  if(!socket) {
+    errno = ENOTSOCK;
+    return -1;
+  }
+  return zmq_send(socket, buf, len, flags);
+}
+
+static int capiRecv(SEXP socket_, void* buf, size_t len, int flags) {
+  void* socket = capiSocket(socket_);
+  if(!socket) {
+    errno = ENOTSOCK;
+    return -1;
+  }
+  return zmq_recv(socket, buf, len, flags);
+}
+
+static int capiErrno() {
+  return zmq_errno();
+}
+
+void rzmq_init_api(DllInfo* info) {
+  R_RegisterCCallable("rzmq", "rzmq_socket", reinterpret_cast<DL_FUNC>(capiSocket));
+  R_RegisterCCallable("rzmq", "rzmq_send", reinterpret_cast<DL_FUNC>(capiSend));
+  R_RegisterCCallable("rzmq", "rzmq_recv", reinterpret_cast<DL_FUNC>(capiRecv));
+  R_RegisterCCallable("rzmq", "rzmq_errno", reinterpret_cast<DL_FUNC>(capiErrno));
+}
@@ -0,0 +1,399 @@
+///////////////////////////////////////////////////////////////////////////
+// Copyright (C) 2011  Whit Armstrong                                    //
+//                                                                       //
+// This program is free software: you can redistribute it and/or modify  //
+// it under the terms of the GNU General Public License as published by  //
+// the Free Software Foundation, either version 3 of the License, or     //
+// (at your option) any later version.                                   //
+//                                                                       //
+// This program is distributed in the hope that it will be useful,       //
+// but WITHOUT ANY WARRANTY; without even the implied warranty of        //
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         //
+// GNU General Public License for more details.                          //
+//                                                                       //
+// You should have received a copy of the GNU General Public License     //
+// along with this program.  If not, see <http://www.gnu.org/licenses/>. //
+///////////////////////////////////////////////////////////////////////////
+
+// Traffic capture and replay.
+//
+// Sockets attached to a capture have every frame that sendMessage and
+// receiveMessage move through them appended to the capture file.  The
+// file starts with "RZCAP", a version byte and the start time as int64
+// nanoseconds since the epoch, followed by one record per frame:
+//
+//   [flags][socket id][time][length][bytes]
+//
+// flags is one byte, bit 0 for ZMQ_SNDMORE or a following frame and bit 1
+// for a received frame; the others are LEB128 varints, time counting
+// nanoseconds since the previous record.  Replay sends the captured frames
+// again through the sockets given for each id, on the original schedule
+// scaled by speed, or as fast as possible.
+
+#include <zmq.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "interface.h"
+
+typedef std::chrono::steady_clock Clock;
+
+static const char CAPTURE_MAGIC[] = "RZCAP";
+static const size_t CAPTURE_MAGIC_SIZE = 5;
+static const unsigned char CAPTURE_VERSION = 1;
+static const size_t CAPTURE_HEADER = CAPTURE_MAGIC_SIZE + 1 + sizeof(int64_t);
+static const unsigned char CAPTURE_MORE = 0x01;
+static const unsigned char CAPTURE_RECEIVED = 0x02;
+
+enum captureDirection { CAPTURE_SEND = 1, CAPTURE_RECEIVE = 2, CAPTURE_BOTH = 3 };
+
+struct capture {
+  FILE* file;
+  Clock::time_point last;
+  double frames;
+  double bytes;
+};
+
+struct captureTap {
+  capture* target;
+  uint64_t id;
+  int direction;
+};
+
+// attached sockets, and the files they write to, under capture_mutex;
+// coalescer threads send through the taps too.  The count lets untapped
+// sends skip the mutex.
+static std::mutex capture_mutex;
+static std::map<void*, captureTap> capture_taps;
+static std::atomic<size_t> capture_tap_count(0);
+
+static void writeVarint(FILE* file, uint64_t value) {
+  unsigned char buf[10];
+  size_t n = 0;
+  do {
+    buf[n] = value & 0x7f;
+    value >>= 7;
+    if(value) buf[n] |= 0x80;
+    n++;
+  } while(value);
+  fwrite(buf, 1, n, file);
+}
+
+bool captureTapped(void* socket) {
+  if(capture_tap_count == 0)
+    return false;
+  std::lock_guard<std::mutex> guard(capture_mutex);
+  return capture_taps.count(socket);
+}
+
+void captureFrame(void* socket, const zmq::message_t& msg, bool more, bool received) {
+  if(capture_tap_count == 0)
+    return;
+  std::lock_guard<std::mutex> guard(capture_mutex);
+  std::map<void*, captureTap>::iterator it = capture_taps.find(socket);
+  if(it == capture_taps.end() || !(it->second.direction & (received ? CAPTURE_RECEIVE : CAPTURE_SEND)))
+    return;
+  capture* c = it->second.target;
+  Clock::time_point now = Clock::now();
+  unsigned char flags = (more ? CAPTURE_MORE : 0) | (received ? CAPTURE_RECEIVED : 0);
+  fputc(flags, c->file);
+  writeVarint(c->file, it->second.id);
+  writeVarint(c->file, std::chrono::duration_cast<std::chrono::nanoseconds>(now - c->last).count());
+  writeVarint(c->file, msg.size());
+  fwrite(msg.data(), 1, msg.size(), c->file);
+  c->last = now;
+  c->frames++;
+  c->bytes += msg.size();
+}
+
+void removeCaptureTaps(void* socket) {
+  std::lock_guard<std::mutex> guard(capture_mutex);
+  capture_taps.erase(socket);
+  capture_tap_count = capture_taps.size();
+}
+
+static void closeCapture(capture* c) {
+  std::lock_guard<std::mutex> guard(capture_mutex);
+  std::map<void*, captureTap>::iterator it = capture_taps.begin();
+  while(it != capture_taps.end()) {
+    if(it->second.target == c) {
+      capture_taps.erase(it++);
+    } else {
+      ++it;
+    }
+  }
+  capture_tap_count = capture_taps.size();
+  fclose(c->file);
+  c->file = NULL;
+}
+
+static void captureFinalizer(SEXP capture_) {
+  capture* c = reinterpret_cast<capture*>(R_ExternalPtrAddr(capture_));
+  if(c) {
+    if(c->file) closeCapture(c);
+    delete c;
+    R_ClearExternalPtr(capture_);
+  }
+}
+
+SEXP initCapture(SEXP path_) {
+  SEXP capture_;
+
+  if(TYPEOF(path_) != STRSXP) {
+    REprintf("path must be a string.\n");
+    return R_NilValue;
+  }
+  const char* path = CHAR(STRING_ELT(path_,0));
+  FILE* file = fopen(path, "wb");
+  if(!file) {
+    REprintf("cannot open capture file %s: %s\n", path, strerror(errno));
+    return R_NilValue;
+  }
+  // frames are small and many, so write through a large buffer
+  setvbuf(file, NULL, _IOFBF, 1 << 20);
+  int64_t start = std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::system_clock::now().time_since_epoch()).count();
+  fwrite(CAPTURE_MAGIC, 1, CAPTURE_MAGIC_SIZE, file);
+  fputc(CAPTURE_VERSION, file);
+  fwrite(&start, sizeof(int64_t), 1, file);
+
+  capture* c = new capture;
+  c->file = file;
+  c->last = Clock::now();
+  c->frames = 0;
+  c->bytes = 0;
+  PROTECT(capture_ = R_MakeExternalPtr(reinterpret_cast<void*>(c),rzmq_capture_tag,R_NilValue));
+  R_RegisterCFinalizerEx(capture_, captureFinalizer, TRUE);
+  UNPROTECT(1);
+  return capture_;
+}
+
+SEXP captureSocket(SEXP capture_, SEXP socket_, SEXP id_, SEXP direction_) {
+  SEXP ans;
+
+  int id = Rf_asInteger(id_);
+  if(id == NA_INTEGER || id < 1) {
+    REprintf("id must be a positive integer.\n");
+    return R_NilValue;
+  }
+  if(TYPEOF(direction_) != STRSXP) {
+    REprintf("direction must be \"both\", \"send\" or \"receive\".\n");
+    return R_NilValue;
+  }
+  std::string direction(CHAR(STRING_ELT(direction_,0)));
+  if(direction != "both" && direction != "send" && direction != "receive") {
+    REprintf("direction must be \"both\", \"send\" or \"receive\".\n");
+    return R_NilValue;
+  }
+  capture* c = reinterpret_cast<capture*>(checkExternalPointer(capture_,rzmq_capture_tag));
+  if(!c || !c->file) {
+    REprintf("bad capture object.\n");
+    return R_NilValue;
+  }
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
+  if(!socket) {
+    REprintf("bad socket object.\n");
+    return R_NilValue;
+  }
+
+  captureTap tap = { c, static_cast<uint64_t>(id),
+                     direction == "send" ? CAPTURE_SEND : direction == "receive" ? CAPTURE_RECEIVE : CAPTURE_BOTH };
+  {
+    std::lock_guard<std::mutex> guard(capture_mutex);
+    capture_taps[socket] = tap;
+    capture_tap_count = capture_taps.size();
+  }
+  PROTECT(ans = Rf_allocVector(LGLSXP,1));
+  LOGICAL(ans)[0] = 1;
+  UNPROTECT(1);
+  return ans;
+}
+
+SEXP stopCapture(SEXP capture_) {
+  SEXP ans, names;
+
+  capture* c = reinterpret_cast<capture*>(checkExternalPointer(capture_,rzmq_capture_tag));
+  if(!c) {
+    REprintf("bad capture object.\n");
+    return R_NilValue;
+  }
+  if(c->file) closeCapture(c);
+
+  PROTECT(ans = Rf_allocVector(REALSXP,2));
+  REAL(ans)[0] = c->frames;
+  REAL(ans)[1] = c->bytes;
+  PROTECT(names = Rf_allocVector(STRSXP,2));
+  SET_STRING_ELT(names, 0, Rf_mkChar("frames"));
+  SET_STRING_ELT(names, 1, Rf_mkChar("bytes"));
+  Rf_setAttrib(ans, R_NamesSymbol, names);
+  UNPROTECT(2);
+  return ans;
+}
+
+static bool readVarint(FILE* file, uint64_t* value) {
+  *value = 0;
+  for(int shift = 0; shift < 64; shift += 7) {
+    int byte = fgetc(file);
+    if(byte == EOF)
+      return false;
+    *value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if(!(byte & 0x80))
+      return true;
+  }
+  return false;
+}
+
+// sleeps in slices short enough to notice an interrupt; false if one came
+static bool sleepUntil(Clock::time_point due) {
+  Clock::time_point now;
+  while((now = Clock::now()) < due) {
+    std::this_thread::sleep_for(std::min<Clock::duration>(due - now, std::chrono::milliseconds(100)));
+    if(pending_interrupt())
+      return false;
+  }
+  return true;
+}
+
+SEXP replayCapture(SEXP path_, SEXP sockets_, SEXP speed_, SEXP direction_) {
+  SEXP ans, names;
+
+  if(TYPEOF(path_) != STRSXP) {
+    REprintf("path must be a string.\n");
+    return R_NilValue;
+  }
+  if(TYPEOF(sockets_) != VECSXP) {
+    REprintf("sockets must be a list of sockets.\n");
+    return R_NilValue;
+  }
+  std::vector<zmq::socket_t*> sockets(Rf_xlength(sockets_));
+  for(R_xlen_t i = 0; i < Rf_xlength(sockets_); i++) {
+    if(VECTOR_ELT(sockets_, i) == R_NilValue)
+      continue;
+    sockets[i] = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(VECTOR_ELT(sockets_, i),rzmq_socket_tag));
+    if(!sockets[i]) {
+      REprintf("bad socket object.\n");
+      return R_NilValue;
+    }
+  }
+  double speed = Rf_asReal(speed_);
+  if(ISNAN(speed) || speed < 0) {
+    REprintf("speed must be a non-negative number.\n");
+    return R_NilValue;
+  }
+  if(TYPEOF(direction_) != STRSXP) {
+    REprintf("direction must be \"both\", \"send\" or \"receive\".\n");
+    return R_NilValue;
+  }
+  std::string direction(CHAR(STRING_ELT(direction_,0)));
+  int wanted = direction == "send" ? CAPTURE_SEND : direction == "receive" ? CAPTURE_RECEIVE : CAPTURE_BOTH;
+
+  const char* path = CHAR(STRING_ELT(path_,0));
+  FILE* file = fopen(path, "rb");
+  if(!file) {
+    REprintf("cannot open capture file %s: %s\n", path, strerror(errno));
+    return R_NilValue;
+  }
+  setvbuf(file, NULL, _IOFBF, 1 << 20);
+  char header[CAPTURE_HEADER];
+  if(fread(header, 1, CAPTURE_HEADER, file) != CAPTURE_HEADER ||
+     memcmp(header, CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE) != 0 ||
+     static_cast<unsigned char>(header[CAPTURE_MAGIC_SIZE]) != CAPTURE_VERSION) {
+    REprintf("%s is not a capture file.\n", path);
+    fclose(file);
+    return R_NilValue;
+  }
+
+  // lag is how far each send started behind its scaled schedule; latency
+  // is how long the sends of each message's frames took, per socket so
+  // that interleaved multipart messages are kept apart
+  double frames = 0, bytes = 0, lag_total = 0, lag_max = 0;
+  double messages = 0, latency_total = 0, latency_max = 0;
+  std::vector<double> latency(sockets.size());
+  bool status = true;
+  std::vector<char> buffer;
+  uint64_t captured = 0;
+  Clock::time_point start = Clock::now();
+  while(true) {
+    int flags = fgetc(file);
+    uint64_t id, delta, length;
+    if(flags == EOF)
+      break;
+    if(!readVarint(file, &id) || !readVarint(file, &delta) || !readVarint(file, &length)) {
+      REprintf("truncated capture file.\n");
+      status = false;
+      break;
+    }
+    buffer.resize(length);
+    if(fread(buffer.data(), 1, length, file) != length) {
+      REprintf("truncated capture file.\n");
+      status = false;
+      break;
+    }
+    captured += delta;
+    if(!(wanted & (flags & CAPTURE_RECEIVED ? CAPTURE_RECEIVE : CAPTURE_SEND)) ||
+       id < 1 || id > sockets.size() || !sockets[id - 1])
+      continue;
+
+    if(speed > 0) {
+      Clock::time_point due = start + std::chrono::nanoseconds(static_cast<int64_t>(captured / speed));
+      Clock::time_point now = Clock::now();
+      if(now < due) {
+        if(!sleepUntil(due)) {
+          status = false;
+          break;
+        }
+      } else {
+        double lag = std::chrono::duration_cast<std::chrono::duration<double, std::milli> >(now - due).count();
+        lag_total += lag;
+        if(lag > lag_max) lag_max = lag;
+      }
+    }
+    zmq::message_t msg(length);
+    memcpy(msg.data(), buffer.data(), length);
+    Clock::time_point sent = Clock::now();
+    if(!sendMessage(sockets[id - 1], msg, flags & CAPTURE_MORE ? ZMQ_SNDMORE : 0)) {
+      status = false;
+      break;
+    }
+    latency[id - 1] += std::chrono::duration_cast<std::chrono::duration<double, std::milli> >(Clock::now() - sent).count();
+    if(!(flags & CAPTURE_MORE)) {
+      messages++;
+      latency_total += latency[id - 1];
+      if(latency[id - 1] > latency_max) latency_max = latency[id - 1];
+      latency[id - 1] = 0;
+    }
+    frames++;
+    bytes += length;
+    if(static_cast<uint64_t>(frames) % 1024 == 0 && pending_interrupt()) {
+      status = false;
+      break;
+    }
+  }
+  fclose(file);
+  double seconds = std::chrono::duration_cast<std::chrono::duration<double> >(Clock::now() - start).count();
+
+  const char* fields[] = { "frames", "bytes", "seconds", "frames.per.sec", "bytes.per.sec", "mean.lag", "max.lag",
+                           "messages", "mean.latency", "max.latency" };
+  double values[] = { frames, bytes, seconds, seconds > 0 ? frames / seconds : 0, seconds > 0 ? bytes / seconds : 0,
+                      frames > 0 ? lag_total / frames : 0, lag_max,
+                      messages, messages > 0 ? latency_total / messages : 0, latency_max };
+  PROTECT(ans = Rf_allocVector(REALSXP,10));
+  PROTECT(names = Rf_allocVector(STRSXP,10));
+  for(int i = 0; i < 10; i++) {
+    REAL(ans)[i] = values[i];
+    SET_STRING_ELT(names, i, Rf_mkChar(fields[i]));
+  }
+  Rf_setAttrib(ans, R_NamesSymbol, names);
+  if(!status) {
+    // a partial replay still reports how far it got
+    Rf_setAttrib(ans, Rf_install("incomplete"), Rf_ScalarLogical(TRUE));
+  }
+  UNPROTECT(2);
+  return ans;
+}
@@ -0,0 +1,386 @@
+///////////////////////////////////////////////////////////////////////////
+// Copyright (C) 2011  Whit Armstrong                                    //
+//                                                                       //
+// This program is free software: you can redistribute it and/or modify  //
+// it under the terms of the GNU General Public License as published by  //
+// the Free Software Foundation, either version 3 of the License, or     //
+// (at your option) any later version.                                   //
+//                                                                       //
+// This program is distributed in the hope that it will be useful,       //
+// but WITHOUT ANY WARRANTY; without even the implied warranty of        //
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         //
+// GNU General Public License for more details.                          //
+//                                                                       //
+// You should have received a copy of the GNU General Public License     //
+// along with this program.  If not, see <http://www.gnu.org/licenses/>. //
+///////////////////////////////////////////////////////////////////////////
+
+// Coalescing of small messages into batch frames.
+//
+// A batch frame is "RZM" and a version byte, followed by each message as
+// its LEB128 length and its bytes.  Sends are appended to the open batch,
+// which goes out once it reaches max.bytes, or once its first message has
+// waited max.delay microseconds; a thread started by the first send keeps
+// the latter deadline, so the socket is shared with it under the
+// coalescer's lock.  Whoever holds the lock uses sendFrame and
+// receiveFrame, which make no R calls but still feed a capture, and
+// failures are reported once the lock is released.  The thread never
+// blocks on the socket while holding the lock, and the R thread empties
+// the batch before it blocks in a receive.  On receive, batch
+// frames are handed out one message at a time, without copying the batch,
+// and any other frame is passed through as it is.
+
+#include <zmq.hpp>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+#include "interface.h"
+
+typedef std::chrono::steady_clock Clock;
+
+static const unsigned char COALESCE_MAGIC[] = { 'R', 'Z', 'M', 1 };
+static const size_t COALESCE_MAGIC_SIZE = 4;
+
+struct coalescer {
+  coalescer() : socket(NULL), messages(0), batches(0), bytes(0), fill(0),
+                received_batches(0), split(0), offset(0), stopping(false) {}
+  zmq::socket_t* socket;  // NULL once stopped
+  size_t max_bytes;
+  std::chrono::microseconds max_delay;
+  std::thread thread;
+
+  // guards the socket and the send side
+  std::mutex lock;
+  std::condition_variable wake;
+  std::vector<unsigned char> batch;
+  size_t batch_messages;
+  Clock::time_point opened;
+  double messages, batches, bytes, fill;
+
+  // receive side, R thread only
+  double received_batches, split;
+  zmq::message_t current;
+  size_t offset;
+
+  bool stopping;
+};
+
+// running coalescers, so closing a socket can stop them
+static std::set<coalescer*> active_coalescers;
+
+static void openBatch(coalescer* c) {
+  c->batch.assign(COALESCE_MAGIC, COALESCE_MAGIC + COALESCE_MAGIC_SIZE);
+  c->batch_messages = 0;
+}
+
+// sends the open batch; called with the lock held, so it returns 0 or the
+// errno of the failure instead of reporting it
+static int flushBatch(coalescer* c, int flags) {
+  if(c->batch_messages == 0)
+    return 0;
+  int error;
+  try {
+    zmq::message_t msg(c->batch.size());
+    memcpy(msg.data(), c->batch.data(), c->batch.size());
+    if(!sendFrame(c->socket, msg, flags, &error))
+      return error;
+  } catch(std::exception& e) {
+    return ENOMEM;
+  }
+  c->batches++;
+  c->fill += std::min(1.0, static_cast<double>(c->batch.size()) / c->max_bytes);
+  openBatch(c);
+  return 0;
+}
+
+// true for no error, otherwise records the errno on the R thread
+static bool errorStatus(int error) {
+  if(error == 0)
+    return true;
+  errno = error;
+  reportErrno();
+  return false;
+}
+
+static void flushLoop(coalescer* c) {
+  std::unique_lock<std::mutex> guard(c->lock);
+  int backoff = 1;
+  while(!c->stopping) {
+    if(c->batch_messages == 0) {
+      c->wake.wait(guard);
+      continue;
+    }
+    Clock::time_point due = c->opened + c->max_delay;
+    if(Clock::now() < due) {
+      c->wake.wait_until(guard, due);
+      continue;
+    }
+    int error = flushBatch(c, ZMQ_DONTWAIT);
+    if(error == 0) {
+      backoff = 1;
+      continue;
+    }
+    // anything but a full queue means the socket or its context is going away
+    if(error != EAGAIN)
+      break;
+    c->wake.wait_for(guard, std::chrono::milliseconds(backoff));
+    backoff = std::min(backoff * 2, 100);
+  }
+}
+
+// the flush thread only runs for coalescers that send
+static int startFlushThread(coalescer* c) {
+  if(c->thread.joinable())
+    return 0;
+  try {
+    c->thread = std::thread(flushLoop, c);
+  } catch(std::exception& e) {
+    return EAGAIN;
+  }
+  return 0;
+}
+
+static void stopCoalescer(coalescer* c) {
+  if(!c->socket)
+    return;
+  if(c->thread.joinable()) {
+    {
+      std::lock_guard<std::mutex> guard(c->lock);
+      c->stopping = true;
+    }
+    c->wake.notify_one();
+    c->thread.join();
+  }
+  // a last try for whatever is still open
+  flushBatch(c, ZMQ_DONTWAIT);
+  active_coalescers.erase(c);
+  c->socket = NULL;
+}
+
+static void coalescerFinalizer(SEXP coalescer_) {
+  coalescer* c = reinterpret_cast<coalescer*>(R_ExternalPtrAddr(coalescer_));
+  if(c) {
+    stopCoalescer(c);
+    delete c;
+    R_ClearExternalPtr(coalescer_);
+  }
+}
+
+void stopCoalescers(void* socket) {
+  std::set<coalescer*> coalescers(active_coalescers);
+  for(std::set<coalescer*>::iterator it = coalescers.begin(); it != coalescers.end(); ++it) {
+    if((*it)->socket == socket) stopCoalescer(*it);
+  }
+}
+
+static coalescer* checkCoalescer(SEXP coalescer_) {
+  coalescer* c = reinterpret_cast<coalescer*>(checkExternalPointer(coalescer_,rzmq_coalescer_tag));
+  if(!c || !c->socket) {
+    REprintf("bad coalescer object.\n");
+    return NULL;
+  }
+  return c;
+}
+
+SEXP initCoalescer(SEXP socket_, SEXP max_bytes_, SEXP max_delay_) {
+  SEXP coalescer_;
+
+  double max_bytes = Rf_asReal(max_bytes_);
+  double max_delay = Rf_asReal(max_delay_);
+  if(ISNAN(max_bytes) || max_bytes < 64 || ISNAN(max_delay) || max_delay < 0) {
+    REprintf("max.bytes must be at least 64 and max.delay non-negative.\n");
+    return R_NilValue;
+  }
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
+  if(!socket) {
+    REprintf("bad socket object.\n");
+    return R_NilValue;
+  }
+
+  coalescer* c = new coalescer;
+  c->max_bytes = static_cast<size_t>(max_bytes);
+  c->max_delay = std::chrono::microseconds(static_cast<int64_t>(max_delay));
+  openBatch(c);
+  c->socket = socket;
+  active_coalescers.insert(c);
+
+  // the coalescer keeps its socket alive, and closing the socket stops it
+  PROTECT(coalescer_ = R_MakeExternalPtr(reinterpret_cast<void*>(c),rzmq_coalescer_tag,socket_));
+  R_RegisterCFinalizerEx(coalescer_, coalescerFinalizer, TRUE);
+  UNPROTECT(1);
+  return coalescer_;
+}
+
+SEXP coalesceSend(SEXP coalescer_, SEXP data_) {
+  if(TYPEOF(data_) != RAWSXP) {
+    REprintf("data type must be raw (RAWSXP).\n");
+    return R_NilValue;
+  }
+  coalescer* c = checkCoalescer(coalescer_);
+  if(!c)
+    return R_NilValue;
+
+  size_t length = Rf_xlength(data_);
+  unsigned char prefix[10];
+  size_t n = 0;
+  for(size_t value = length; ; ) {
+    prefix[n] = value & 0x7f;
+    value >>= 7;
+    if(value) prefix[n] |= 0x80;
+    n++;
+    if(!value) break;
+  }
+
+  // without a delay every send is flushed at once, and no thread is needed
+  int error = c->max_delay.count() > 0 ? startFlushThread(c) : 0;
+  if(error == 0) {
+    // no R calls while the lock is held
+    std::lock_guard<std::mutex> guard(c->lock);
+    try {
+      if(c->batch_messages > 0 && c->batch.size() + n + length > c->max_bytes)
+        error = flushBatch(c, 0);
+      if(error == 0) {
+        if(c->batch.capacity() < c->max_bytes)
+          c->batch.reserve(c->max_bytes);
+        if(c->batch_messages == 0) {
+          c->opened = Clock::now();
+          c->wake.notify_one();
+        }
+        c->batch.insert(c->batch.end(), prefix, prefix + n);
+        c->batch.insert(c->batch.end(), RAW(data_), RAW(data_) + length);
+        c->batch_messages++;
+        c->messages++;
+        c->bytes += length;
+        if(c->batch.size() >= c->max_bytes || c->max_delay.count() == 0)
+          error = flushBatch(c, 0);
+      }
+    } catch(std::exception& e) {
+      error = ENOMEM;
+    }
+  }
+  return statusResult(errorStatus(error));
+}
+
+SEXP coalesceFlush(SEXP coalescer_) {
+  coalescer* c = checkCoalescer(coalescer_);
+  if(!c)
+    return R_NilValue;
+  int error;
+  {
+    std::lock_guard<std::mutex> guard(c->lock);
+    error = flushBatch(c, 0);
+  }
+  return statusResult(errorStatus(error));
+}
+
+static bool readLength(const unsigned char* data, size_t size, size_t* pos, size_t* value) {
+  *value = 0;
+  for(int shift = 0; shift < 64 && *pos < size; shift += 7) {
+    unsigned char byte = data[(*pos)++];
+    *value |= static_cast<size_t>(byte & 0x7f) << shift;
+    if(!(byte & 0x80))
+      return *value <= size - *pos;
+  }
+  return false;
+}
+
+SEXP coalesceReceive(SEXP coalescer_, SEXP dont_wait_) {
+  if(TYPEOF(dont_wait_) != LGLSXP) {
+    REprintf("dont_wait type must be logical (LGLSXP).\n");
+    return R_NilValue;
+  }
+  coalescer* c = checkCoalescer(coalescer_);
+  if(!c)
+    return R_NilValue;
+
+  while(true) {
+    const unsigned char* data = reinterpret_cast<const unsigned char*>(c->current.data());
+    size_t length;
+    if(c->offset > 0 && c->offset < c->current.size()) {
+      if(readLength(data, c->current.size(), &c->offset, &length)) {
+        SEXP ans = Rf_allocVector(RAWSXP, length);
+        memcpy(RAW(ans), data + c->offset, length);
+        c->offset += length;
+        c->split++;
+        return ans;
+      }
+      REprintf("malformed batch frame, dropping the rest of it.\n");
+    }
+    c->offset = 0;
+
+    int error = 0;
+    {
+      // the flush thread may be sending on the same socket; a blocking
+      // receive sends the open batch first, so the thread has nothing to
+      // do while the lock is held, and a peer answering it is not kept
+      // waiting on it
+      std::lock_guard<std::mutex> guard(c->lock);
+      if(!LOGICAL(dont_wait_)[0])
+        error = flushBatch(c, 0);
+      if(error == 0)
+        receiveFrame(c->socket, &c->current, LOGICAL(dont_wait_)[0] ? ZMQ_DONTWAIT : 0, &error);
+    }
+    if(!errorStatus(error))
+      return R_NilValue;
+    data = reinterpret_cast<const unsigned char*>(c->current.data());
+    if(c->current.size() >= COALESCE_MAGIC_SIZE && memcmp(data, COALESCE_MAGIC, COALESCE_MAGIC_SIZE) == 0) {
+      c->offset = COALESCE_MAGIC_SIZE;
+      c->received_batches++;
+      continue;
+    }
+    SEXP ans = Rf_allocVector(RAWSXP, c->current.size());
+    memcpy(RAW(ans), data, c->current.size());
+    return ans;
+  }
+}
+
+SEXP coalesceStats(SEXP coalescer_) {
+  SEXP ans, names;
+
+  coalescer* c = reinterpret_cast<coalescer*>(checkExternalPointer(coalescer_,rzmq_coalescer_tag));
+  if(!c) {
+    REprintf("bad coalescer object.\n");
+    return R_NilValue;
+  }
+  double values[7];
+  {
+    std::lock_guard<std::mutex> guard(c->lock);
+    values[0] = c->messages;
+    values[1] = c->batches;
+    values[2] = c->bytes;
+    values[3] = c->batches > 0 ? c->fill / c->batches : 0;
+    values[4] = c->batch_messages;
+  }
+  values[5] = c->received_batches;
+  values[6] = c->split;
+  const char* fields[] = { "messages", "batches", "bytes", "fill.ratio", "pending", "received.batches", "split" };
+  PROTECT(ans = Rf_allocVector(REALSXP,7));
+  PROTECT(names = Rf_allocVector(STRSXP,7));
+  for(int i = 0; i < 7; i++) {
+    REAL(ans)[i] = values[i];
+    SET_STRING_ELT(names, i, Rf_mkChar(fields[i]));
+  }
+  Rf_setAttrib(ans, R_NamesSymbol, names);
+  UNPROTECT(2);
+  return ans;
+}
+
+SEXP stopCoalesce(SEXP coalescer_) {
+  SEXP ans;
+  bool status(false);
+  coalescer* c = reinterpret_cast<coalescer*>(checkExternalPointer(coalescer_,rzmq_coalescer_tag));
+  if(c) {
+    status = c->socket != NULL;
+    stopCoalescer(c);
+  } else {
+    REprintf("bad coalescer object.\n");
+  }
+  PROTECT(ans = Rf_allocVector(LGLSXP,1));
+  LOGICAL(ans)[0] = static_cast<int>(status);
+  UNPROTECT(1);
+  return ans;
+}
@@ -0,0 +1,578 @@
+///////////////////////////////////////////////////////////////////////////
+// Copyright (C) 2011  Whit Armstrong                                    //
+//                                                                       //
+// This program is free software: you can redistribute it and/or modify  //
+// it under the terms of the GNU General Public License as published by  //
+// the Free Software Foundation, either version 3 of the License, or     //
+// (at your option) any later version.                                   //
+//                                                                       //
+// This program is distributed in the hope that it will be useful,       //
+// but WITHOUT ANY WARRANTY; without even the implied warranty of        //
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         //
+// GNU General Public License for more details.                          //
+//                                                                       //
+// You should have received a copy of the GNU General Public License     //
+// along with this program.  If not, see <http://www.gnu.org/licenses/>. //
+///////////////////////////////////////////////////////////////////////////
+
+// Compact encoding of common R objects.
+//
+// A payload is "RZB" and a version byte, followed by one value:
+//
+//   value    tag byte, then the length as a varint unless the scalar bit
+//            is set, the elements, and the names if the named bit is set
+//   tag      low 6 bits the type, 0x80 scalar, 0x40 named
+//   logical, integer   4 bytes per element, little endian
+//   double             8 bytes per element, little endian
+//   raw                1 byte per element
+//   character          one string per element
+//   list               one value per element
+//   factor             4 byte codes, then a varint level count and the levels
+//   data.frame         varint ncol, varint nrow, ncol names, ncol values
+//   string   varint byte count + 1, 0 for NA, then the UTF-8 bytes
+//
+// Varints are unsigned LEB128.  Objects with any other attributes or
+// types are left to R's serialize().
+
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include "interface.h"
+#include <Rversion.h>
+
+static const char COMPACT_MAGIC[3] = { 'R', 'Z', 'B' };
+static const uint8_t COMPACT_VERSION = 1;
+static const int COMPACT_MAX_DEPTH = 512;
+
+enum compactType {
+  CT_NULL = 0,
+  CT_LOGICAL = 1,
+  CT_INTEGER = 2,
+  CT_DOUBLE = 3,
+  CT_STRING = 4,
+  CT_RAW = 5,
+  CT_LIST = 6,
+  CT_FACTOR = 7,
+  CT_FRAME = 8
+};
+
+static const uint8_t CT_SCALAR = 0x80;
+static const uint8_t CT_NAMED = 0x40;
+static const uint8_t CT_TYPE_MASK = 0x3f;
+
+enum compactKind { CK_PLAIN, CK_FACTOR, CK_FRAME, CK_UNSUPPORTED };
+
+static bool littleEndian() {
+  const uint16_t one = 1;
+  return *reinterpret_cast<const uint8_t*>(&one) == 1;
+}
+
+static bool hasClass(SEXP cls, const char* name) {
+  return TYPEOF(cls) == STRSXP && Rf_xlength(cls) == 1 && strcmp(CHAR(STRING_ELT(cls, 0)), name) == 0;
+}
+
+// ANY_ATTRIB is the API test for attributes from R 4.5.0 on
+static bool hasAttributes(SEXP x) {
+#if R_VERSION >= R_Version(4, 5, 0)
+  return ANY_ATTRIB(x);
+#else
+  return ATTRIB(x) != R_NilValue;
+#endif
+}
+
+#if R_VERSION >= R_Version(4, 6, 0)
+static SEXP countAttribute(SEXP tag, SEXP value, void* data) {
+  ++*static_cast<int*>(data);
+  return NULL;
+}
+#endif
+
+// R_mapAttrib walks the attributes through the API from R 4.6.0 on
+static int attributeCount(SEXP x) {
+#if R_VERSION >= R_Version(4, 6, 0)
+  int count = 0;
+  R_mapAttrib(x, countAttribute, &count);
+  return count;
+#else
+  return Rf_length(ATTRIB(x));
+#endif
+}
+
+// row names 1..n, as data.frame() gives them
+static bool defaultRowNames(SEXP row_names) {
+  if(TYPEOF(row_names) != INTSXP)
+    return false;
+  // getAttrib turns compact row names into a compact sequence, which
+  // reading by element does not expand
+  for(R_xlen_t i = 0; i < Rf_xlength(row_names); i++) {
+    if(INTEGER_ELT(row_names, i) != i + 1)
+      return false;
+  }
+  return true;
+}
+
+// what x encodes as, judged from its attributes; data.frames must have
+// default row names
+static compactKind kindOf(SEXP x, SEXP* names, R_xlen_t* nrow) {
+  SEXP cls = R_NilValue, levels = R_NilValue, row_names = R_NilValue;
+  *names = R_NilValue;
+  switch(TYPEOF(x)) {
+  case NILSXP: case LGLSXP: case INTSXP: case REALSXP: case RAWSXP: case STRSXP: case VECSXP:
+    break;
+  default:
+    return CK_UNSUPPORTED;
+  }
+  if(!hasAttributes(x))
+    return CK_PLAIN;
+
+  // any attribute besides these four needs serialize(); names, class and
+  // levels come back as stored, only row names may be allocated
+  *names = Rf_getAttrib(x, R_NamesSymbol);
+  cls = Rf_getAttrib(x, R_ClassSymbol);
+  levels = Rf_getAttrib(x, R_LevelsSymbol);
+  row_names = PROTECT(Rf_getAttrib(x, R_RowNamesSymbol));
+  int known = (*names != R_NilValue) + (cls != R_NilValue) + (levels != R_NilValue) + (row_names != R_NilValue);
+  if(attributeCount(x) != known) {
+    UNPROTECT(1);
+    return CK_UNSUPPORTED;
+  }
+  compactKind kind = CK_UNSUPPORTED;
+  if(*names != R_NilValue && TYPEOF(*names) != STRSXP)
+    kind = CK_UNSUPPORTED;
+  else if(cls == R_NilValue)
+    kind = levels == R_NilValue && row_names == R_NilValue ? CK_PLAIN : CK_UNSUPPORTED;
+  else if(hasClass(cls, "factor") && TYPEOF(x) == INTSXP && TYPEOF(levels) == STRSXP &&
+          *names == R_NilValue && row_names == R_NilValue)
+    kind = CK_FACTOR;
+  else if(hasClass(cls, "data.frame") && TYPEOF(x) == VECSXP && levels == R_NilValue &&
+          *names != R_NilValue && defaultRowNames(row_names)) {
+    *nrow = Rf_xlength(row_names);
+    kind = CK_FRAME;
+  }
+  // names is the attribute of x itself, which keeps it alive
+  UNPROTECT(1);
+  return kind;
+}
+
+static void putVarint(std::string& out, uint64_t value) {
+  while(value >= 0x80) {
+    out.push_back(static_cast<char>(value | 0x80));
+    value >>= 7;
+  }
+  out.push_back(static_cast<char>(value));
+}
+
+static void putTag(std::string& out, uint8_t type, R_xlen_t n, bool named) {
+  uint8_t tag = type | (named ? CT_NAMED : 0);
+  if(n == 1) {
+    out.push_back(static_cast<char>(tag | CT_SCALAR));
+  } else {
+    out.push_back(static_cast<char>(tag));
+    putVarint(out, n);
+  }
+}
+
+static void putStrings(std::string& out, SEXP x) {
+  for(R_xlen_t i = 0; i < Rf_xlength(x); i++) {
+    SEXP s = STRING_ELT(x, i);
+    if(s == NA_STRING) {
+      putVarint(out, 0);
+    } else {
+      const char* c = Rf_translateCharUTF8(s);
+      size_t len = strlen(c);
+      putVarint(out, len + 1);
+      out.append(c, len);
+    }
+  }
+}
+
+// false if x, or anything inside it, needs R's serialize()
+static bool encodeValue(std::string& out, SEXP x, int depth) {
+  SEXP names;
+  R_xlen_t nrow = 0;
+  if(depth > COMPACT_MAX_DEPTH)
+    return false;
+  compactKind kind = kindOf(x, &names, &nrow);
+  if(kind == CK_UNSUPPORTED)
+    return false;
+  R_xlen_t n = Rf_xlength(x);
+  bool named = names != R_NilValue;
+
+  switch(TYPEOF(x)) {
+  case NILSXP:
+    out.push_back(CT_NULL);
+    return true;
+  case LGLSXP:
+    putTag(out, CT_LOGICAL, n, named);
+    out.append(reinterpret_cast<const char*>(LOGICAL(x)), n * sizeof(int));
+    break;
+  case INTSXP:
+    putTag(out, kind == CK_FACTOR ? CT_FACTOR : CT_INTEGER, n, named);
+    out.append(reinterpret_cast<const char*>(INTEGER(x)), n * sizeof(int));
+    if(kind == CK_FACTOR) {
+      SEXP levels = Rf_getAttrib(x, R_LevelsSymbol);
+      putVarint(out, Rf_xlength(levels));
+      putStrings(out, levels);
+    }
+    break;
+  case REALSXP:
+    putTag(out, CT_DOUBLE, n, named);
+    out.append(reinterpret_cast<const char*>(REAL(x)), n * sizeof(double));
+    break;
+  case RAWSXP:
+    putTag(out, CT_RAW, n, named);
+    out.append(reinterpret_cast<const char*>(RAW(x)), n);
+    break;
+  case STRSXP:
+    putTag(out, CT_STRING, n, named);
+    putStrings(out, x);
+    break;
+  case VECSXP:
+    if(kind == CK_FRAME) {
+      out.push_back(CT_FRAME);
+      putVarint(out, n);
+      putVarint(out, nrow);
+      putStrings(out, names);
+      for(R_xlen_t i = 0; i < n; i++) {
+        if(Rf_xlength(VECTOR_ELT(x, i)) != nrow || !encodeValue(out, VECTOR_ELT(x, i), depth + 1))
+          return false;
+      }
+      return true;
+    }
+    putTag(out, CT_LIST, n, named);
+    for(R_xlen_t i = 0; i < n; i++) {
+      if(!encodeValue(out, VECTOR_ELT(x, i), depth + 1))
+        return false;
+    }
+    break;
+  default:
+    return false;
+  }
+  if(named)
+    putStrings(out, names);
+  return true;
+}
+
+struct compactReader {
+  const uint8_t* p;
+  const uint8_t* end;
+};
+
+// reading primitives: they return false on malformed input and never
+// touch R, so checkCompact can run them on any thread
+
+static bool readBytes(compactReader* r, uint64_t n, const uint8_t** data) {
+  if(static_cast<uint64_t>(r->end - r->p) < n)
+    return false;
+  *data = r->p;
+  r->p += n;
+  return true;
+}
+
+static bool readVarint(compactReader* r, uint64_t* value) {
+  *value = 0;
+  for(int shift = 0; shift < 64; shift += 7) {
+    if(r->p == r->end)
+      return false;
+    uint8_t b = *r->p++;
+    *value |= static_cast<uint64_t>(b & 0x7f) << shift;
+    if(!(b & 0x80))
+      return true;
+  }
+  return false;
+}
+
+// a count of elements taking at least width bytes each, checked against
+// what is left so that corrupt input cannot ask for a huge allocation
+static bool readCount(compactReader* r, uint64_t width, R_xlen_t* n) {
+  uint64_t value;
+  if(!readVarint(r, &value) || value > static_cast<uint64_t>(r->end - r->p) / width)
+    return false;
+  *n = static_cast<R_xlen_t>(value);
+  return true;
+}
+
+static bool readLength(compactReader* r, uint8_t tag, uint64_t width, R_xlen_t* n) {
+  if(tag & CT_SCALAR) {
+    *n = 1;
+    return true;
+  }
+  return readCount(r, width, n);
+}
+
+// a string, with *len == -1 for NA
+static bool readString(compactReader* r, const char** s, int* len) {
+  uint64_t value;
+  const uint8_t* data;
+  if(!readVarint(r, &value))
+    return false;
+  if(value == 0) {
+    *len = -1;
+    return true;
+  }
+  if(value - 1 > INT_MAX || !readBytes(r, value - 1, &data))
+    return false;
+  *s = reinterpret_cast<const char*>(data);
+  *len = static_cast<int>(value - 1);
+  return true;
+}
+
+static bool checkCodes(const uint8_t* data, R_xlen_t n, R_xlen_t nlevels) {
+  for(R_xlen_t i = 0; i < n; i++) {
+    int code;
+    memcpy(&code, data + i * sizeof(int), sizeof(int));
+    if(code != NA_INTEGER && (code < 1 || code > nlevels))
+      return false;
+  }
+  return true;
+}
+
+static bool skipStrings(compactReader* r, R_xlen_t n) {
+  for(R_xlen_t i = 0; i < n; i++) {
+    const char* s;
+    int len;
+    if(!readString(r, &s, &len))
+      return false;
+    // R refuses strings with embedded nuls
+    if(len > 0 && memchr(s, 0, len))
+      return false;
+  }
+  return true;
+}
+
+// walks one value without building it, checking everything decodeValue
+// would reject; *length is the value's length
+static bool skipValue(compactReader* r, int depth, R_xlen_t* length) {
+  const uint8_t* data;
+  R_xlen_t n = 0;
+  if(depth > COMPACT_MAX_DEPTH || !readBytes(r, 1, &data))
+    return false;
+  uint8_t tag = *data;
+
+  switch(tag & CT_TYPE_MASK) {
+  case CT_NULL:
+    *length = 0;
+    return true;
+  case CT_LOGICAL:
+  case CT_INTEGER:
+    if(!readLength(r, tag, sizeof(int), &n) || !readBytes(r, n * sizeof(int), &data))
+      return false;
+    break;
+  case CT_DOUBLE:
+    if(!readLength(r, tag, sizeof(double), &n) || !readBytes(r, n * sizeof(double), &data))
+      return false;
+    break;
+  case CT_RAW:
+    if(!readLength(r, tag, 1, &n) || !readBytes(r, n, &data))
+      return false;
+    break;
+  case CT_STRING:
+    if(!readLength(r, tag, 1, &n) || !skipStrings(r, n))
+      return false;
+    break;
+  case CT_LIST:
+    if(!readLength(r, tag, 1, &n))
+      return false;
+    for(R_xlen_t i = 0; i < n; i++) {
+      R_xlen_t element;
+      if(!skipValue(r, depth + 1, &element))
+        return false;
+    }
+    break;
+  case CT_FACTOR: {
+    R_xlen_t nlevels;
+    if(!readLength(r, tag, sizeof(int), &n) || !readBytes(r, n * sizeof(int), &data) ||
+       !readCount(r, 1, &nlevels) || !checkCodes(data, n, nlevels) || !skipStrings(r, nlevels))
+      return false;
+    break;
+  }
+  case CT_FRAME: {
+    uint64_t nrow;
+    if(!readCount(r, 2, &n) || !readVarint(r, &nrow) || nrow > INT_MAX || !skipStrings(r, n))
+      return false;
+    for(R_xlen_t i = 0; i < n; i++) {
+      R_xlen_t column;
+      if(!skipValue(r, depth + 1, &column) || static_cast<uint64_t>(column) != nrow)
+        return false;
+    }
+    *length = n;
+    return true;
+  }
+  default:
+    return false;
+  }
+
+  *length = n;
+  return !(tag & CT_NAMED) || skipStrings(r, n);
+}
+
+static void compactError() {
+  Rf_error("malformed compact message.");
+}
+
+static R_xlen_t getCount(compactReader* r, uint64_t width) {
+  R_xlen_t n;
+  if(!readCount(r, width, &n)) compactError();
+  return n;
+}
+
+static R_xlen_t getLength(compactReader* r, uint8_t tag, uint64_t width) {
+  R_xlen_t n;
+  if(!readLength(r, tag, width, &n)) compactError();
+  return n;
+}
+
+static SEXP getStrings(compactReader* r, R_xlen_t n) {
+  SEXP x = PROTECT(Rf_allocVector(STRSXP, n));
+  for(R_xlen_t i = 0; i < n; i++) {
+    const char* s;
+    int len;
+    if(!readString(r, &s, &len)) compactError();
+    SET_STRING_ELT(x, i, len < 0 ? NA_STRING : Rf_mkCharLenCE(s, len, CE_UTF8));
+  }
+  UNPROTECT(1);
+  return x;
+}
+
+static SEXP getVector(compactReader* r, SEXPTYPE type, R_xlen_t n, size_t width) {
+  const uint8_t* data;
+  if(!readBytes(r, n * width, &data)) compactError();
+  SEXP x = Rf_allocVector(type, n);
+  if(!n)
+    return x;
+  switch(type) {
+  case LGLSXP: memcpy(LOGICAL(x), data, n * width); break;
+  case INTSXP: memcpy(INTEGER(x), data, n * width); break;
+  case REALSXP: memcpy(REAL(x), data, n * width); break;
+  case CPLXSXP: memcpy(COMPLEX(x), data, n * width); break;
+  default: memcpy(RAW(x), data, n * width); break;
+  }
+  return x;
+}
+
+static SEXP decodeValue(compactReader* r, int depth) {
+  SEXP x;
+  const uint8_t* data;
+  if(depth > COMPACT_MAX_DEPTH) {
+    Rf_error("compact message is nested too deeply.");
+  }
+  if(!readBytes(r, 1, &data)) compactError();
+  uint8_t tag = *data;
+
+  switch(tag & CT_TYPE_MASK) {
+  case CT_NULL:
+    return R_NilValue;
+  case CT_LOGICAL:
+    x = PROTECT(getVector(r, LGLSXP, getLength(r, tag, sizeof(int)), sizeof(int)));
+    break;
+  case CT_INTEGER:
+    x = PROTECT(getVector(r, INTSXP, getLength(r, tag, sizeof(int)), sizeof(int)));
+    break;
+  case CT_DOUBLE:
+    x = PROTECT(getVector(r, REALSXP, getLength(r, tag, sizeof(double)), sizeof(double)));
+    break;
+  case CT_RAW:
+    x = PROTECT(getVector(r, RAWSXP, getLength(r, tag, 1), 1));
+    break;
+  case CT_STRING:
+    x = PROTECT(getStrings(r, getLength(r, tag, 1)));
+    break;
+  case CT_LIST: {
+    R_xlen_t n = getLength(r, tag, 1);
+    x = PROTECT(Rf_allocVector(VECSXP, n));
+    for(R_xlen_t i = 0; i < n; i++) {
+      SET_VECTOR_ELT(x, i, decodeValue(r, depth + 1));
+    }
+    break;
+  }
+  case CT_FACTOR: {
+    x = PROTECT(getVector(r, INTSXP, getLength(r, tag, sizeof(int)), sizeof(int)));
+    R_xlen_t nlevels = getCount(r, 1);
+    if(!checkCodes(reinterpret_cast<const uint8_t*>(INTEGER(x)), Rf_xlength(x), nlevels)) compactError();
+    Rf_setAttrib(x, R_LevelsSymbol, getStrings(r, nlevels));
+    Rf_setAttrib(x, R_ClassSymbol, Rf_mkString("factor"));
+    break;
+  }
+  case CT_FRAME: {
+    R_xlen_t ncol = getCount(r, 2);
+    uint64_t nrow;
+    if(!readVarint(r, &nrow) || nrow > INT_MAX) compactError();
+    x = PROTECT(Rf_allocVector(VECSXP, ncol));
+    Rf_setAttrib(x, R_NamesSymbol, getStrings(r, ncol));
+    for(R_xlen_t i = 0; i < ncol; i++) {
+      SEXP column = decodeValue(r, depth + 1);
+      SET_VECTOR_ELT(x, i, column);
+      if(static_cast<uint64_t>(Rf_xlength(column)) != nrow) compactError();
+    }
+    SEXP row_names = PROTECT(Rf_allocVector(INTSXP, nrow ? 2 : 0));
+    if(nrow) {
+      INTEGER(row_names)[0] = NA_INTEGER;
+      INTEGER(row_names)[1] = -static_cast<int>(nrow);
+    }
+    Rf_setAttrib(x, R_RowNamesSymbol, row_names);
+    Rf_setAttrib(x, R_ClassSymbol, Rf_mkString("data.frame"));
+    UNPROTECT(2);
+    return x;
+  }
+  default:
+    Rf_error("unknown compact type %d.", tag & CT_TYPE_MASK);
+  }
+
+  if(tag & CT_NAMED) {
+    Rf_setAttrib(x, R_NamesSymbol, getStrings(r, Rf_xlength(x)));
+  }
+  UNPROTECT(1);
+  return x;
+}
+
+bool isCompact(const unsigned char* data, size_t size) {
+  return size >= 4 && memcmp(data, COMPACT_MAGIC, sizeof(COMPACT_MAGIC)) == 0;
+}
+
+bool checkCompact(const unsigned char* data, size_t size, std::string* error) {
+  R_xlen_t length;
+  if(data[3] != COMPACT_VERSION) {
+    *error = "unsupported compact version.";
+    return false;
+  }
+  if(!littleEndian()) {
+    *error = "compact messages are only supported on little endian platforms.";
+    return false;
+  }
+  compactReader reader = { data + 4, data + size };
+  if(!skipValue(&reader, 0, &length) || reader.p != reader.end) {
+    *error = "malformed compact message.";
+    return false;
+  }
+  return true;
+}
+
+SEXP compactDecode(const unsigned char* data, size_t size) {
+  if(data[3] != COMPACT_VERSION) {
+    Rf_error("unsupported compact version %d.", data[3]);
+  }
+  if(!littleEndian()) {
+    Rf_error("compact messages are only supported on little endian platforms.");
+  }
+  compactReader reader = { data + 4, data + size };
+  SEXP ans = PROTECT(decodeValue(&reader, 0));
+  if(reader.p != reader.end) compactError();
+  UNPROTECT(1);
+  return ans;
+}
+
+// the compact encoding of data_, or NULL if it needs R's serialize()
+SEXP compactSerialize(SEXP data_) {
+  if(!littleEndian())
+    return R_NilValue;
+
+  std::string out(COMPACT_MAGIC, sizeof(COMPACT_MAGIC));
+  out.push_back(static_cast<char>(COMPACT_VERSION));
+  if(!encodeValue(out, data_, 0))
+    return R_NilValue;
+
+  SEXP ans = Rf_allocVector(RAWSXP, out.size());
+  memcpy(RAW(ans), out.data(), out.size());
+  return ans;
+}
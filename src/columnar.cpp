@@ -0,0 +1,493 @@
+///////////////////////////////////////////////////////////////////////////
+// Copyright (C) 2011  Whit Armstrong                                    //
+//                                                                       //
+// This program is free software: you can redistribute it and/or modify  //
+// it under the terms of the GNU General Public License as published by  //
+// the Free Software Foundation, either version 3 of the License, or     //
+// (at your option) any later version.                                   //
+//                                                                       //
+// This program is distributed in the hope that it will be useful,       //
+// but WITHOUT ANY WARRANTY; without even the implied warranty of        //
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         //
+// GNU General Public License for more details.                          //
+//                                                                       //
+// You should have received a copy of the GNU General Public License     //
+// along with this program.  If not, see <http://www.gnu.org/licenses/>. //
+///////////////////////////////////////////////////////////////////////////
+
+// Columnar data.frame transport, readable without R.
+//
+// A table is one multipart message: a header frame, then the frames of
+// each column in order.  All integers are little endian.
+//
+//   header    "RZCF", u8 version, u8 1 (little endian), u16 reserved,
+//             u32 ncol, u32 reserved, u64 nrow, then per column
+//             u8 type, u8 reserved, u16 name length and the UTF-8 name
+//   int32, float64 and logical columns
+//             one frame holding the nrow values; logical NA is INT32_MIN
+//   string and factor columns
+//             one frame of nrow int32 dictionary indices, -1 for NA, then
+//             the dictionary: u32 count, u32 offsets[count + 1] and the
+//             UTF-8 bytes of the entries
+//
+// Numeric and logical columns are sent straight from R's memory and
+// received with a single copy each.
+
+#include <zmq.hpp>
+#include <climits>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "interface.h"
+
+static const char COLUMNAR_MAGIC[4] = { 'R', 'Z', 'C', 'F' };
+static const uint8_t COLUMNAR_VERSION = 1;
+static const size_t COLUMNAR_HEADER_SIZE = 24;
+
+enum columnType {
+  COL_INT32 = 1,
+  COL_FLOAT64 = 2,
+  COL_LOGICAL = 3,
+  COL_STRING = 4,
+  COL_FACTOR = 5
+};
+
+static bool littleEndian() {
+  const uint16_t one = 1;
+  return *reinterpret_cast<const uint8_t*>(&one) == 1;
+}
+
+static void freeBuffer(void* data, void* hint) {
+  free(data);
+}
+
+template <typename T>
+static void putValue(std::string& out, T value) {
+  out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+// column type of x, or 0 if it cannot be sent
+static int columnTypeOf(SEXP x) {
+  switch(TYPEOF(x)) {
+  case INTSXP:
+    return Rf_isFactor(x) ? COL_FACTOR : COL_INT32;
+  case REALSXP:
+    return COL_FLOAT64;
+  case LGLSXP:
+    return COL_LOGICAL;
+  case STRSXP:
+    return COL_STRING;
+  default:
+    return 0;
+  }
+}
+
+// storage of a numeric column, through the accessor of its type
+static void* columnData(SEXP x, int type) {
+  switch(type) {
+  case COL_FLOAT64:
+    return REAL(x);
+  case COL_LOGICAL:
+    return LOGICAL(x);
+  default:
+    return INTEGER(x);
+  }
+}
+
+// dictionary of a string or factor column, translated to UTF-8; for a
+// character vector, seen maps each distinct CHARSXP to its entry
+struct stringDictionary {
+  std::vector<std::string> entries;
+  std::unordered_map<SEXP, int32_t> seen;
+};
+
+// dictionary frame of the given strings
+static zmq::message_t* dictionaryFrame(const std::vector<std::string>& entries) {
+  size_t bytes = 0;
+  for(size_t i = 0; i < entries.size(); i++) bytes += entries[i].size();
+  size_t size = sizeof(uint32_t) * (entries.size() + 2) + bytes;
+  char* buf = reinterpret_cast<char*>(malloc(size ? size : 1));
+  uint32_t* header = reinterpret_cast<uint32_t*>(buf);
+  char* text = buf + sizeof(uint32_t) * (entries.size() + 2);
+  header[0] = entries.size();
+  uint32_t offset = 0;
+  for(size_t i = 0; i < entries.size(); i++) {
+    header[i + 1] = offset;
+    memcpy(text + offset, entries[i].data(), entries[i].size());
+    offset += entries[i].size();
+  }
+  header[entries.size() + 1] = offset;
+  return new zmq::message_t(buf, size, freeBuffer, NULL);
+}
+
+// Translating to UTF-8 can raise an R error, so every name and string is
+// translated before any column is lent or any frame allocated, and under
+// R_ToplevelExec, so the error cannot unwind through the C++ objects.
+struct columnarStrings {
+  SEXP data;
+  std::vector<std::string> names;
+  std::vector<stringDictionary> dictionaries;
+};
+
+static void translateStrings(void* data) {
+  columnarStrings* strings = reinterpret_cast<columnarStrings*>(data);
+  SEXP names = Rf_getAttrib(strings->data, R_NamesSymbol);
+  for(R_xlen_t j = 0; j < Rf_xlength(strings->data); j++) {
+    strings->names[j] = names == R_NilValue ? "" : Rf_translateCharUTF8(STRING_ELT(names, j));
+    SEXP column = VECTOR_ELT(strings->data, j);
+    int type = columnTypeOf(column);
+    stringDictionary& dictionary = strings->dictionaries[j];
+    if(type == COL_FACTOR) {
+      SEXP levels = Rf_getAttrib(column, R_LevelsSymbol);
+      for(R_xlen_t i = 0; i < Rf_xlength(levels); i++) {
+        dictionary.entries.push_back(Rf_translateCharUTF8(STRING_ELT(levels, i)));
+      }
+    } else if(type == COL_STRING) {
+      // R caches strings, so equal strings are mostly the same CHARSXP
+      for(R_xlen_t i = 0; i < Rf_xlength(column); i++) {
+        SEXP s = STRING_ELT(column, i);
+        if(s != NA_STRING && dictionary.seen.find(s) == dictionary.seen.end()) {
+          dictionary.entries.push_back(Rf_translateCharUTF8(s));
+          dictionary.seen[s] = static_cast<int32_t>(dictionary.entries.size() - 1);
+        }
+      }
+    }
+  }
+}
+
+// index and dictionary frames of a character vector or factor
+static void encodeStrings(SEXP x, int type, const stringDictionary& dictionary, std::vector<zmq::message_t*>& frames) {
+  R_xlen_t n = Rf_xlength(x);
+  int32_t* indices = reinterpret_cast<int32_t*>(malloc(n ? n * sizeof(int32_t) : 1));
+
+  if(type == COL_FACTOR) {
+    const int* codes = INTEGER(x);
+    for(R_xlen_t i = 0; i < n; i++) {
+      indices[i] = codes[i] == NA_INTEGER ? -1 : codes[i] - 1;
+    }
+  } else {
+    for(R_xlen_t i = 0; i < n; i++) {
+      SEXP s = STRING_ELT(x, i);
+      indices[i] = s == NA_STRING ? -1 : dictionary.seen.find(s)->second;
+    }
+  }
+
+  frames.push_back(new zmq::message_t(indices, n * sizeof(int32_t), freeBuffer, NULL));
+  frames.push_back(dictionaryFrame(dictionary.entries));
+}
+
+SEXP sendDataFrame(SEXP socket_, SEXP data_, SEXP send_more_) {
+  if(TYPEOF(data_) != VECSXP || !Rf_inherits(data_, "data.frame")) {
+    REprintf("data must be a data.frame.\n");
+    return R_NilValue;
+  }
+
+  if(TYPEOF(send_more_) != LGLSXP) {
+    REprintf("send.more type must be logical (LGLSXP).\n");
+    return R_NilValue;
+  }
+
+  if(!littleEndian()) {
+    REprintf("columnar frames are only supported on little endian platforms.\n");
+    return R_NilValue;
+  }
+
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
+  if(!socket) {
+    REprintf("bad socket object.\n");
+    return R_NilValue;
+  }
+
+  R_xlen_t ncol = Rf_xlength(data_);
+  R_xlen_t nrow = ncol ? Rf_xlength(VECTOR_ELT(data_, 0)) : Rf_xlength(Rf_getAttrib(data_, R_RowNamesSymbol));
+  for(R_xlen_t j = 0; j < ncol; j++) {
+    SEXP column = VECTOR_ELT(data_, j);
+    if(!columnTypeOf(column)) {
+      REprintf("column %d has an unsupported type.\n", static_cast<int>(j + 1));
+      return R_NilValue;
+    }
+    if(Rf_xlength(column) != nrow) {
+      REprintf("column %d has the wrong length.\n", static_cast<int>(j + 1));
+      return R_NilValue;
+    }
+  }
+
+  columnarStrings strings;
+  strings.data = data_;
+  strings.names.resize(ncol);
+  strings.dictionaries.resize(ncol);
+  if(!R_ToplevelExec(translateStrings, &strings)) {
+    REprintf("cannot translate the names or strings to UTF-8.\n");
+    return R_NilValue;
+  }
+
+  std::string header(COLUMNAR_MAGIC, sizeof(COLUMNAR_MAGIC));
+  putValue<uint8_t>(header, COLUMNAR_VERSION);
+  putValue<uint8_t>(header, 1);
+  putValue<uint16_t>(header, 0);
+  putValue<uint32_t>(header, ncol);
+  putValue<uint32_t>(header, 0);
+  putValue<uint64_t>(header, nrow);
+  for(R_xlen_t j = 0; j < ncol; j++) {
+    const std::string& name = strings.names[j];
+    size_t name_len = std::min(name.size(), static_cast<size_t>(UINT16_MAX));
+    putValue<uint8_t>(header, columnTypeOf(VECTOR_ELT(data_, j)));
+    putValue<uint8_t>(header, 0);
+    putValue<uint16_t>(header, name_len);
+    header.append(name.data(), name_len);
+  }
+
+  std::vector<zmq::message_t*> frames;
+  zmq::message_t* header_frame = new zmq::message_t(header.size());
+  memcpy(header_frame->data(), header.data(), header.size());
+  frames.push_back(header_frame);
+  for(R_xlen_t j = 0; j < ncol; j++) {
+    SEXP column = VECTOR_ELT(data_, j);
+    int type = columnTypeOf(column);
+    if(type == COL_STRING || type == COL_FACTOR) {
+      encodeStrings(column, type, strings.dictionaries[j], frames);
+    } else {
+      size_t width = type == COL_FLOAT64 ? sizeof(double) : sizeof(int);
+      lendVector(column);
+      frames.push_back(new zmq::message_t(columnData(column, type), nrow * width, returnVector, column));
+    }
+  }
+
+  // multipart messages are atomic, so only the first frame can fail with EAGAIN
+  bool status(true);
+  for(size_t i = 0; i < frames.size() && status; i++) {
+    bool last = i + 1 == frames.size();
+    status = sendMessage(socket, *frames[i], last ? (LOGICAL(send_more_)[0] ? ZMQ_SNDMORE : 0) : ZMQ_SNDMORE);
+  }
+  for(size_t i = 0; i < frames.size(); i++) delete frames[i];
+  return statusResult(status);
+}
+
+columnarTable::~columnarTable() {
+  for(size_t i = 0; i < frames.size(); i++) delete frames[i];
+}
+
+bool isColumnar(const unsigned char* data, size_t size) {
+  return size >= sizeof(COLUMNAR_MAGIC) && memcmp(data, COLUMNAR_MAGIC, sizeof(COLUMNAR_MAGIC)) == 0;
+}
+
+static void columnarTableFinalizer(SEXP table_) {
+  columnarTable* table = reinterpret_cast<columnarTable*>(R_ExternalPtrAddr(table_));
+  if(table) {
+    delete table;
+    R_ClearExternalPtr(table_);
+  }
+}
+
+// checks the frames of a table and indexes its columns without touching R
+bool parseColumnar(columnarTable* table, std::string* error) {
+  std::vector<zmq::message_t*>& frames = table->frames;
+  if(frames.empty() || frames[0]->size() < COLUMNAR_HEADER_SIZE ||
+     !isColumnar(reinterpret_cast<const unsigned char*>(frames[0]->data()), frames[0]->size())) {
+    *error = "not a columnar message.";
+    return false;
+  }
+  const char* header = reinterpret_cast<const char*>(frames[0]->data());
+  const char* end = header + frames[0]->size();
+  if(static_cast<uint8_t>(header[4]) != COLUMNAR_VERSION || header[5] != 1) {
+    *error = "unsupported columnar version.";
+    return false;
+  }
+  uint32_t ncol;
+  memcpy(&ncol, header + 8, sizeof(uint32_t));
+  memcpy(&table->nrow, header + 16, sizeof(uint64_t));
+  if(table->nrow > static_cast<uint64_t>(INT_MAX)) {
+    *error = "too many rows.";
+    return false;
+  }
+
+  const char* p = header + COLUMNAR_HEADER_SIZE;
+  size_t frame = 1;
+  for(uint32_t j = 0; j < ncol; j++) {
+    columnarColumn column;
+    uint16_t name_len;
+    if(end - p < 4) {
+      *error = "truncated columnar header.";
+      return false;
+    }
+    column.type = static_cast<uint8_t>(p[0]);
+    memcpy(&name_len, p + 2, sizeof(uint16_t));
+    p += 4;
+    if(end - p < name_len) {
+      *error = "truncated columnar header.";
+      return false;
+    }
+    column.name.assign(p, name_len);
+    p += name_len;
+
+    size_t width = column.type == COL_FLOAT64 ? sizeof(double) : sizeof(int32_t);
+    if(column.type < COL_INT32 || column.type > COL_FACTOR) {
+      *error = "unknown column type.";
+      return false;
+    }
+    if(frame >= frames.size() || frames[frame]->size() != table->nrow * width) {
+      *error = "column frame has the wrong size.";
+      return false;
+    }
+    column.values = reinterpret_cast<const char*>(frames[frame++]->data());
+
+    column.count = 0;
+    if(column.type == COL_STRING || column.type == COL_FACTOR) {
+      if(frame >= frames.size() || frames[frame]->size() < 2 * sizeof(uint32_t)) {
+        *error = "missing dictionary frame.";
+        return false;
+      }
+      const char* dict = reinterpret_cast<const char*>(frames[frame]->data());
+      size_t dict_size = frames[frame++]->size();
+      memcpy(&column.count, dict, sizeof(uint32_t));
+      size_t text_start = sizeof(uint32_t) * (static_cast<size_t>(column.count) + 2);
+      if(dict_size < text_start) {
+        *error = "truncated dictionary.";
+        return false;
+      }
+      column.offsets = reinterpret_cast<const uint32_t*>(dict + sizeof(uint32_t));
+      column.text = dict + text_start;
+      for(uint32_t k = 0; k < column.count; k++) {
+        if(column.offsets[k] > column.offsets[k + 1]) {
+          *error = "bad dictionary offsets.";
+          return false;
+        }
+      }
+      if(column.offsets[column.count] > dict_size - text_start) {
+        *error = "truncated dictionary.";
+        return false;
+      }
+      const int32_t* indices = reinterpret_cast<const int32_t*>(column.values);
+      for(uint64_t i = 0; i < table->nrow; i++) {
+        if(indices[i] < -1 || indices[i] >= static_cast<int64_t>(column.count)) {
+          *error = "dictionary index out of range.";
+          return false;
+        }
+      }
+    }
+    table->columns.push_back(column);
+  }
+  if(frame != frames.size()) {
+    *error = "unexpected frames after the last column.";
+    return false;
+  }
+  return true;
+}
+
+// builds the data.frame; only called on tables that passed parseColumnar
+SEXP materializeColumnar(const columnarTable& table) {
+  R_xlen_t nrow = static_cast<R_xlen_t>(table.nrow);
+  R_xlen_t ncol = table.columns.size();
+  SEXP ans = PROTECT(Rf_allocVector(VECSXP, ncol));
+  SEXP names = PROTECT(Rf_allocVector(STRSXP, ncol));
+
+  for(R_xlen_t j = 0; j < ncol; j++) {
+    const columnarColumn& column = table.columns[j];
+    SET_STRING_ELT(names, j, Rf_mkCharLenCE(column.name.data(), column.name.size(), CE_UTF8));
+    SEXP x;
+    switch(column.type) {
+    case COL_INT32:
+    case COL_LOGICAL:
+      x = Rf_allocVector(column.type == COL_INT32 ? INTSXP : LGLSXP, nrow);
+      SET_VECTOR_ELT(ans, j, x);
+      memcpy(columnData(x, column.type), column.values, nrow * sizeof(int));
+      break;
+    case COL_FLOAT64:
+      x = Rf_allocVector(REALSXP, nrow);
+      SET_VECTOR_ELT(ans, j, x);
+      memcpy(REAL(x), column.values, nrow * sizeof(double));
+      break;
+    default: {
+      SEXP dictionary = PROTECT(Rf_allocVector(STRSXP, column.count));
+      for(uint32_t k = 0; k < column.count; k++) {
+        SET_STRING_ELT(dictionary, k, Rf_mkCharLenCE(column.text + column.offsets[k],
+                                                     column.offsets[k + 1] - column.offsets[k], CE_UTF8));
+      }
+      const int32_t* indices = reinterpret_cast<const int32_t*>(column.values);
+      if(column.type == COL_FACTOR) {
+        x = Rf_allocVector(INTSXP, nrow);
+        SET_VECTOR_ELT(ans, j, x);
+        int* codes = INTEGER(x);
+        for(R_xlen_t i = 0; i < nrow; i++) {
+          codes[i] = indices[i] < 0 ? NA_INTEGER : indices[i] + 1;
+        }
+        Rf_setAttrib(x, R_LevelsSymbol, dictionary);
+        Rf_setAttrib(x, R_ClassSymbol, Rf_mkString("factor"));
+      } else {
+        x = Rf_allocVector(STRSXP, nrow);
+        SET_VECTOR_ELT(ans, j, x);
+        for(R_xlen_t i = 0; i < nrow; i++) {
+          SET_STRING_ELT(x, i, indices[i] < 0 ? NA_STRING : STRING_ELT(dictionary, indices[i]));
+        }
+      }
+      UNPROTECT(1);
+    }
+    }
+  }
+
+  Rf_setAttrib(ans, R_NamesSymbol, names);
+  // compact row names, as .set_row_names() makes them
+  SEXP row_names = PROTECT(Rf_allocVector(INTSXP, nrow ? 2 : 0));
+  if(nrow) {
+    INTEGER(row_names)[0] = NA_INTEGER;
+    INTEGER(row_names)[1] = -static_cast<int>(nrow);
+  }
+  Rf_setAttrib(ans, R_RowNamesSymbol, row_names);
+  Rf_setAttrib(ans, R_ClassSymbol, Rf_mkString("data.frame"));
+  UNPROTECT(3);
+  return ans;
+}
+
+// receives all frames of one message into table
+static bool receiveColumnar(zmq::socket_t* socket, int flags, columnarTable* table) {
+  zmq::message_t* msg = new zmq::message_t;
+  table->frames.push_back(msg);
+  if(!receiveMessage(socket, msg, flags))
+    return false;
+  // multipart messages are atomic, so the rest is already here
+  while(msg->more()) {
+    msg = new zmq::message_t;
+    table->frames.push_back(msg);
+    if(!receiveMessage(socket, msg, 0))
+      return false;
+  }
+  return true;
+}
+
+SEXP receiveDataFrame(SEXP socket_, SEXP dont_wait_) {
+  if(TYPEOF(dont_wait_) != LGLSXP) {
+    REprintf("dont_wait type must be logical (LGLSXP).\n");
+    return R_NilValue;
+  }
+
+  if(!littleEndian()) {
+    REprintf("columnar frames are only supported on little endian platforms.\n");
+    return R_NilValue;
+  }
+
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
+  if(!socket) {
+    REprintf("bad socket object.\n");
+    return R_NilValue;
+  }
+
+  columnarTable* table = new columnarTable;
+  std::string error;
+  if(!receiveColumnar(socket, LOGICAL(dont_wait_)[0] ? ZMQ_DONTWAIT : 0, table)) {
+    delete table;
+    return R_NilValue;
+  }
+  if(!parseColumnar(table, &error)) {
+    delete table;
+    REprintf("%s\n", error.c_str());
+    return R_NilValue;
+  }
+  // an allocation error while building the data.frame leaves the table to
+  // the garbage collector
+  SEXP table_ = PROTECT(R_MakeExternalPtr(table, R_NilValue, R_NilValue));
+  R_RegisterCFinalizerEx(table_, columnarTableFinalizer, TRUE);
+  SEXP ans = materializeColumnar(*table);
+  columnarTableFinalizer(table_);
+  UNPROTECT(1);
+  return ans;
+}
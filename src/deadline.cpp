@@ -0,0 +1,185 @@
+///////////////////////////////////////////////////////////////////////////
+// Copyright (C) 2011  Whit Armstrong                                    //
+//                                                                       //
+// This program is free software: you can redistribute it and/or modify  //
+// it under the terms of the GNU General Public License as published by  //
+// the Free Software Foundation, either version 3 of the License, or     //
+// (at your option) any later version.                                   //
+//                                                                       //
+// This program is distributed in the hope that it will be useful,       //
+// but WITHOUT ANY WARRANTY; without even the implied warranty of        //
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         //
+// GNU General Public License for more details.                          //
+//                                                                       //
+// You should have received a copy of the GNU General Public License     //
+// along with this program.  If not, see <http://www.gnu.org/licenses/>. //
+///////////////////////////////////////////////////////////////////////////
+
+// Deadlines stamped on messages, so stale ones are dropped before R.
+//
+// A stamped message starts with a 12 byte frame: "RZD", the clock, and
+// the deadline in microseconds as a little endian int64.  The epoch clock
+// works across hosts whose clocks agree; the monotonic clock only works
+// between processes on one host, but does not jump.  On receive, expired
+// messages are read and dropped part by part without ever becoming R
+// objects, and the counts are kept per socket until it is closed.
+
+#include <zmq.hpp>
+#include <chrono>
+#include <map>
+#include <string>
+#include "interface.h"
+
+static const unsigned char DEADLINE_MAGIC[] = { 'R', 'Z', 'D' };
+static const size_t DEADLINE_FRAME = sizeof(DEADLINE_MAGIC) + 1 + sizeof(int64_t);
+
+enum deadlineClock { DEADLINE_EPOCH = 0, DEADLINE_MONOTONIC = 1 };
+
+struct deadlineCounts {
+  deadlineCounts() : fresh(0), expired(0), unstamped(0) {}
+  double fresh, expired, unstamped;
+};
+
+static std::map<void*, deadlineCounts> deadline_counts;
+
+void removeDeadlineCounts(void* socket) {
+  deadline_counts.erase(socket);
+}
+
+static int64_t clockMicros(int clock) {
+  if(clock == DEADLINE_MONOTONIC)
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+SEXP sendDeadline(SEXP socket_, SEXP data_, SEXP ttl_, SEXP clock_, SEXP send_more_) {
+  if(TYPEOF(data_) != RAWSXP) {
+    REprintf("data type must be raw (RAWSXP).\n");
+    return R_NilValue;
+  }
+  double ttl = Rf_asReal(ttl_);
+  if(ISNAN(ttl) || ttl < 0) {
+    REprintf("ttl must be a non-negative number of milliseconds.\n");
+    return R_NilValue;
+  }
+  if(TYPEOF(clock_) != STRSXP || LENGTH(clock_) < 1) {
+    REprintf("clock must be a string.\n");
+    return R_NilValue;
+  }
+  std::string clock(CHAR(STRING_ELT(clock_,0)));
+  if(clock != "epoch" && clock != "monotonic") {
+    REprintf("clock must be epoch or monotonic.\n");
+    return R_NilValue;
+  }
+  if(TYPEOF(send_more_) != LGLSXP) {
+    REprintf("send.more type must be logical (LGLSXP).\n");
+    return R_NilValue;
+  }
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
+  if(!socket) {
+    REprintf("bad socket object.\n");
+    return R_NilValue;
+  }
+
+  int which = clock == "monotonic" ? DEADLINE_MONOTONIC : DEADLINE_EPOCH;
+  uint64_t deadline = static_cast<uint64_t>(clockMicros(which) + static_cast<int64_t>(ttl * 1000));
+  zmq::message_t header(DEADLINE_FRAME);
+  unsigned char* bytes = reinterpret_cast<unsigned char*>(header.data());
+  memcpy(bytes, DEADLINE_MAGIC, sizeof(DEADLINE_MAGIC));
+  bytes[sizeof(DEADLINE_MAGIC)] = which;
+  for(size_t i = 0; i < sizeof(int64_t); i++)
+    bytes[sizeof(DEADLINE_MAGIC) + 1 + i] = (deadline >> (8 * i)) & 0xff;
+
+  zmq::message_t msg(Rf_xlength(data_));
+  memcpy(msg.data(), RAW(data_), Rf_xlength(data_));
+
+  // multipart messages are atomic, so only the header can fail with EAGAIN
+  bool status = sendMessage(socket, header, ZMQ_SNDMORE) &&
+    sendMessage(socket, msg, LOGICAL(send_more_)[0] ? ZMQ_SNDMORE : 0);
+  return statusResult(status);
+}
+
+// the deadline of a header frame, or false for any other frame
+static bool readDeadline(const zmq::message_t& msg, int* clock, int64_t* deadline) {
+  const unsigned char* bytes = reinterpret_cast<const unsigned char*>(msg.data());
+  if(msg.size() != DEADLINE_FRAME || !msg.more() || memcmp(bytes, DEADLINE_MAGIC, sizeof(DEADLINE_MAGIC)) != 0)
+    return false;
+  *clock = bytes[sizeof(DEADLINE_MAGIC)];
+  if(*clock != DEADLINE_EPOCH && *clock != DEADLINE_MONOTONIC)
+    return false;
+  uint64_t value = 0;
+  for(size_t i = 0; i < sizeof(int64_t); i++)
+    value |= static_cast<uint64_t>(bytes[sizeof(DEADLINE_MAGIC) + 1 + i]) << (8 * i);
+  *deadline = static_cast<int64_t>(value);
+  return true;
+}
+
+SEXP receiveFresh(SEXP socket_, SEXP dont_wait_) {
+  if(TYPEOF(dont_wait_) != LGLSXP) {
+    REprintf("dont_wait type must be logical (LGLSXP).\n");
+    return R_NilValue;
+  }
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
+  if(!socket) {
+    REprintf("bad socket object.\n");
+    return R_NilValue;
+  }
+
+  int flags = LOGICAL(dont_wait_)[0] ? ZMQ_DONTWAIT : 0;
+  deadlineCounts& counts = deadline_counts[socket];
+  zmq::message_t msg;
+  while(true) {
+    if(!receiveMessage(socket, &msg, flags))
+      return R_NilValue;
+    int clock;
+    int64_t deadline;
+    if(!readDeadline(msg, &clock, &deadline)) {
+      counts.unstamped++;
+      break;
+    }
+    bool expired = clockMicros(clock) > deadline;
+    // the rest of the message is already here
+    if(!receiveMessage(socket, &msg, 0))
+      return R_NilValue;
+    if(!expired) {
+      counts.fresh++;
+      break;
+    }
+    counts.expired++;
+    while(msg.more()) {
+      if(!receiveMessage(socket, &msg, 0))
+        return R_NilValue;
+    }
+  }
+
+  SEXP ans = Rf_allocVector(RAWSXP,msg.size());
+  memcpy(RAW(ans),msg.data(),msg.size());
+  return ans;
+}
+
+SEXP deadlineStats(SEXP socket_) {
+  SEXP ans, names;
+
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
+  if(!socket) {
+    REprintf("bad socket object.\n");
+    return R_NilValue;
+  }
+  deadlineCounts counts;
+  std::map<void*, deadlineCounts>::iterator it = deadline_counts.find(socket);
+  if(it != deadline_counts.end()) counts = it->second;
+
+  PROTECT(ans = Rf_allocVector(REALSXP,3));
+  PROTECT(names = Rf_allocVector(STRSXP,3));
+  REAL(ans)[0] = counts.fresh;
+  REAL(ans)[1] = counts.expired;
+  REAL(ans)[2] = counts.unstamped;
+  SET_STRING_ELT(names, 0, Rf_mkChar("fresh"));
+  SET_STRING_ELT(names, 1, Rf_mkChar("expired"));
+  SET_STRING_ELT(names, 2, Rf_mkChar("unstamped"));
+  Rf_setAttrib(ans, R_NamesSymbol, names);
+  UNPROTECT(2);
+  return ans;
+}
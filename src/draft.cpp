@@ -0,0 +1,153 @@
+///////////////////////////////////////////////////////////////////////////
+// Copyright (C) 2011  Whit Armstrong                                    //
+//                                                                       //
+// This program is free software: you can redistribute it and/or modify  //
+// it under the terms of the GNU General Public License as published by  //
+// the Free Software Foundation, either version 3 of the License, or     //
+// (at your option) any later version.                                   //
+//                                                                       //
+// This program is distributed in the hope that it will be useful,       //
+// but WITHOUT ANY WARRANTY; without even the implied warranty of        //
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         //
+// GNU General Public License for more details.                          //
+//                                                                       //
+// You should have received a copy of the GNU General Public License     //
+// along with this program.  If not, see <http://www.gnu.org/licenses/>. //
+///////////////////////////////////////////////////////////////////////////
+
+// Groups and routing ids of the draft socket types.
+//
+// SERVER tags each received message with the routing id of its CLIENT and
+// needs it again to reply; RADIO sends to a group and DISH receives the
+// groups it joined.  Both live on the message itself rather than in
+// frames, so these calls use libzmq's message API directly.  Everything
+// here needs a libzmq built with the draft API, which configure detects.
+
+#include <zmq.hpp>
+#include "interface.h"
+
+#ifdef ZMQ_BUILD_DRAFT_API
+static SEXP setGroup(SEXP socket_, SEXP group_, bool join) {
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
+  if(!socket) { REprintf("bad socket object.\n");return R_NilValue; }
+  if(TYPEOF(group_)!=STRSXP) { REprintf("group must be a string.\n");return R_NilValue; }
+  const char* group = CHAR(STRING_ELT(group_,0));
+  int rc = join ? zmq_join(static_cast<void*>(*socket), group) : zmq_leave(static_cast<void*>(*socket), group);
+  if(rc != 0)
+    reportErrno();
+  return statusResult(rc == 0);
+}
+#else
+static void draftUnavailable() {
+  REprintf("draft socket API not available, libzmq must be built with drafts enabled.\n");
+}
+#endif
+
+SEXP joinGroup(SEXP socket_, SEXP group_) {
+#ifdef ZMQ_BUILD_DRAFT_API
+  return setGroup(socket_, group_, true);
+#else
+  draftUnavailable();
+  return R_NilValue;
+#endif
+}
+
+SEXP leaveGroup(SEXP socket_, SEXP group_) {
+#ifdef ZMQ_BUILD_DRAFT_API
+  return setGroup(socket_, group_, false);
+#else
+  draftUnavailable();
+  return R_NilValue;
+#endif
+}
+
+SEXP sendRouted(SEXP socket_, SEXP data_, SEXP routing_id_, SEXP group_) {
+#ifdef ZMQ_BUILD_DRAFT_API
+  if(TYPEOF(data_) != RAWSXP) {
+    REprintf("data type must be raw (RAWSXP).\n");
+    return R_NilValue;
+  }
+  if(routing_id_ != R_NilValue && !Rf_isNumeric(routing_id_)) {
+    REprintf("routing id must be a number.\n");
+    return R_NilValue;
+  }
+  if(group_ != R_NilValue && TYPEOF(group_) != STRSXP) {
+    REprintf("group must be a string.\n");
+    return R_NilValue;
+  }
+
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
+  if(!socket) {
+    REprintf("bad socket object.\n");
+    return R_NilValue;
+  }
+
+  zmq_msg_t msg;
+  if(zmq_msg_init_size(&msg, Rf_xlength(data_)) != 0) {
+    reportErrno();
+    return statusResult(false);
+  }
+  memcpy(zmq_msg_data(&msg), RAW(data_), Rf_xlength(data_));
+  bool status = (routing_id_ == R_NilValue ||
+                 zmq_msg_set_routing_id(&msg, static_cast<uint32_t>(Rf_asReal(routing_id_))) == 0) &&
+    (group_ == R_NilValue || zmq_msg_set_group(&msg, CHAR(STRING_ELT(group_,0))) == 0) &&
+    zmq_msg_send(&msg, static_cast<void*>(*socket), 0) >= 0;
+  if(!status) {
+    reportErrno();
+    // a sent message belongs to libzmq, an unsent one is still ours
+    zmq_msg_close(&msg);
+  }
+  return statusResult(status);
+#else
+  draftUnavailable();
+  return R_NilValue;
+#endif
+}
+
+SEXP receiveRouted(SEXP socket_, SEXP dont_wait_) {
+#ifdef ZMQ_BUILD_DRAFT_API
+  if(TYPEOF(dont_wait_) != LGLSXP) {
+    REprintf("dont_wait type must be logical (LGLSXP).\n");
+    return R_NilValue;
+  }
+
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
+  if(!socket) {
+    REprintf("bad socket object.\n");
+    return R_NilValue;
+  }
+
+  zmq_msg_t msg;
+  zmq_msg_init(&msg);
+  if(zmq_msg_recv(&msg, static_cast<void*>(*socket), LOGICAL(dont_wait_)[0] ? ZMQ_DONTWAIT : 0) < 0) {
+    reportErrno();
+    zmq_msg_close(&msg);
+    return R_NilValue;
+  }
+  // routing id 0 and the empty group mean none was set
+  uint32_t routing_id = zmq_msg_routing_id(&msg);
+  char group[ZMQ_GROUP_MAX_LENGTH + 1];
+  strncpy(group, zmq_msg_group(&msg), ZMQ_GROUP_MAX_LENGTH);
+  group[ZMQ_GROUP_MAX_LENGTH] = '\0';
+
+  SEXP ans, names;
+  PROTECT(ans = Rf_allocVector(VECSXP,3));
+  SEXP data = Rf_allocVector(RAWSXP, zmq_msg_size(&msg));
+  SET_VECTOR_ELT(ans, 0, data);
+  memcpy(RAW(data), zmq_msg_data(&msg), zmq_msg_size(&msg));
+  zmq_msg_close(&msg);
+
+  if(routing_id) SET_VECTOR_ELT(ans, 1, Rf_ScalarReal(routing_id));
+  if(group[0]) SET_VECTOR_ELT(ans, 2, Rf_mkString(group));
+  PROTECT(names = Rf_allocVector(STRSXP,3));
+  SET_STRING_ELT(names, 0, Rf_mkChar("data"));
+  SET_STRING_ELT(names, 1, Rf_mkChar("routing.id"));
+  SET_STRING_ELT(names, 2, Rf_mkChar("group"));
+  Rf_setAttrib(ans, R_NamesSymbol, names);
+  UNPROTECT(2);
+  return ans;
+#else
+  draftUnavailable();
+  return R_NilValue;
+#endif
+}
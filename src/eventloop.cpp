@@ -0,0 +1,217 @@
+///////////////////////////////////////////////////////////////////////////
+// Copyright (C) 2011  Whit Armstrong                                    //
+//                                                                       //
+// This program is free software: you can redistribute it and/or modify  //
+// it under the terms of the GNU General Public License as published by  //
+// the Free Software Foundation, either version 3 of the License, or     //
+// (at your option) any later version.                                   //
+//                                                                       //
+// This program is distributed in the hope that it will be useful,       //
+// but WITHOUT ANY WARRANTY; without even the implied warranty of        //
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         //
+// GNU General Public License for more details.                          //
+//                                                                       //
+// You should have received a copy of the GNU General Public License     //
+// along with this program.  If not, see <http://www.gnu.org/licenses/>. //
+///////////////////////////////////////////////////////////////////////////
+
+// Socket callbacks driven by R's own event loop.
+//
+// The descriptor behind ZMQ_FD only signals that the socket's state may
+// have changed, and it is edge triggered: once it has fired, it will not
+// fire again until ZMQ_EVENTS has been read and new activity arrives.  So
+// the input handler calls the R callback while ZMQ_EVENTS reports pending
+// messages, but at most DISPATCH_CALLS times, and stops early once a call
+// reads nothing.  A socket still busy after that is finished from R's
+// polled events hook, which runs while the event loop waits, so a flood of
+// messages cannot hold up the console and a callback that never reads
+// cannot hang it.
+
+#include <zmq.hpp>
+#include <set>
+#include "interface.h"
+#ifndef _WIN32
+#include <R_ext/eventloop.h>
+
+// activity id of our input handlers
+static const int RZMQ_ACTIVITY = 27;
+// callback calls per dispatch
+static const int DISPATCH_CALLS = 64;
+// how often the event loop returns to busy sockets, in microseconds
+static const int BACKLOG_WAIT = 10000;
+
+struct socketHandler {
+  InputHandler* input;
+  zmq::socket_t* socket;
+  // the handler's external pointer; its prot slot keeps the socket and
+  // callback alive
+  SEXP self;
+  SEXP call;
+};
+
+// registered handlers, so closing a socket can remove its handlers
+static std::set<socketHandler*> active_handlers;
+// handlers that stopped with messages still pending
+static std::set<socketHandler*> backlogged_handlers;
+static void (*previous_polled_events)(void) = NULL;
+static int previous_wait_usec = 0;
+static bool polling_backlog = false;
+
+static void dispatchSocket(void* data);
+
+static void pollBacklog() {
+  if(previous_polled_events) previous_polled_events();
+  std::set<socketHandler*> handlers(backlogged_handlers);
+  for(std::set<socketHandler*>::iterator it = handlers.begin(); it != handlers.end(); ++it) {
+    // an earlier callback may have removed this handler
+    if(backlogged_handlers.count(*it)) dispatchSocket(*it);
+  }
+}
+
+// hooks into the event loop while any handler is backlogged, and gives
+// the previous hook back once none is
+static void updateBacklog() {
+  if(!backlogged_handlers.empty() && !polling_backlog) {
+    previous_polled_events = R_PolledEvents;
+    previous_wait_usec = R_wait_usec;
+    R_PolledEvents = pollBacklog;
+    if(R_wait_usec <= 0 || R_wait_usec > BACKLOG_WAIT) R_wait_usec = BACKLOG_WAIT;
+    polling_backlog = true;
+  } else if(backlogged_handlers.empty() && polling_backlog && R_PolledEvents == pollBacklog) {
+    R_PolledEvents = previous_polled_events;
+    R_wait_usec = previous_wait_usec;
+    polling_backlog = false;
+  }
+}
+
+static void deactivateHandler(socketHandler* handler) {
+  removeInputHandler(&R_InputHandlers, handler->input);
+  handler->input = NULL;
+  active_handlers.erase(handler);
+  backlogged_handlers.erase(handler);
+  updateBacklog();
+  R_ReleaseObject(handler->self);
+}
+
+static bool socketReadable(zmq::socket_t* socket) {
+  int events = 0;
+  size_t events_len = sizeof(events);
+  socket->getsockopt(ZMQ_EVENTS, &events, &events_len);
+  return events & ZMQ_POLLIN;
+}
+
+static void dispatchSocket(void* data) {
+  socketHandler* handler = reinterpret_cast<socketHandler*>(data);
+  // the callback may remove its own handler
+  PROTECT(handler->self);
+  bool backlogged = false;
+  try {
+    for(int calls = 0; handler->input && socketReadable(handler->socket); calls++) {
+      if(calls == DISPATCH_CALLS) {
+        backlogged = true;
+        break;
+      }
+      double received = receivedFrames();
+      int error = 0;
+      R_tryEval(handler->call, R_GlobalEnv, &error);
+      // a callback that reads nothing is called again on new activity
+      if(error || receivedFrames() == received)
+        break;
+    }
+  } catch(std::exception& e) {
+    reportError(e);
+  }
+  if(backlogged && handler->input)
+    backlogged_handlers.insert(handler);
+  else
+    backlogged_handlers.erase(handler);
+  updateBacklog();
+  UNPROTECT(1);
+}
+
+static void socketHandlerFinalizer(SEXP handler_) {
+  socketHandler* handler = reinterpret_cast<socketHandler*>(R_ExternalPtrAddr(handler_));
+  if(handler) {
+    if(handler->input) deactivateHandler(handler);
+    delete handler;
+    R_ClearExternalPtr(handler_);
+  }
+}
+#endif
+
+SEXP addSocketHandler(SEXP socket_, SEXP callback_) {
+#ifndef _WIN32
+  SEXP handler_;
+
+  if(!Rf_isFunction(callback_)) {
+    REprintf("callback must be a function.\n");
+    return R_NilValue;
+  }
+
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
+  if(!socket) {
+    REprintf("bad socket object.\n");
+    return R_NilValue;
+  }
+
+  int fd;
+  size_t fd_len = sizeof(fd);
+  try {
+    socket->getsockopt(ZMQ_FD, &fd, &fd_len);
+  } catch(std::exception& e) {
+    reportError(e);
+    return R_NilValue;
+  }
+
+  socketHandler* handler = new socketHandler;
+  handler->socket = socket;
+  SEXP keep = PROTECT(Rf_allocVector(VECSXP, 2));
+  SET_VECTOR_ELT(keep, 0, socket_);
+  SET_VECTOR_ELT(keep, 1, handler->call = Rf_lang2(callback_, socket_));
+  PROTECT(handler_ = R_MakeExternalPtr(reinterpret_cast<void*>(handler),rzmq_socket_handler_tag,keep));
+  R_RegisterCFinalizerEx(handler_, socketHandlerFinalizer, TRUE);
+  handler->self = handler_;
+  handler->input = addInputHandler(R_InputHandlers, fd, dispatchSocket, RZMQ_ACTIVITY);
+  handler->input->userData = handler;
+  // registered handlers stay alive until removed
+  R_PreserveObject(handler_);
+  active_handlers.insert(handler);
+
+  // messages queued before now will not make the descriptor fire again
+  dispatchSocket(handler);
+  UNPROTECT(2);
+  return handler_;
+#else
+  REprintf("socket handlers are not supported on Windows.\n");
+  return R_NilValue;
+#endif
+}
+
+SEXP removeSocketHandler(SEXP handler_) {
+  SEXP ans;
+  bool status(false);
+#ifndef _WIN32
+  if(TYPEOF(handler_) == EXTPTRSXP && R_ExternalPtrTag(handler_) == rzmq_socket_handler_tag) {
+    socketHandler* handler = reinterpret_cast<socketHandler*>(R_ExternalPtrAddr(handler_));
+    if(handler && handler->input) {
+      deactivateHandler(handler);
+      status = true;
+    }
+  } else {
+    REprintf("bad socket handler object.\n");
+  }
+#endif
+  PROTECT(ans = Rf_allocVector(LGLSXP,1));
+  LOGICAL(ans)[0] = static_cast<int>(status);
+  UNPROTECT(1);
+  return ans;
+}
+
+void removeSocketHandlers(void* socket) {
+#ifndef _WIN32
+  std::set<socketHandler*> handlers(active_handlers);
+  for(std::set<socketHandler*>::iterator it = handlers.begin(); it != handlers.end(); ++it) {
+    if((*it)->socket == socket) deactivateHandler(*it);
+  }
+#endif
+}
@@ -18,10 +18,24 @@
 #include <sstream>
 #include <zmq.hpp>
 #include <chrono>
-#include <stdexcept>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <vector>
+#include <Rversion.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 static_assert(ZMQ_VERSION_MAJOR >= 3,"The minimum required version of libzmq is 3.0.0.");
 #include "interface.h"
 
+static void contextFinalizer(SEXP context_);
+static void socketFinalizer(SEXP socket_);
+static void messageFinalizer(SEXP msg_);
+
 typedef std::chrono::high_resolution_clock Time;
 typedef std::chrono::milliseconds ms;
 
@@ -34,6 +48,211 @@ int pending_interrupt() {
     return !(R_ToplevelExec(check_interrupt_fn, NULL));
 }
 
+// errno of the last failed call, captured before R can clobber it
+static int last_errno = 0;
+
+static bool quietErrors() {
+  SEXP quiet = Rf_GetOption1(Rf_install("rzmq.quiet"));
+  return TYPEOF(quiet) == LGLSXP && Rf_length(quiet) == 1 && LOGICAL(quiet)[0] == TRUE;
+}
+
+void reportError(const std::exception& e) {
+  const zmq::error_t* error = dynamic_cast<const zmq::error_t*>(&e);
+  last_errno = error ? error->num() : ENOMEM;
+  if(!quietErrors()) {
+    REprintf("%s\n",e.what());
+  }
+}
+
+// records the error of a failed libzmq C call; EAGAIN is expected, so it
+// is not printed
+void reportErrno() {
+  if(zmq_errno() == EAGAIN) {
+    last_errno = EAGAIN;
+  } else {
+    reportError(zmq::error_t());
+  }
+}
+
+bool sendFrame(zmq::socket_t* socket, zmq::message_t& msg, int flags, int* error) {
+  try {
+    // zmq empties msg when it sends it, so a capture keeps a shared copy
+    bool tapped = captureTapped(socket);
+    zmq::message_t frame;
+    if(tapped) frame.copy(&msg);
+    if(socket->send(msg, flags)) {
+      if(tapped) captureFrame(socket, frame, flags & ZMQ_SNDMORE, false);
+      return true;
+    }
+    *error = EAGAIN;
+  } catch(zmq::error_t& e) {
+    *error = e.num();
+  } catch(std::exception& e) {
+    *error = ENOMEM;
+  }
+  return false;
+}
+
+bool sendMessage(zmq::socket_t* socket, zmq::message_t& msg, int flags) {
+  int error;
+  releaseReturnedVectors();
+  if(sendFrame(socket, msg, flags, &error))
+    return true;
+  errno = error;
+  reportErrno();
+  return false;
+}
+
+// frames received through receiveFrame, so a socket handler can tell
+// whether its callback read anything
+static std::atomic<uint64_t> received_frames(0);
+
+double receivedFrames() {
+  return received_frames;
+}
+
+bool receiveFrame(zmq::socket_t* socket, zmq::message_t* msg, int flags, int* error) {
+  try {
+    if(socket->recv(msg, flags)) {
+      received_frames++;
+      captureFrame(socket, *msg, msg->more(), true);
+      return true;
+    }
+    *error = EAGAIN;
+  } catch(zmq::error_t& e) {
+    *error = e.num();
+  } catch(std::exception& e) {
+    *error = ENOMEM;
+  }
+  return false;
+}
+
+bool receiveMessage(zmq::socket_t* socket, zmq::message_t* msg, int flags) {
+  int error;
+  releaseReturnedVectors();
+  if(receiveFrame(socket, msg, flags, &error))
+    return true;
+  errno = error;
+  reportErrno();
+  return false;
+}
+
+// Vectors lent to zmq without copying.  zmq may free a message on one of
+// its I/O threads, where the R API is off limits, so the free callback
+// only queues the vector.  The R thread releases the queue on every
+// send and receive and whenever a socket or context is closed; the flag
+// keeps that to a single load when nothing has come back.
+static std::mutex lent_mutex;
+static std::vector<SEXP> returned_vectors;
+static std::atomic<bool> vectors_returned(false);
+
+void returnVector(void* data, void* hint) {
+  std::lock_guard<std::mutex> lock(lent_mutex);
+  returned_vectors.push_back(reinterpret_cast<SEXP>(hint));
+  vectors_returned = true;
+}
+
+void releaseReturnedVectors() {
+  if(!vectors_returned)
+    return;
+  std::vector<SEXP> returned;
+  {
+    std::lock_guard<std::mutex> lock(lent_mutex);
+    returned.swap(returned_vectors);
+    vectors_returned = false;
+  }
+  for(size_t i = 0; i < returned.size(); i++) {
+    R_ReleaseObject(returned[i]);
+  }
+}
+
+void lendVector(SEXP x) {
+  releaseReturnedVectors();
+  // R must copy the vector rather than modify it while zmq reads it
+#if R_VERSION >= R_Version(3, 5, 0)
+  MARK_NOT_MUTABLE(x);
+#else
+  SET_NAMED(x, 2);
+#endif
+  R_PreserveObject(x);
+}
+
+static const char* errnoName(int errnum) {
+  switch(errnum) {
+  case EAGAIN: return "EAGAIN";
+  case EINTR: return "EINTR";
+  case EINVAL: return "EINVAL";
+  case ENOMEM: return "ENOMEM";
+  case ENOTSUP: return "ENOTSUP";
+  case EHOSTUNREACH: return "EHOSTUNREACH";
+  case ENOTSOCK: return "ENOTSOCK";
+  case EMSGSIZE: return "EMSGSIZE";
+  case ENOBUFS: return "ENOBUFS";
+  case EFSM: return "EFSM";
+  case ETERM: return "ETERM";
+  case EMTHREAD: return "EMTHREAD";
+  default: return "";
+  }
+}
+
+// TRUE, or FALSE carrying the errno of the failure and its name
+SEXP statusResult(bool status) {
+  SEXP ans;
+  PROTECT(ans = Rf_allocVector(LGLSXP,1));
+  LOGICAL(ans)[0] = static_cast<int>(status);
+  if(!status) {
+    Rf_setAttrib(ans, Rf_install("errno"), Rf_ScalarInteger(last_errno));
+    Rf_setAttrib(ans, Rf_install("error"), Rf_mkString(errnoName(last_errno)));
+  }
+  UNPROTECT(1);
+  return ans;
+}
+
+struct rawReader {
+  const unsigned char* data;
+  size_t size;
+  size_t pos;
+};
+
+static void rawInBytes(R_inpstream_t stream, void* buf, int length) {
+  rawReader* r = reinterpret_cast<rawReader*>(stream->data);
+  if(r->size - r->pos < static_cast<size_t>(length)) {
+    Rf_error("truncated serialized data.");
+  }
+  memcpy(buf, r->data + r->pos, length);
+  r->pos += length;
+}
+
+static int rawInChar(R_inpstream_t stream) {
+  unsigned char ch;
+  rawInBytes(stream, &ch, 1);
+  return ch;
+}
+
+// unserializes bytes in R's format or the compact one without calling back
+// into R's unserialize()
+SEXP unserializeBytes(const unsigned char* data, size_t size) {
+  if(isCompact(data, size))
+    return compactDecode(data, size);
+  rawReader reader = { data, size, 0 };
+  struct R_inpstream_st in;
+  R_InitInPStream(&in, reinterpret_cast<R_pstream_data_t>(&reader), R_pstream_any_format,
+                  rawInChar, rawInBytes, NULL, R_NilValue);
+  return R_Unserialize(&in);
+}
+
+SEXP rzmq_unserialize(SEXP data, SEXP rho) {
+  return unserializeBytes(RAW(data), Rf_xlength(data));
+}
+
+SEXP unserializeMessage(SEXP data_) {
+  if(TYPEOF(data_) != RAWSXP) {
+    REprintf("data type must be raw (RAWSXP).\n");
+    return R_NilValue;
+  }
+  return rzmq_unserialize(data_, R_GlobalEnv);
+}
+
 SEXP get_zmq_version() {
   SEXP ans;
   int major, minor, patch;
@@ -48,92 +267,164 @@ SEXP get_zmq_version() {
 
 SEXP get_zmq_errno() {
   SEXP ans; PROTECT(ans = Rf_allocVector(INTSXP,1));
-  INTEGER(ans)[0] = zmq_errno();
+  INTEGER(ans)[0] = last_errno;
   UNPROTECT(1);
   return ans;
 }
 
 SEXP get_zmq_strerror() {
   SEXP ans; PROTECT(ans = Rf_allocVector(STRSXP,1));
-  SET_STRING_ELT(ans, 0, Rf_mkChar(zmq_strerror(zmq_errno())));
+  SET_STRING_ELT(ans, 0, Rf_mkChar(zmq_strerror(last_errno)));
   UNPROTECT(1);
   return ans;
 }
 
+struct socketTypeName {
+  const char* name;
+  int type;
+};
+
+static const socketTypeName socket_types[] = {
+  { "ZMQ_PAIR", ZMQ_PAIR },
+  { "ZMQ_PUB", ZMQ_PUB },
+  { "ZMQ_SUB", ZMQ_SUB },
+  { "ZMQ_REQ", ZMQ_REQ },
+  { "ZMQ_REP", ZMQ_REP },
+  { "ZMQ_DEALER", ZMQ_DEALER },
+  { "ZMQ_ROUTER", ZMQ_ROUTER },
+  { "ZMQ_PULL", ZMQ_PULL },
+  { "ZMQ_PUSH", ZMQ_PUSH },
+  { "ZMQ_XPUB", ZMQ_XPUB },
+  { "ZMQ_XSUB", ZMQ_XSUB },
+  { "ZMQ_XREQ", ZMQ_XREQ },
+  { "ZMQ_XREP", ZMQ_XREP },
+#ifdef ZMQ_STREAM
+  { "ZMQ_STREAM", ZMQ_STREAM },
+#endif
+  // draft types, only when configure found the draft API
+#ifdef ZMQ_BUILD_DRAFT_API
+  { "ZMQ_SERVER", ZMQ_SERVER },
+  { "ZMQ_CLIENT", ZMQ_CLIENT },
+  { "ZMQ_RADIO", ZMQ_RADIO },
+  { "ZMQ_DISH", ZMQ_DISH },
+  { "ZMQ_GATHER", ZMQ_GATHER },
+  { "ZMQ_SCATTER", ZMQ_SCATTER },
+#endif
+};
+
 int string_to_socket_type(const std::string s) {
-  if(s == "ZMQ_PAIR") {
-    return ZMQ_PAIR;
-  } else if(s == "ZMQ_PUB") {
-    return ZMQ_PUB;
-  } else if(s == "ZMQ_SUB") {
-    return ZMQ_SUB;
-  } else if(s == "ZMQ_REQ") {
-    return ZMQ_REQ;
-  } else if(s == "ZMQ_REP") {
-    return ZMQ_REP;
-  } else if(s == "ZMQ_DEALER") {
-    return ZMQ_DEALER;
-  } else if(s == "ZMQ_ROUTER") {
-    return ZMQ_ROUTER;
-  } else if(s == "ZMQ_PULL") {
-    return ZMQ_PULL;
-  } else if(s == "ZMQ_PUSH") {
-    return ZMQ_PUSH;
-  } else if(s == "ZMQ_XPUB") {
-    return ZMQ_XPUB;
-  } else if(s == "ZMQ_XSUB") {
-    return ZMQ_XSUB;
-  } else if(s == "ZMQ_XREQ") {
-    return ZMQ_XREQ;
-  } else if(s == "ZMQ_XREP") {
-    return ZMQ_XREP;
-  } else {
-    return -1;
+  for(size_t i = 0; i < sizeof(socket_types) / sizeof(socket_types[0]); i++) {
+    if(s == socket_types[i].name)
+      return socket_types[i].type;
   }
+  return -1;
 }
 
-void* checkExternalPointer(SEXP xp_, const char* valid_tag) {
-  if(xp_ == R_NilValue) {
-    throw std::logic_error("External pointer is NULL.");
-  }
-  if(TYPEOF(xp_) != EXTPTRSXP) {
-    throw std::logic_error("Not an external pointer.");
-  }
+SEXP rzmq_context_tag;
+SEXP rzmq_socket_tag;
+SEXP rzmq_message_tag;
+SEXP rzmq_rpc_client_tag;
+SEXP rzmq_broker_tag;
+SEXP rzmq_socket_handler_tag;
+SEXP rzmq_zap_handler_tag;
+SEXP rzmq_spill_queue_tag;
+SEXP rzmq_reliable_publisher_tag;
+SEXP rzmq_reliable_subscriber_tag;
+SEXP rzmq_liveness_tag;
+SEXP rzmq_capture_tag;
+SEXP rzmq_coalescer_tag;
+SEXP rzmq_pacer_tag;
+
+// symbols are never collected, so the tags need no protection
+void rzmq_init_tags() {
+  rzmq_context_tag = Rf_install("zmq::context_t*");
+  rzmq_socket_tag = Rf_install("zmq::socket_t*");
+  rzmq_message_tag = Rf_install("zmq::message_t*");
+  rzmq_rpc_client_tag = Rf_install("rzmq::rpcClient*");
+  rzmq_broker_tag = Rf_install("rzmq::broker*");
+  rzmq_socket_handler_tag = Rf_install("rzmq::socketHandler*");
+  rzmq_zap_handler_tag = Rf_install("rzmq::zapHandler*");
+  rzmq_spill_queue_tag = Rf_install("rzmq::spillQueue*");
+  rzmq_reliable_publisher_tag = Rf_install("rzmq::reliablePublisher*");
+  rzmq_reliable_subscriber_tag = Rf_install("rzmq::reliableSubscriber*");
+  rzmq_liveness_tag = Rf_install("rzmq::livenessTable*");
+  rzmq_capture_tag = Rf_install("rzmq::capture*");
+  rzmq_coalescer_tag = Rf_install("rzmq::coalescer*");
+  rzmq_pacer_tag = Rf_install("rzmq::pacer*");
+}
 
-  if(R_ExternalPtrTag(xp_)==R_NilValue) {
-    throw std::logic_error("External pointer tag is NULL.");
-  }
-  const char* xp_tag = CHAR(PRINTNAME(R_ExternalPtrTag(xp_)));
-  if(!xp_tag) {
-    throw std::logic_error("External pointer tag is blank.");
+// open handles of each context.  Handles are removed when they are closed
+// or finalized, so the unprotected SEXPs held here are always alive.
+typedef std::map<SEXP, R_CFinalizer_t> handleMap;
+static std::map<zmq::context_t*, handleMap> context_handles;
+
+void registerHandle(SEXP handle_, R_CFinalizer_t close) {
+  zmq::context_t* context = reinterpret_cast<zmq::context_t*>(checkExternalPointer(R_ExternalPtrProtected(handle_),rzmq_context_tag));
+  if(context) {
+    context_handles[context][handle_] = close;
   }
-  if(strcmp(xp_tag,valid_tag) != 0) {
-    throw std::logic_error("External pointer tag does not match.");
+}
+
+void unregisterHandle(SEXP handle_) {
+  zmq::context_t* context = reinterpret_cast<zmq::context_t*>(checkExternalPointer(R_ExternalPtrProtected(handle_),rzmq_context_tag));
+  if(context) {
+    std::map<zmq::context_t*, handleMap>::iterator it = context_handles.find(context);
+    if(it != context_handles.end()) {
+      it->second.erase(handle_);
+    }
   }
-  if(R_ExternalPtrAddr(xp_)==NULL) {
-    throw std::logic_error("External pointer address is null.");
+}
+
+// closes every handle of the context; zmq_ctx_term would block on them
+static void closeHandles(zmq::context_t* context, SEXP linger_) {
+  std::map<zmq::context_t*, handleMap>::iterator it = context_handles.find(context);
+  if(it == context_handles.end())
+    return;
+  handleMap handles;
+  handles.swap(it->second);
+  context_handles.erase(it);
+  for(handleMap::iterator h = handles.begin(); h != handles.end(); ++h) {
+    if(linger_ != R_NilValue && R_ExternalPtrTag(h->first) == rzmq_socket_tag) {
+      int linger = Rf_asInteger(linger_);
+      try {
+        reinterpret_cast<zmq::socket_t*>(R_ExternalPtrAddr(h->first))->setsockopt(ZMQ_LINGER, &linger, sizeof(int));
+      } catch(std::exception& e) {
+        reportError(e);
+      }
+    }
+    h->second(h->first);
   }
-  return R_ExternalPtrAddr(xp_);
 }
 
 static void contextFinalizer(SEXP context_) {
   zmq::context_t* context = reinterpret_cast<zmq::context_t*>(R_ExternalPtrAddr(context_));
   if(context) {
+    closeHandles(context, R_NilValue);
     delete context;
     R_ClearExternalPtr(context_);
+    // terminating the context has freed every message still queued
+    releaseReturnedVectors();
   }
 }
 
 static void socketFinalizer(SEXP socket_) {
-  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,"zmq::socket_t*"));
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
   if(socket) {
+    unregisterHandle(socket_);
+    removeSocketHandlers(socket);
+    stopSpillQueues(socket);
+    removeCaptureTaps(socket);
+    stopCoalescers(socket);
+    stopPacers(socket);
+    removeDeadlineCounts(socket);
     delete socket;
     R_ClearExternalPtr(socket_);
+    releaseReturnedVectors();
   }
 }
 
 static void messageFinalizer(SEXP msg_) {
-  zmq::message_t* msg = reinterpret_cast<zmq::message_t*>(checkExternalPointer(msg_,"zmq::message_t*"));
+  zmq::message_t* msg = reinterpret_cast<zmq::message_t*>(checkExternalPointer(msg_,rzmq_message_tag));
   if(msg) {
     delete msg; // destructor will call zmq_msg_close()
     R_ClearExternalPtr(msg_);
@@ -150,12 +441,12 @@ SEXP initContext(SEXP threads_) {
   try {
     context = new zmq::context_t(*INTEGER(threads_));
   } catch(std::exception& e) {
-    REprintf("%s\n",e.what());
+    reportError(e);
     return R_NilValue;
   }
 
   if(context) {
-    PROTECT(context_ = R_MakeExternalPtr(reinterpret_cast<void*>(context),Rf_install("zmq::context_t*"),R_NilValue));
+    PROTECT(context_ = R_MakeExternalPtr(reinterpret_cast<void*>(context),rzmq_context_tag,R_NilValue));
     R_RegisterCFinalizerEx(context_, contextFinalizer, TRUE);
     UNPROTECT(1);
     return context_;
@@ -178,13 +469,8 @@ SEXP initSocket(SEXP context_, SEXP socket_type_) {
     return R_NilValue;
   }
 
-  zmq::context_t* context(NULL);
-  try {
-    context = reinterpret_cast<zmq::context_t*>(checkExternalPointer(context_,"zmq::context_t*"));
-  } catch(std::logic_error &e) {
-      REprintf("%s\n",e.what());
-      return R_NilValue;
-  }
+  zmq::context_t* context = reinterpret_cast<zmq::context_t*>(checkExternalPointer(context_,rzmq_context_tag));
+  if(!context) { REprintf("bad context object.\n");return R_NilValue; }
 
   zmq::socket_t* socket = new zmq::socket_t(*context,socket_type);
   if(!socket) { REprintf("bad socket object.\n");return R_NilValue; }
@@ -192,12 +478,62 @@ SEXP initSocket(SEXP context_, SEXP socket_type_) {
   //uint64_t hwm = 1;
   //socket->setsockopt(ZMQ_HWM, &hwm, sizeof (hwm));
 
-  PROTECT(socket_ = R_MakeExternalPtr(reinterpret_cast<void*>(socket),Rf_install("zmq::socket_t*"),R_NilValue));
+  // the socket keeps its context alive
+  PROTECT(socket_ = R_MakeExternalPtr(reinterpret_cast<void*>(socket),rzmq_socket_tag,context_));
   R_RegisterCFinalizerEx(socket_, socketFinalizer, TRUE);
+  registerHandle(socket_, socketFinalizer);
   UNPROTECT(1);
   return socket_;
 }
 
+SEXP closeSocket(SEXP socket_, SEXP linger_) {
+  SEXP ans;
+
+  if(TYPEOF(socket_) != EXTPTRSXP || R_ExternalPtrTag(socket_) != rzmq_socket_tag) {
+    REprintf("bad socket object.\n");
+    return R_NilValue;
+  }
+
+  // closing an already closed socket does nothing
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(R_ExternalPtrAddr(socket_));
+  if(socket) {
+    if(linger_ != R_NilValue) {
+      int linger = Rf_asInteger(linger_);
+      try {
+        socket->setsockopt(ZMQ_LINGER, &linger, sizeof(int));
+      } catch(std::exception& e) {
+        reportError(e);
+      }
+    }
+    socketFinalizer(socket_);
+  }
+
+  PROTECT(ans = Rf_allocVector(LGLSXP,1));
+  LOGICAL(ans)[0] = socket != NULL;
+  UNPROTECT(1);
+  return ans;
+}
+
+SEXP termContext(SEXP context_, SEXP linger_) {
+  SEXP ans;
+
+  if(TYPEOF(context_) != EXTPTRSXP || R_ExternalPtrTag(context_) != rzmq_context_tag) {
+    REprintf("bad context object.\n");
+    return R_NilValue;
+  }
+
+  zmq::context_t* context = reinterpret_cast<zmq::context_t*>(R_ExternalPtrAddr(context_));
+  if(context) {
+    closeHandles(context, linger_);
+    contextFinalizer(context_);
+  }
+
+  PROTECT(ans = Rf_allocVector(LGLSXP,1));
+  LOGICAL(ans)[0] = context != NULL;
+  UNPROTECT(1);
+  return ans;
+}
+
 SEXP bindSocket(SEXP socket_, SEXP address_) {
   SEXP ans; PROTECT(ans = Rf_allocVector(LGLSXP,1)); LOGICAL(ans)[0] = 1;
 
@@ -207,11 +543,16 @@ SEXP bindSocket(SEXP socket_, SEXP address_) {
     return R_NilValue;
   }
 
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
+  if(!socket) {
+    REprintf("bad socket object.\n");
+    UNPROTECT(1);
+    return R_NilValue;
+  }
   try {
-    zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,"zmq::socket_t*"));
     socket->bind(CHAR(STRING_ELT(address_,0)));
   } catch(std::exception& e) {
-    REprintf("%s\n",e.what());
+    reportError(e);
     LOGICAL(ans)[0] = 0;
   }
 
@@ -268,7 +609,10 @@ SEXP pollSocket(SEXP sockets_, SEXP events_, SEXP timeout_) {
 
     try {
         for (int i = 0; i < nsock; i++) {
-            zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(VECTOR_ELT(sockets_, i), "zmq::socket_t*"));
+            zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(VECTOR_ELT(sockets_, i),rzmq_socket_tag));
+            if(!socket) {
+                Rf_error("bad socket object.");
+            }
             pitems[i].socket = (void*)*socket;
             pitems[i].events = rzmq_build_event_bitmask(VECTOR_ELT(events_, i));
         }
@@ -353,11 +697,16 @@ SEXP connectSocket(SEXP socket_, SEXP address_) {
     UNPROTECT(1);
     return R_NilValue;
   }
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
+  if(!socket) {
+    REprintf("bad socket object.\n");
+    UNPROTECT(1);
+    return R_NilValue;
+  }
   try {
-    zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,"zmq::socket_t*"));
     socket->connect(CHAR(STRING_ELT(address_,0)));
   } catch(std::exception& e) {
-    REprintf("%s\n",e.what());
+    reportError(e);
     LOGICAL(ans)[0] = 0;
   }
 
@@ -373,11 +722,16 @@ SEXP disconnectSocket(SEXP socket_, SEXP address_) {
     UNPROTECT(1);
     return R_NilValue;
   }
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
+  if(!socket) {
+    REprintf("bad socket object.\n");
+    UNPROTECT(1);
+    return R_NilValue;
+  }
   try {
-    zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,"zmq::socket_t*"));
     socket->disconnect(CHAR(STRING_ELT(address_,0)));
   } catch(std::exception& e) {
-    REprintf("%s\n",e.what());
+    reportError(e);
     LOGICAL(ans)[0] = 0;
   }
 
@@ -386,23 +740,19 @@ SEXP disconnectSocket(SEXP socket_, SEXP address_) {
 }
 
 SEXP sendSocket(SEXP socket_, SEXP data_, SEXP send_more_) {
-  SEXP ans; PROTECT(ans = Rf_allocVector(LGLSXP,1));
   bool status(false);
   if(TYPEOF(data_) != RAWSXP) {
     REprintf("data type must be raw (RAWSXP).\n");
-    UNPROTECT(1);
     return R_NilValue;
   }
 
   if(TYPEOF(send_more_) != LGLSXP) {
     REprintf("send.more type must be logical (LGLSXP).\n");
-    UNPROTECT(1);
     return R_NilValue;
   }
 
-  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,"zmq::socket_t*"));
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
   if(!socket) { 
-    UNPROTECT(1);
     REprintf("bad socket object.\n");
     return R_NilValue;
   }
@@ -410,52 +760,97 @@ SEXP sendSocket(SEXP socket_, SEXP data_, SEXP send_more_) {
   zmq::message_t msg (Rf_xlength(data_));
   memcpy(msg.data(), RAW(data_), Rf_xlength(data_));
 
-  bool send_more = LOGICAL(send_more_)[0];
-  try {
-    if(send_more) {
-      status = socket->send(msg,ZMQ_SNDMORE);
+  status = sendMessage(socket, msg, LOGICAL(send_more_)[0] ? ZMQ_SNDMORE : 0);
+  return statusResult(status);
+}
+
+// contiguous storage of an atomic vector, or NULL for other types
+static char* vectorBytes(SEXP x, size_t* nbytes) {
+  switch(TYPEOF(x)) {
+  case RAWSXP:
+    *nbytes = Rf_xlength(x);
+    return reinterpret_cast<char*>(RAW(x));
+  case LGLSXP:
+    *nbytes = Rf_xlength(x) * sizeof(int);
+    return reinterpret_cast<char*>(LOGICAL(x));
+  case INTSXP:
+    *nbytes = Rf_xlength(x) * sizeof(int);
+    return reinterpret_cast<char*>(INTEGER(x));
+  case REALSXP:
+    *nbytes = Rf_xlength(x) * sizeof(double);
+    return reinterpret_cast<char*>(REAL(x));
+  case CPLXSXP:
+    *nbytes = Rf_xlength(x) * sizeof(Rcomplex);
+    return reinterpret_cast<char*>(COMPLEX(x));
+  default:
+    return NULL;
+  }
+}
+
+SEXP sendGather(SEXP socket_, SEXP parts_, SEXP send_more_) {
+  if(TYPEOF(parts_) != VECSXP || Rf_xlength(parts_) == 0) {
+    REprintf("parts must be a non-empty list.\n");
+    return R_NilValue;
+  }
+  size_t length;
+  for(R_xlen_t i = 0; i < Rf_xlength(parts_); i++) {
+    if(!vectorBytes(VECTOR_ELT(parts_, i), &length)) {
+      REprintf("part %d must be a raw, logical, integer, double or complex vector.\n", static_cast<int>(i + 1));
+      return R_NilValue;
+    }
+  }
+
+  if(TYPEOF(send_more_) != LGLSXP) {
+    REprintf("send.more type must be logical (LGLSXP).\n");
+    return R_NilValue;
+  }
+
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
+  if(!socket) {
+    REprintf("bad socket object.\n");
+    return R_NilValue;
+  }
+
+  // every part is lent to zmq as it is, so nothing is copied
+  std::vector<zmq::message_t*> frames;
+  for(R_xlen_t i = 0; i < Rf_xlength(parts_); i++) {
+    SEXP part = VECTOR_ELT(parts_, i);
+    char* data = vectorBytes(part, &length);
+    if(length == 0) {
+      frames.push_back(new zmq::message_t(0));
     } else {
-      status = socket->send(msg);
+      lendVector(part);
+      frames.push_back(new zmq::message_t(data, length, returnVector, part));
     }
-  } catch(std::exception& e) {
-    REprintf("%s\n",e.what());
   }
-  LOGICAL(ans)[0] = static_cast<int>(status);
-  UNPROTECT(1);
-  return ans;
+
+  // multipart messages are atomic, so only the first frame can fail with EAGAIN
+  bool status(true);
+  for(size_t i = 0; i < frames.size() && status; i++) {
+    bool last = i + 1 == frames.size();
+    status = sendMessage(socket, *frames[i], last ? (LOGICAL(send_more_)[0] ? ZMQ_SNDMORE : 0) : ZMQ_SNDMORE);
+  }
+  for(size_t i = 0; i < frames.size(); i++) delete frames[i];
+  return statusResult(status);
 }
 
 SEXP sendNullMsg(SEXP socket_, SEXP send_more_) {
-  SEXP ans; PROTECT(ans = Rf_allocVector(LGLSXP,1));
   bool status(false);
 
   if(TYPEOF(send_more_) != LGLSXP) {
     REprintf("send.more type must be logical (LGLSXP).\n");
-    UNPROTECT(1);
     return R_NilValue;
   }
 
-  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,"zmq::socket_t*"));
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
   if(!socket) { 
     REprintf("bad socket object.\n");
-    UNPROTECT(1);
     return R_NilValue; 
   }
   zmq::message_t msg(0);
 
-  bool send_more = LOGICAL(send_more_)[0];
-  try {
-    if(send_more) {
-      status = socket->send(msg,ZMQ_SNDMORE);
-    } else {
-      status = socket->send(msg);
-    }
-  } catch(std::exception& e) {
-    REprintf("%s\n",e.what());
-  }
-  LOGICAL(ans)[0] = static_cast<int>(status);
-  UNPROTECT(1);
-  return ans;
+  status = sendMessage(socket, msg, LOGICAL(send_more_)[0] ? ZMQ_SNDMORE : 0);
+  return statusResult(status);
 }
 
 SEXP initMessage(SEXP data_) {
@@ -471,70 +866,51 @@ SEXP initMessage(SEXP data_) {
 // no copy below, see first that one copy works
 //  zmq::message_t msg(reinterpret_cast<void*>(data_), Rf_xlength(data_), NULL);
 
-  PROTECT(msg_ = R_MakeExternalPtr(reinterpret_cast<void*>(msg),Rf_install("zmq::message_t*"),R_NilValue));
+  PROTECT(msg_ = R_MakeExternalPtr(reinterpret_cast<void*>(msg),rzmq_message_tag,R_NilValue));
   R_RegisterCFinalizerEx(msg_, messageFinalizer, TRUE);
   UNPROTECT(1);
   return msg_;
 }
 
 SEXP sendMessageObject(SEXP socket_, SEXP msg_, SEXP send_more_) {
-  SEXP ans; PROTECT(ans = Rf_allocVector(LGLSXP,1));
   bool status(false);
 
   if(TYPEOF(send_more_) != LGLSXP) {
     REprintf("send.more type must be logical (LGLSXP).\n");
-    UNPROTECT(1);
     return R_NilValue;
   }
 
-  zmq::message_t* msg = reinterpret_cast<zmq::message_t*>(checkExternalPointer(msg_,"zmq::message_t*"));
+  zmq::message_t* msg = reinterpret_cast<zmq::message_t*>(checkExternalPointer(msg_,rzmq_message_tag));
   if(!msg) { 
     REprintf("bad message object.\n");
-    UNPROTECT(1);
     return R_NilValue; 
   }
 
   zmq::message_t copy;
   copy.copy(msg);
 
-  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,"zmq::socket_t*"));
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
   if(!socket) { 
     REprintf("bad socket object.\n");
-    UNPROTECT(1);
     return R_NilValue;
   }
 
-  bool send_more = LOGICAL(send_more_)[0];
-  try {
-    if(send_more) {
-      status = socket->send(copy,ZMQ_SNDMORE);
-    } else {
-      status = socket->send(copy);
-    }
-  } catch(std::exception& e) {
-    REprintf("%s\n",e.what());
-  }
-  LOGICAL(ans)[0] = static_cast<int>(status);
-  UNPROTECT(1);
-  return ans;
+  status = sendMessage(socket, copy, LOGICAL(send_more_)[0] ? ZMQ_SNDMORE : 0);
+  return statusResult(status);
 }
 
 SEXP receiveNullMsg(SEXP socket_) {
   SEXP ans; PROTECT(ans = Rf_allocVector(LGLSXP,1));
   bool status(false);
 
-  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,"zmq::socket_t*"));
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
   if(!socket) { 
     REprintf("bad socket object.\n");
     UNPROTECT(1);
     return R_NilValue;
   }
   zmq::message_t msg;
-  try {
-    status = socket->recv(&msg);
-  } catch(std::exception& e) {
-    REprintf("%s\n",e.what());
-  }
+  status = receiveMessage(socket, &msg, 0);
   LOGICAL(ans)[0] = static_cast<int>(status) && (msg.size() == 0);
   UNPROTECT(1);
   return ans;
@@ -548,17 +924,13 @@ SEXP receiveSocket(SEXP socket_, SEXP dont_wait_) {
     return R_NilValue;
   }
   int flags = LOGICAL(dont_wait_)[0];
-  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,"zmq::socket_t*"));
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
   if(!socket) { 
     REprintf("bad socket object.\n"); 
     return R_NilValue;
   }
   int success = 0;
-  try {
-    success = socket->recv(&msg, flags);
-  } catch(std::exception& e) {
-    REprintf("%s\n",e.what());
-  }
+  success = receiveMessage(socket, &msg, flags);
   if(!success)
     return R_NilValue;
   SEXP ans = Rf_allocVector(RAWSXP,msg.size());
@@ -567,7 +939,6 @@ SEXP receiveSocket(SEXP socket_, SEXP dont_wait_) {
 }
 
 SEXP sendRawString(SEXP socket_, SEXP data_, SEXP send_more_) {
-  SEXP ans;
   bool status(false);
   if(TYPEOF(data_) != STRSXP) {
     REprintf("data type must be raw (STRSXP).\n");
@@ -579,7 +950,7 @@ SEXP sendRawString(SEXP socket_, SEXP data_, SEXP send_more_) {
     return R_NilValue;
   }
 
-  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,"zmq::socket_t*"));
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
   if(!socket) {
     REprintf("bad socket object.\n");
     return R_NilValue;
@@ -589,20 +960,8 @@ SEXP sendRawString(SEXP socket_, SEXP data_, SEXP send_more_) {
   zmq::message_t msg (strlen(data));
   memcpy(msg.data(), data, strlen(data));
 
-  bool send_more = LOGICAL(send_more_)[0];
-  try {
-    if(send_more) {
-      status = socket->send(msg,ZMQ_SNDMORE);
-    } else {
-      status = socket->send(msg);
-    }
-  } catch(std::exception& e) {
-    REprintf("%s\n",e.what());
-  }
-  PROTECT(ans = Rf_allocVector(LGLSXP,1));
-  LOGICAL(ans)[0] = static_cast<int>(status);
-  UNPROTECT(1);
-  return ans;
+  status = sendMessage(socket, msg, LOGICAL(send_more_)[0] ? ZMQ_SNDMORE : 0);
+  return statusResult(status);
 }
 
 
@@ -610,13 +969,9 @@ SEXP receiveString(SEXP socket_) {
   SEXP ans;
   bool status(false);
   zmq::message_t msg;
-  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,"zmq::socket_t*"));
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
   if(!socket) { REprintf("bad socket object.\n");return R_NilValue; }
-  try {
-    status = socket->recv(&msg);
-  } catch(std::exception& e) {
-    REprintf("%s\n",e.what());
-  }
+  status = receiveMessage(socket, &msg, 0);
   if(status) {
     PROTECT(ans = Rf_allocVector(STRSXP,1));
     char* string_msg = new char[msg.size() + 1];
@@ -637,12 +992,9 @@ SEXP receiveInt(SEXP socket_) {
   SEXP ans;
   bool status(false);
   zmq::message_t msg;
-  try {
-    zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,"zmq::socket_t*"));
-    status = socket->recv(&msg);
-  } catch(std::exception& e) {
-    REprintf("%s\n",e.what());
-  }
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
+  if(!socket) { REprintf("bad socket object.\n");return R_NilValue; }
+  status = receiveMessage(socket, &msg, 0);
   if(status) {
     if(msg.size() != sizeof(int)) {
       REprintf("bad integer size on remote machine.\n");
@@ -660,12 +1012,9 @@ SEXP receiveDouble(SEXP socket_) {
   SEXP ans;
   bool status(false);
   zmq::message_t msg;
-  try {
-    zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,"zmq::socket_t*"));
-    status = socket->recv(&msg);
-  } catch(std::exception& e) {
-    REprintf("%s\n",e.what());
-  }
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
+  if(!socket) { REprintf("bad socket object.\n");return R_NilValue; }
+  status = receiveMessage(socket, &msg, 0);
   if(status) {
     if(msg.size() != sizeof(double)) {
       REprintf("bad double size on remote machine.\n");
@@ -679,11 +1028,518 @@ SEXP receiveDouble(SEXP socket_) {
   return R_NilValue;
 }
 
+// Chunked object streaming: R_Serialize writes straight into fixed size
+// chunks, each sent as a message of its own, and R_Unserialize reads them
+// back one at a time.  Neither side ever builds the full serialized
+// RAWSXP or a full size copy of it, and since every chunk is a complete
+// message, libzmq only holds as many of them as the high water marks
+// allow.  Each chunk starts with "RZS", a flags byte marking the last
+// chunk, and its sequence number as a little endian uint32, so a lost or
+// foreign message is caught rather than unserialized.
+static const unsigned char CHUNK_MAGIC[] = { 'R', 'Z', 'S' };
+static const size_t CHUNK_HEADER = sizeof(CHUNK_MAGIC) + 1 + sizeof(uint32_t);
+static const unsigned char CHUNK_LAST = 1;
+
+struct chunkedWriter {
+  zmq::socket_t* socket;
+  size_t chunk_size;
+  char* buf;
+  size_t fill;
+  uint32_t seq;
+  bool failed;
+};
+
+struct chunkedReader {
+  zmq::socket_t* socket;
+  zmq::message_t msg;
+  size_t pos;
+  uint32_t seq;
+  bool last;
+};
+
+static void freeChunk(void* data, void* hint) {
+  free(data);
+}
+
+static void flushChunk(chunkedWriter* w, bool last, int flags) {
+  unsigned char* header = reinterpret_cast<unsigned char*>(w->buf);
+  memcpy(header, CHUNK_MAGIC, sizeof(CHUNK_MAGIC));
+  header[sizeof(CHUNK_MAGIC)] = last ? CHUNK_LAST : 0;
+  for(size_t i = 0; i < sizeof(uint32_t); i++)
+    header[sizeof(CHUNK_MAGIC) + 1 + i] = (w->seq >> (8 * i)) & 0xff;
+  w->seq++;
+  try {
+    // zmq owns the chunk from here on and frees it once it is on the wire
+    zmq::message_t msg(w->buf, CHUNK_HEADER + w->fill, freeChunk, NULL);
+    w->buf = NULL;
+    w->fill = 0;
+    if(!sendMessage(w->socket, msg, flags)) {
+      w->failed = true;
+    }
+  } catch(std::exception& e) {
+    reportError(e);
+    w->failed = true;
+  }
+}
+
+static void chunkedOutBytes(R_outpstream_t stream, void* buf, int length) {
+  chunkedWriter* w = reinterpret_cast<chunkedWriter*>(stream->data);
+  const char* src = reinterpret_cast<const char*>(buf);
+  size_t remaining = length;
+  while(remaining > 0 && !w->failed) {
+    // only flush a full chunk once more data arrives, so the last chunk
+    // can be marked and sent with the caller's flags
+    if(w->buf && w->fill == w->chunk_size) {
+      flushChunk(w, false, 0);
+      continue;
+    }
+    if(!w->buf) {
+      w->buf = reinterpret_cast<char*>(malloc(CHUNK_HEADER + w->chunk_size));
+      if(!w->buf) {
+        REprintf("failed to allocate stream chunk.\n");
+        w->failed = true;
+        return;
+      }
+    }
+    size_t n = std::min(remaining, w->chunk_size - w->fill);
+    memcpy(w->buf + CHUNK_HEADER + w->fill, src, n);
+    w->fill += n;
+    src += n;
+    remaining -= n;
+  }
+}
+
+static void chunkedOutChar(R_outpstream_t stream, int c) {
+  char ch = static_cast<char>(c);
+  chunkedOutBytes(stream, &ch, 1);
+}
+
+struct chunkedSerialize {
+  SEXP data;
+  R_outpstream_t out;
+};
+
+static void chunkedSerializeFn(void* data) {
+  chunkedSerialize* call = reinterpret_cast<chunkedSerialize*>(data);
+  R_Serialize(call->data, call->out);
+}
+
+// checks the header of the chunk just received; false for anything that
+// is not the next chunk of the stream
+static bool readChunkHeader(chunkedReader* r) {
+  const unsigned char* header = reinterpret_cast<const unsigned char*>(r->msg.data());
+  if(r->msg.size() < CHUNK_HEADER || memcmp(header, CHUNK_MAGIC, sizeof(CHUNK_MAGIC)) != 0)
+    return false;
+  uint32_t seq = 0;
+  for(size_t i = 0; i < sizeof(uint32_t); i++)
+    seq |= static_cast<uint32_t>(header[sizeof(CHUNK_MAGIC) + 1 + i]) << (8 * i);
+  if(seq != r->seq)
+    return false;
+  r->seq++;
+  r->last = header[sizeof(CHUNK_MAGIC)] & CHUNK_LAST;
+  r->pos = CHUNK_HEADER;
+  return true;
+}
+
+static void chunkedInBytes(R_inpstream_t stream, void* buf, int length) {
+  chunkedReader* r = reinterpret_cast<chunkedReader*>(stream->data);
+  char* dest = reinterpret_cast<char*>(buf);
+  size_t remaining = length;
+  while(remaining > 0) {
+    if(r->pos == r->msg.size()) {
+      if(r->last) {
+        Rf_error("chunked stream ended before the object was complete.");
+      }
+      if(!receiveMessage(r->socket, &r->msg, 0)) {
+        Rf_error("failed to receive the next chunk of the stream.");
+      }
+      if(!readChunkHeader(r)) {
+        Rf_error("chunked stream out of sequence at chunk %u.", r->seq);
+      }
+      continue;
+    }
+    size_t n = std::min(remaining, r->msg.size() - r->pos);
+    memcpy(dest, reinterpret_cast<const char*>(r->msg.data()) + r->pos, n);
+    r->pos += n;
+    dest += n;
+    remaining -= n;
+  }
+}
+
+static int chunkedInChar(R_inpstream_t stream) {
+  unsigned char ch;
+  chunkedInBytes(stream, &ch, 1);
+  return ch;
+}
+
+static void chunkedReaderFinalizer(SEXP reader_) {
+  chunkedReader* reader = reinterpret_cast<chunkedReader*>(R_ExternalPtrAddr(reader_));
+  if(reader) {
+    delete reader;
+    R_ClearExternalPtr(reader_);
+  }
+}
+
+SEXP sendChunked(SEXP socket_, SEXP data_, SEXP chunk_size_, SEXP xdr_, SEXP send_more_) {
+
+  if(TYPEOF(send_more_) != LGLSXP) {
+    REprintf("send.more type must be logical (LGLSXP).\n");
+    return R_NilValue;
+  }
+
+  if(TYPEOF(xdr_) != LGLSXP) {
+    REprintf("xdr type must be logical (LGLSXP).\n");
+    return R_NilValue;
+  }
+
+  double chunk_size = Rf_asReal(chunk_size_);
+  if(!(chunk_size >= 1)) {
+    REprintf("chunk.size must be a positive number of bytes.\n");
+    return R_NilValue;
+  }
+
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
+  if(!socket) {
+    REprintf("bad socket object.\n");
+    return R_NilValue;
+  }
+
+  chunkedWriter w = { socket, static_cast<size_t>(chunk_size), NULL, 0, 0, false };
+  struct R_outpstream_st out;
+  R_InitOutPStream(&out, reinterpret_cast<R_pstream_data_t>(&w),
+                   LOGICAL(xdr_)[0] ? R_pstream_xdr_format : R_pstream_binary_format, 3,
+                   chunkedOutChar, chunkedOutBytes, NULL, R_NilValue);
+  // serialize() can fail part way, or be interrupted; the error is
+  // printed and the chunk buffer must not leak
+  chunkedSerialize call = { data_, &out };
+  if(!R_ToplevelExec(chunkedSerializeFn, &call)) {
+    // chunks already sent are closed with an empty last one, so the
+    // receiver fails on this stream instead of reading on into the next
+    if(w.seq > 0 && !w.failed) {
+      if(!w.buf)
+        w.buf = reinterpret_cast<char*>(malloc(CHUNK_HEADER));
+      if(w.buf) {
+        w.fill = 0;
+        flushChunk(&w, true, 0);
+      }
+    }
+    free(w.buf);
+    return statusResult(false);
+  }
+
+  if(!w.failed) {
+    flushChunk(&w, true, LOGICAL(send_more_)[0] ? ZMQ_SNDMORE : 0);
+  }
+  free(w.buf);
+
+  return statusResult(!w.failed);
+}
+
+SEXP receiveChunked(SEXP socket_, SEXP dont_wait_) {
+  if(TYPEOF(dont_wait_) != LGLSXP) {
+    REprintf("dont_wait type must be logical (LGLSXP).\n");
+    return R_NilValue;
+  }
+
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
+  if(!socket) {
+    REprintf("bad socket object.\n");
+    return R_NilValue;
+  }
+
+  // the reader lives behind an external pointer so an unserialize error
+  // (which longjmps) still releases the current frame at the next gc
+  chunkedReader* reader = new chunkedReader;
+  reader->socket = socket;
+  reader->pos = 0;
+  reader->seq = 0;
+  reader->last = false;
+  SEXP reader_ = PROTECT(R_MakeExternalPtr(reinterpret_cast<void*>(reader),R_NilValue,R_NilValue));
+  R_RegisterCFinalizerEx(reader_, chunkedReaderFinalizer, TRUE);
+
+  bool status(false);
+  status = receiveMessage(socket, &reader->msg, LOGICAL(dont_wait_)[0] ? ZMQ_DONTWAIT : 0);
+  if(!status) {
+    UNPROTECT(1);
+    return R_NilValue;
+  }
+  if(!readChunkHeader(reader)) {
+    REprintf("message is not the start of a chunked stream.\n");
+    UNPROTECT(1);
+    return R_NilValue;
+  }
+
+  struct R_inpstream_st in;
+  R_InitInPStream(&in, reinterpret_cast<R_pstream_data_t>(reader), R_pstream_any_format,
+                  chunkedInChar, chunkedInBytes, NULL, R_NilValue);
+  SEXP ans = PROTECT(R_Unserialize(&in));
+  if(!reader->last) {
+    Rf_warning("chunked stream continues after the object.");
+  } else if(reader->pos != reader->msg.size()) {
+    Rf_warning("chunked stream has %d trailing bytes.", static_cast<int>(reader->msg.size() - reader->pos));
+  }
+  chunkedReaderFinalizer(reader_);
+  UNPROTECT(2);
+  return ans;
+}
+
+// File sends map the requested region and hand the mapping to zmq, so
+// the bytes go to the wire without passing through R.  When the region
+// is split into several frames they share one mapping, released by
+// whichever frame zmq frees last.
+struct fileMapping {
+  void* base;
+  size_t length;
+  std::atomic<size_t> refs;
+};
+
+static void dropMapping(fileMapping* mapping, size_t refs) {
+  if((mapping->refs -= refs) == 0) {
+#ifndef _WIN32
+    if(mapping->base) munmap(mapping->base, mapping->length);
+#else
+    free(mapping->base);
+#endif
+    delete mapping;
+  }
+}
+
+static void releaseMapping(void* data, void* hint) {
+  dropMapping(reinterpret_cast<fileMapping*>(hint), 1);
+}
+
+// returns the mapping of [offset, offset + length) and the address of
+// offset inside it, or NULL with a message printed
+static fileMapping* mapFileRegion(const char* path, double offset, double* length, char** data) {
+#ifndef _WIN32
+  int fd = open(path, O_RDONLY);
+  if(fd < 0) {
+    REprintf("cannot open file %s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+  struct stat st;
+  if(fstat(fd, &st) != 0) {
+    REprintf("cannot stat file %s: %s\n", path, strerror(errno));
+    close(fd);
+    return NULL;
+  }
+  double file_size = static_cast<double>(st.st_size);
+#else
+  FILE* fp = fopen(path, "rb");
+  if(!fp) {
+    REprintf("cannot open file %s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+  _fseeki64(fp, 0, SEEK_END);
+  double file_size = static_cast<double>(_ftelli64(fp));
+#endif
+  if(*length < 0) {
+    *length = file_size - offset;
+  }
+  // written so that NaN fails every test
+  if(!(offset >= 0) || !(*length >= 0) || !(offset + *length <= file_size)) {
+    REprintf("region [%.0f, %.0f) is outside of file %s.\n", offset, offset + *length, path);
+#ifndef _WIN32
+    close(fd);
+#else
+    fclose(fp);
+#endif
+    return NULL;
+  }
+
+  fileMapping* mapping = new fileMapping;
+  mapping->refs = 0;
+#ifndef _WIN32
+  // mmap offsets must be page aligned
+  off_t page = sysconf(_SC_PAGESIZE);
+  off_t aligned = static_cast<off_t>(offset) - static_cast<off_t>(offset) % page;
+  mapping->length = static_cast<size_t>(*length) + (static_cast<off_t>(offset) - aligned);
+  mapping->base = mapping->length ? mmap(NULL, mapping->length, PROT_READ, MAP_SHARED, fd, aligned) : NULL;
+  close(fd);
+  if(mapping->base == MAP_FAILED) {
+    REprintf("cannot map file %s: %s\n", path, strerror(errno));
+    delete mapping;
+    return NULL;
+  }
+  if(mapping->base) {
+    madvise(mapping->base, mapping->length, MADV_SEQUENTIAL);
+  }
+  *data = mapping->base ? reinterpret_cast<char*>(mapping->base) + (static_cast<off_t>(offset) - aligned) : NULL;
+#else
+  // no mmap here, read the region into a single buffer instead
+  mapping->length = static_cast<size_t>(*length);
+  mapping->base = malloc(mapping->length ? mapping->length : 1);
+  _fseeki64(fp, static_cast<__int64>(offset), SEEK_SET);
+  if(!mapping->base || fread(mapping->base, 1, mapping->length, fp) != mapping->length) {
+    REprintf("cannot read file %s.\n", path);
+    free(mapping->base);
+    fclose(fp);
+    delete mapping;
+    return NULL;
+  }
+  fclose(fp);
+  *data = reinterpret_cast<char*>(mapping->base);
+#endif
+  return mapping;
+}
+
+SEXP sendFile(SEXP socket_, SEXP path_, SEXP offset_, SEXP length_, SEXP frame_size_, SEXP send_more_) {
+
+  if(TYPEOF(path_) != STRSXP) {
+    REprintf("path must be a string.\n");
+    return R_NilValue;
+  }
+
+  if(TYPEOF(send_more_) != LGLSXP) {
+    REprintf("send.more type must be logical (LGLSXP).\n");
+    return R_NilValue;
+  }
+
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
+  if(!socket) {
+    REprintf("bad socket object.\n");
+    return R_NilValue;
+  }
+
+  const char* path = Rf_translateChar(STRING_ELT(path_,0));
+  double length = Rf_asReal(length_);
+  char* data;
+  fileMapping* mapping = mapFileRegion(path, Rf_asReal(offset_), &length, &data);
+  if(!mapping) {
+    return R_NilValue;
+  }
+
+  size_t total = static_cast<size_t>(length);
+  double frame_size_value = Rf_asReal(frame_size_);
+  size_t frame_size = frame_size_value >= 1 && frame_size_value < length ? static_cast<size_t>(frame_size_value) : total;
+  size_t nframes = (total && frame_size) ? (total + frame_size - 1) / frame_size : 1;
+  // one reference per frame plus our own until all frames are built
+  mapping->refs = nframes + 1;
+
+  bool status(true);
+  size_t built = 0, sent = 0;
+  for(size_t i = 0; i < nframes && status; i++) {
+    size_t n = std::min(frame_size, total - sent);
+    int flags = (i + 1 < nframes || LOGICAL(send_more_)[0]) ? ZMQ_SNDMORE : 0;
+    try {
+      zmq::message_t msg(data ? data + sent : NULL, n, releaseMapping, mapping);
+      built++;
+      status = sendMessage(socket, msg, flags);
+    } catch(std::exception& e) {
+      reportError(e);
+      status = false;
+    }
+    sent += n;
+  }
+  dropMapping(mapping, nframes - built + 1);
+
+  return statusResult(status);
+}
+
+// write len bytes at offset of path, growing the file as needed
+static bool writeFileRegion(const char* path, double offset, const void* data, size_t len) {
+#ifndef _WIN32
+  int fd = open(path, O_RDWR | O_CREAT, 0666);
+  if(fd < 0) {
+    REprintf("cannot open file %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  struct stat st;
+  off_t end = static_cast<off_t>(offset) + len;
+  if(fstat(fd, &st) != 0 || (st.st_size < end && ftruncate(fd, end) != 0)) {
+    REprintf("cannot resize file %s: %s\n", path, strerror(errno));
+    close(fd);
+    return false;
+  }
+  if(len == 0) {
+    close(fd);
+    return true;
+  }
+  off_t page = sysconf(_SC_PAGESIZE);
+  off_t aligned = static_cast<off_t>(offset) - static_cast<off_t>(offset) % page;
+  size_t map_len = len + (static_cast<off_t>(offset) - aligned);
+  void* base = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, aligned);
+  close(fd);
+  if(base == MAP_FAILED) {
+    REprintf("cannot map file %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  memcpy(reinterpret_cast<char*>(base) + (static_cast<off_t>(offset) - aligned), data, len);
+  munmap(base, map_len);
+  return true;
+#else
+  FILE* fp = fopen(path, "r+b");
+  if(!fp) fp = fopen(path, "w+b");
+  if(!fp) {
+    REprintf("cannot open file %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  bool status = _fseeki64(fp, static_cast<__int64>(offset), SEEK_SET) == 0 &&
+    fwrite(data, 1, len, fp) == len;
+  if(!status) REprintf("cannot write file %s.\n", path);
+  fclose(fp);
+  return status;
+#endif
+}
+
+SEXP receiveInto(SEXP socket_, SEXP target_, SEXP offset_, SEXP dont_wait_) {
+  SEXP ans;
+  zmq::message_t msg;
+
+  if(TYPEOF(dont_wait_) != LGLSXP) {
+    REprintf("dont_wait type must be logical (LGLSXP).\n");
+    return R_NilValue;
+  }
+
+  double offset = Rf_asReal(offset_);
+  if(!(offset >= 0)) {
+    REprintf("offset must be a non-negative number of bytes.\n");
+    return R_NilValue;
+  }
+
+  size_t capacity = 0;
+  char* dest = NULL;
+  if(TYPEOF(target_) != STRSXP) {
+    dest = vectorBytes(target_, &capacity);
+    if(!dest) {
+      REprintf("target must be a file path or a raw, logical, integer, double or complex vector.\n");
+      return R_NilValue;
+    }
+  }
+
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
+  if(!socket) {
+    REprintf("bad socket object.\n");
+    return R_NilValue;
+  }
+
+  bool status(false);
+  status = receiveMessage(socket, &msg, LOGICAL(dont_wait_)[0] ? ZMQ_DONTWAIT : 0);
+  if(!status)
+    return R_NilValue;
+
+  if(dest) {
+    if(offset + msg.size() > capacity) {
+      REprintf("message of %.0f bytes does not fit at offset %.0f of a %.0f byte target.\n",
+               static_cast<double>(msg.size()), offset, static_cast<double>(capacity));
+      return R_NilValue;
+    }
+    memcpy(dest + static_cast<size_t>(offset), msg.data(), msg.size());
+  } else if(!writeFileRegion(Rf_translateChar(STRING_ELT(target_,0)), offset, msg.data(), msg.size())) {
+    return R_NilValue;
+  }
+
+  PROTECT(ans = Rf_allocVector(REALSXP,1));
+  REAL(ans)[0] = static_cast<double>(msg.size());
+  UNPROTECT(1);
+  return ans;
+}
+
 #if ZMQ_VERSION_MAJOR < 3
 // removed from libzmq3
 SEXP set_hwm(SEXP socket_, SEXP option_value_) {
 
-  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,"zmq::socket_t*"));
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
   if(!socket) { REprintf("bad socket object.\n");return R_NilValue; }
   if(TYPEOF(option_value_)!=INTSXP) { REprintf("option value must be an int.\n");return R_NilValue; }
   SEXP ans; PROTECT(ans = Rf_allocVector(LGLSXP,1)); LOGICAL(ans)[0] = 1;
@@ -692,20 +1548,26 @@ SEXP set_hwm(SEXP socket_, SEXP option_value_) {
   try {
     socket->setsockopt(ZMQ_HWM, &option_value, sizeof(uint64_t));
   } catch(std::exception& e) {
-    REprintf("%s\n",e.what());
+    reportError(e);
     LOGICAL(ans)[0] = 0;
   }
   UNPROTECT(1);
   return ans;
 }
 
+#else
+// kept so the registered routine resolves; the R wrapper stops first
+SEXP set_hwm(SEXP socket_, SEXP option_value_) {
+  REprintf("ZMQ_HWM is not available in libzmq3.\n");
+  return R_NilValue;
+}
 #endif
 
 #if ZMQ_VERSION_MAJOR < 3
 // removed from libzmq3
 SEXP set_swap(SEXP socket_, SEXP option_value_) {
 
-  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,"zmq::socket_t*"));
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
   if(!socket) { REprintf("bad socket object.\n");return R_NilValue; }
   if(TYPEOF(option_value_)!=INTSXP) { REprintf("option value must be an int.\n");return R_NilValue; }
   SEXP ans; PROTECT(ans = Rf_allocVector(LGLSXP,1)); LOGICAL(ans)[0] = 1;
@@ -714,17 +1576,23 @@ SEXP set_swap(SEXP socket_, SEXP option_value_) {
   try {
     socket->setsockopt(ZMQ_SWAP, &option_value, sizeof(int64_t));
   } catch(std::exception& e) {
-    REprintf("%s\n",e.what());
+    reportError(e);
     LOGICAL(ans)[0] = 0;
   }
   UNPROTECT(1);
   return ans;
 }
+#else
+// kept so the registered routine resolves; the R wrapper stops first
+SEXP set_swap(SEXP socket_, SEXP option_value_) {
+  REprintf("ZMQ_SWAP is not available in libzmq3.\n");
+  return R_NilValue;
+}
 #endif
 
 SEXP set_affinity(SEXP socket_, SEXP option_value_) {
 
-  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,"zmq::socket_t*"));
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
   if(!socket) { REprintf("bad socket object.\n");return R_NilValue; }
   if(TYPEOF(option_value_)!=INTSXP) { REprintf("option value must be an int.\n");return R_NilValue; }
   SEXP ans; PROTECT(ans = Rf_allocVector(LGLSXP,1)); LOGICAL(ans)[0] = 1;
@@ -733,7 +1601,7 @@ SEXP set_affinity(SEXP socket_, SEXP option_value_) {
   try {
     socket->setsockopt(ZMQ_AFFINITY, &option_value, sizeof(uint64_t));
   } catch(std::exception& e) {
-    REprintf("%s\n",e.what());
+    reportError(e);
     LOGICAL(ans)[0] = 0;
   }
   UNPROTECT(1);
@@ -742,7 +1610,7 @@ SEXP set_affinity(SEXP socket_, SEXP option_value_) {
 
 SEXP set_identity(SEXP socket_, SEXP option_value_) {
 
-  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,"zmq::socket_t*"));
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
   if(!socket) { REprintf("bad socket object.\n");return R_NilValue; }
   if(TYPEOF(option_value_)!=STRSXP) { REprintf("option value must be a string.\n");return R_NilValue; }
   SEXP ans; PROTECT(ans = Rf_allocVector(LGLSXP,1)); LOGICAL(ans)[0] = 1;
@@ -750,7 +1618,7 @@ SEXP set_identity(SEXP socket_, SEXP option_value_) {
   try {
     socket->setsockopt(ZMQ_IDENTITY, option_value,strlen(option_value));
   } catch(std::exception& e) {
-    REprintf("%s\n",e.what());
+    reportError(e);
     LOGICAL(ans)[0] = 0;
   }
   UNPROTECT(1);
@@ -759,7 +1627,7 @@ SEXP set_identity(SEXP socket_, SEXP option_value_) {
 
 SEXP subscribe(SEXP socket_, SEXP option_value_) {
 
-  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,"zmq::socket_t*"));
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
   if(!socket) { REprintf("bad socket object.\n");return R_NilValue; }
   if(TYPEOF(option_value_)!=STRSXP) { REprintf("option value must be a string.\n");return R_NilValue; }
   SEXP ans; PROTECT(ans = Rf_allocVector(LGLSXP,1)); LOGICAL(ans)[0] = 1;
@@ -767,7 +1635,7 @@ SEXP subscribe(SEXP socket_, SEXP option_value_) {
   try {
     socket->setsockopt(ZMQ_SUBSCRIBE, option_value,strlen(option_value));
   } catch(std::exception& e) {
-    REprintf("%s\n",e.what());
+    reportError(e);
     LOGICAL(ans)[0] = 0;
   }
   UNPROTECT(1);
@@ -776,7 +1644,7 @@ SEXP subscribe(SEXP socket_, SEXP option_value_) {
 
 SEXP unsubscribe(SEXP socket_, SEXP option_value_) {
 
-  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,"zmq::socket_t*"));
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
   if(!socket) { REprintf("bad socket object.\n");return R_NilValue; }
   if(TYPEOF(option_value_)!=STRSXP) { REprintf("option value must be a string.\n");return R_NilValue; }
   SEXP ans; PROTECT(ans = Rf_allocVector(LGLSXP,1)); LOGICAL(ans)[0] = 1;
@@ -784,7 +1652,7 @@ SEXP unsubscribe(SEXP socket_, SEXP option_value_) {
   try {
     socket->setsockopt(ZMQ_UNSUBSCRIBE, option_value,strlen(option_value));
   } catch(std::exception& e) {
-    REprintf("%s\n",e.what());
+    reportError(e);
     LOGICAL(ans)[0] = 0;
   }
   UNPROTECT(1);
@@ -793,7 +1661,7 @@ SEXP unsubscribe(SEXP socket_, SEXP option_value_) {
 
 SEXP set_rate(SEXP socket_, SEXP option_value_) {
 
-  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,"zmq::socket_t*"));
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
   if(!socket) { REprintf("bad socket object.\n");return R_NilValue; }
   if(TYPEOF(option_value_)!=INTSXP) { REprintf("option value must be an int.\n");return R_NilValue; }
   SEXP ans; PROTECT(ans = Rf_allocVector(LGLSXP,1)); LOGICAL(ans)[0] = 1;
@@ -807,7 +1675,7 @@ SEXP set_rate(SEXP socket_, SEXP option_value_) {
   try {
     socket->setsockopt(ZMQ_RATE, &option_value, sizeof(int64_t));
   } catch(std::exception& e) {
-    REprintf("%s\n",e.what());
+    reportError(e);
     LOGICAL(ans)[0] = 0;
   }
   UNPROTECT(1);
@@ -816,7 +1684,7 @@ SEXP set_rate(SEXP socket_, SEXP option_value_) {
 
 SEXP set_recovery_ivl(SEXP socket_, SEXP option_value_) {
 
-  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,"zmq::socket_t*"));
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
   if(!socket) { REprintf("bad socket object.\n");return R_NilValue; }
   if(TYPEOF(option_value_)!=INTSXP) { REprintf("option value must be an int.\n");return R_NilValue; }
   SEXP ans; PROTECT(ans = Rf_allocVector(LGLSXP,1)); LOGICAL(ans)[0] = 1;
@@ -829,7 +1697,7 @@ SEXP set_recovery_ivl(SEXP socket_, SEXP option_value_) {
   try {
     socket->setsockopt(ZMQ_RECOVERY_IVL, &option_value, sizeof(int64_t));
   } catch(std::exception& e) {
-    REprintf("%s\n",e.what());
+    reportError(e);
     LOGICAL(ans)[0] = 0;
   }
   UNPROTECT(1);
@@ -841,7 +1709,7 @@ SEXP set_recovery_ivl(SEXP socket_, SEXP option_value_) {
 // removed from libzmq3
 SEXP set_recovery_ivl_msec(SEXP socket_, SEXP option_value_) {
 
-  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,"zmq::socket_t*"));
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
   if(!socket) { REprintf("bad socket object.\n");return R_NilValue; }
   if(TYPEOF(option_value_)!=INTSXP) { REprintf("option value must be an int.\n");return R_NilValue; }
   SEXP ans; PROTECT(ans = Rf_allocVector(LGLSXP,1)); LOGICAL(ans)[0] = 1;
@@ -850,19 +1718,25 @@ SEXP set_recovery_ivl_msec(SEXP socket_, SEXP option_value_) {
   try {
     socket->setsockopt(ZMQ_RECOVERY_IVL_MSEC, &option_value, sizeof(int64_t));
   } catch(std::exception& e) {
-    REprintf("%s\n",e.what());
+    reportError(e);
     LOGICAL(ans)[0] = 0;
   }
   UNPROTECT(1);
   return ans;
 }
+#else
+// kept so the registered routine resolves; the R wrapper stops first
+SEXP set_recovery_ivl_msec(SEXP socket_, SEXP option_value_) {
+  REprintf("ZMQ_RECOVERY_IVL_MSEC is not available in libzmq3.\n");
+  return R_NilValue;
+}
 #endif
 
 #if ZMQ_VERSION_MAJOR < 3
 // removed from libzmq3
 SEXP set_mcast_loop(SEXP socket_, SEXP option_value_) {
 
-  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,"zmq::socket_t*"));
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
   if(!socket) { REprintf("bad socket object.\n");return R_NilValue; }
   if(TYPEOF(option_value_)!=LGLSXP) { REprintf("option value must be a logical.\n");return R_NilValue; }
   SEXP ans; PROTECT(ans = Rf_allocVector(LGLSXP,1)); LOGICAL(ans)[0] = 1;
@@ -871,17 +1745,23 @@ SEXP set_mcast_loop(SEXP socket_, SEXP option_value_) {
   try {
     socket->setsockopt(ZMQ_MCAST_LOOP, &option_value, sizeof(int64_t));
   } catch(std::exception& e) {
-    REprintf("%s\n",e.what());
+    reportError(e);
     LOGICAL(ans)[0] = 0;
   }
   UNPROTECT(1);
   return ans;
 }
+#else
+// kept so the registered routine resolves; the R wrapper stops first
+SEXP set_mcast_loop(SEXP socket_, SEXP option_value_) {
+  REprintf("ZMQ_MCAST_LOOP is not available in libzmq3.\n");
+  return R_NilValue;
+}
 #endif
 
 SEXP set_sndbuf(SEXP socket_, SEXP option_value_) {
 
-  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,"zmq::socket_t*"));
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
   if(!socket) { REprintf("bad socket object.\n");return R_NilValue; }
   if(TYPEOF(option_value_)!=INTSXP) { REprintf("option value must be an int.\n");return R_NilValue; }
   SEXP ans; PROTECT(ans = Rf_allocVector(LGLSXP,1)); LOGICAL(ans)[0] = 1;
@@ -896,7 +1776,7 @@ SEXP set_sndbuf(SEXP socket_, SEXP option_value_) {
   try {
     socket->setsockopt(ZMQ_SNDBUF, &option_value, sizeof(uint64_t));
   } catch(std::exception& e) {
-    REprintf("%s\n",e.what());
+    reportError(e);
     LOGICAL(ans)[0] = 0;
   }
   UNPROTECT(1);
@@ -905,7 +1785,7 @@ SEXP set_sndbuf(SEXP socket_, SEXP option_value_) {
 
 SEXP set_rcvbuf(SEXP socket_, SEXP option_value_) {
 
-  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,"zmq::socket_t*"));
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
   if(!socket) { REprintf("bad socket object.\n");return R_NilValue; }
   if(TYPEOF(option_value_)!=INTSXP) { REprintf("option value must be an int.\n");return R_NilValue; }
   SEXP ans; PROTECT(ans = Rf_allocVector(LGLSXP,1)); LOGICAL(ans)[0] = 1;
@@ -920,7 +1800,7 @@ SEXP set_rcvbuf(SEXP socket_, SEXP option_value_) {
   try {
     socket->setsockopt(ZMQ_RCVBUF, &option_value, sizeof(uint64_t));
   } catch(std::exception& e) {
-    REprintf("%s\n",e.what());
+    reportError(e);
     LOGICAL(ans)[0] = 0;
   }
   UNPROTECT(1);
@@ -929,7 +1809,7 @@ SEXP set_rcvbuf(SEXP socket_, SEXP option_value_) {
 
 SEXP set_linger(SEXP socket_, SEXP option_value_) {
 
-  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,"zmq::socket_t*"));
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
   if(!socket) { REprintf("bad socket object.\n");return R_NilValue; }
   if(TYPEOF(option_value_)!=INTSXP) { REprintf("option value must be an int.\n");return R_NilValue; }
   SEXP ans; PROTECT(ans = Rf_allocVector(LGLSXP,1)); LOGICAL(ans)[0] = 1;
@@ -938,7 +1818,7 @@ SEXP set_linger(SEXP socket_, SEXP option_value_) {
   try {
     socket->setsockopt(ZMQ_LINGER, &option_value, sizeof(int));
   } catch(std::exception& e) {
-    REprintf("%s\n",e.what());
+    reportError(e);
     LOGICAL(ans)[0] = 0;
   }
   UNPROTECT(1);
@@ -947,7 +1827,7 @@ SEXP set_linger(SEXP socket_, SEXP option_value_) {
 
 SEXP set_reconnect_ivl(SEXP socket_, SEXP option_value_) {
 
-  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,"zmq::socket_t*"));
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
   if(!socket) { REprintf("bad socket object.\n");return R_NilValue; }
   if(TYPEOF(option_value_)!=INTSXP) { REprintf("option value must be an int.\n");return R_NilValue; }
   SEXP ans; PROTECT(ans = Rf_allocVector(LGLSXP,1)); LOGICAL(ans)[0] = 1;
@@ -956,7 +1836,7 @@ SEXP set_reconnect_ivl(SEXP socket_, SEXP option_value_) {
   try {
     socket->setsockopt(ZMQ_RECONNECT_IVL, &option_value, sizeof(int));
   } catch(std::exception& e) {
-    REprintf("%s\n",e.what());
+    reportError(e);
     LOGICAL(ans)[0] = 0;
   }
   UNPROTECT(1);
@@ -965,7 +1845,7 @@ SEXP set_reconnect_ivl(SEXP socket_, SEXP option_value_) {
 
 SEXP set_zmq_backlog(SEXP socket_, SEXP option_value_) {
 
-  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,"zmq::socket_t*"));
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
   if(!socket) { REprintf("bad socket object.\n");return R_NilValue; }
   if(TYPEOF(option_value_)!=INTSXP) { REprintf("option value must be an int.\n");return R_NilValue; }
   SEXP ans; PROTECT(ans = Rf_allocVector(LGLSXP,1)); LOGICAL(ans)[0] = 1;
@@ -974,7 +1854,7 @@ SEXP set_zmq_backlog(SEXP socket_, SEXP option_value_) {
   try {
     socket->setsockopt(ZMQ_BACKLOG, &option_value, sizeof(int));
   } catch(std::exception& e) {
-    REprintf("%s\n",e.what());
+    reportError(e);
     LOGICAL(ans)[0] = 0;
   }
   UNPROTECT(1);
@@ -983,7 +1863,7 @@ SEXP set_zmq_backlog(SEXP socket_, SEXP option_value_) {
 
 SEXP set_reconnect_ivl_max(SEXP socket_, SEXP option_value_) {
 
-  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,"zmq::socket_t*"));
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
   if(!socket) { REprintf("bad socket object.\n");return R_NilValue; }
   if(TYPEOF(option_value_)!=INTSXP) { REprintf("option value must be an int.\n");return R_NilValue; }
   SEXP ans; PROTECT(ans = Rf_allocVector(LGLSXP,1)); LOGICAL(ans)[0] = 1;
@@ -992,16 +1872,65 @@ SEXP set_reconnect_ivl_max(SEXP socket_, SEXP option_value_) {
   try {
     socket->setsockopt(ZMQ_RECONNECT_IVL_MAX, &option_value, sizeof(int));
   } catch(std::exception& e) {
-    REprintf("%s\n",e.what());
+    reportError(e);
     LOGICAL(ans)[0] = 0;
   }
   UNPROTECT(1);
   return ans;
 }
 
+// ZMQ_HEARTBEAT_* arrived in libzmq 4.2
+#ifdef ZMQ_HEARTBEAT_IVL
+static SEXP setHeartbeatOption(SEXP socket_, SEXP option_value_, int option) {
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
+  if(!socket) { REprintf("bad socket object.\n");return R_NilValue; }
+  if(TYPEOF(option_value_)!=INTSXP) { REprintf("option value must be an int.\n");return R_NilValue; }
+  SEXP ans; PROTECT(ans = Rf_allocVector(LGLSXP,1)); LOGICAL(ans)[0] = 1;
+
+  int option_value(INTEGER(option_value_)[0]);
+  try {
+    socket->setsockopt(option, &option_value, sizeof(int));
+  } catch(std::exception& e) {
+    reportError(e);
+    LOGICAL(ans)[0] = 0;
+  }
+  UNPROTECT(1);
+  return ans;
+}
+#else
+static SEXP heartbeatUnavailable() {
+  REprintf("heartbeats require libzmq 4.2 or later.\n");
+  return R_NilValue;
+}
+#endif
+
+SEXP set_heartbeat_ivl(SEXP socket_, SEXP option_value_) {
+#ifdef ZMQ_HEARTBEAT_IVL
+  return setHeartbeatOption(socket_, option_value_, ZMQ_HEARTBEAT_IVL);
+#else
+  return heartbeatUnavailable();
+#endif
+}
+
+SEXP set_heartbeat_timeout(SEXP socket_, SEXP option_value_) {
+#ifdef ZMQ_HEARTBEAT_IVL
+  return setHeartbeatOption(socket_, option_value_, ZMQ_HEARTBEAT_TIMEOUT);
+#else
+  return heartbeatUnavailable();
+#endif
+}
+
+SEXP set_heartbeat_ttl(SEXP socket_, SEXP option_value_) {
+#ifdef ZMQ_HEARTBEAT_IVL
+  return setHeartbeatOption(socket_, option_value_, ZMQ_HEARTBEAT_TTL);
+#else
+  return heartbeatUnavailable();
+#endif
+}
+
 SEXP set_sndtimeo(SEXP socket_, SEXP option_value_) {
 
-  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,"zmq::socket_t*"));
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
   if(!socket) { REprintf("bad socket object.\n");return R_NilValue; }
   if(TYPEOF(option_value_)!=INTSXP) { REprintf("option value must be an int.\n");return R_NilValue; }
   SEXP ans; PROTECT(ans = Rf_allocVector(LGLSXP,1)); LOGICAL(ans)[0] = 1;
@@ -1010,7 +1939,7 @@ SEXP set_sndtimeo(SEXP socket_, SEXP option_value_) {
   try {
     socket->setsockopt(ZMQ_SNDTIMEO, &option_value, sizeof(int));
   } catch(std::exception& e) {
-    REprintf("%s\n",e.what());
+    reportError(e);
     LOGICAL(ans)[0] = 0;
   }
   UNPROTECT(1);
@@ -1019,7 +1948,7 @@ SEXP set_sndtimeo(SEXP socket_, SEXP option_value_) {
 
 SEXP set_rcvtimeo(SEXP socket_, SEXP option_value_) {
 
-  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,"zmq::socket_t*"));
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
   if(!socket) { REprintf("bad socket object.\n");return R_NilValue; }
   if(TYPEOF(option_value_)!=INTSXP) { REprintf("option value must be an int.\n");return R_NilValue; }
   SEXP ans; PROTECT(ans = Rf_allocVector(LGLSXP,1)); LOGICAL(ans)[0] = 1;
@@ -1028,7 +1957,7 @@ SEXP set_rcvtimeo(SEXP socket_, SEXP option_value_) {
   try {
     socket->setsockopt(ZMQ_RCVTIMEO, &option_value, sizeof(int));
   } catch(std::exception& e) {
-    REprintf("%s\n",e.what());
+    reportError(e);
     LOGICAL(ans)[0] = 0;
   }
   UNPROTECT(1);
@@ -1037,14 +1966,14 @@ SEXP set_rcvtimeo(SEXP socket_, SEXP option_value_) {
 
 SEXP get_last_endpoint(SEXP socket_) {
 
-  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,"zmq::socket_t*"));
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
   if(!socket) { REprintf("bad socket object.\n");return R_NilValue; }
   char option_value[1024];
   size_t option_value_len = sizeof(option_value);
   try {
     socket->getsockopt(ZMQ_LAST_ENDPOINT, option_value, &option_value_len);
   } catch(std::exception& e) {
-    REprintf("%s\n",e.what());
+    reportError(e);
     return R_NilValue;
   }
   SEXP ans; PROTECT(ans = Rf_allocVector(STRSXP,1));
@@ -1055,7 +1984,7 @@ SEXP get_last_endpoint(SEXP socket_) {
 
 SEXP get_sndtimeo(SEXP socket_) {
 
-  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,"zmq::socket_t*"));
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
   if(!socket) { REprintf("bad socket object.\n");return R_NilValue; }
 #if ZMQ_VERSION_MAJOR > 2
   int option_value;
@@ -1066,7 +1995,7 @@ SEXP get_sndtimeo(SEXP socket_) {
   try {
     socket->getsockopt(ZMQ_SNDTIMEO, &option_value, &option_value_len);
   } catch(std::exception& e) {
-    REprintf("%s\n",e.what());
+    reportError(e);
     return R_NilValue;
   }
   SEXP ans; PROTECT(ans = Rf_allocVector(REALSXP,1));
@@ -1077,7 +2006,7 @@ SEXP get_sndtimeo(SEXP socket_) {
 
 SEXP get_rcvtimeo(SEXP socket_) {
 
-  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,"zmq::socket_t*"));
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
   if(!socket) { REprintf("bad socket object.\n");return R_NilValue; }
 #if ZMQ_VERSION_MAJOR > 2
   int option_value;
@@ -1088,7 +2017,7 @@ SEXP get_rcvtimeo(SEXP socket_) {
   try {
     socket->getsockopt(ZMQ_RCVTIMEO, &option_value, &option_value_len);
   } catch(std::exception& e) {
-    REprintf("%s\n",e.what());
+    reportError(e);
     return R_NilValue;
   }
   SEXP ans; PROTECT(ans = Rf_allocVector(REALSXP,1));
@@ -1099,7 +2028,7 @@ SEXP get_rcvtimeo(SEXP socket_) {
 
 SEXP get_rcvmore(SEXP socket_) {
 
-  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,"zmq::socket_t*"));
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
   if(!socket) { REprintf("bad socket object.\n");return R_NilValue; }
 #if ZMQ_VERSION_MAJOR > 2
   int option_value;
@@ -1110,7 +2039,7 @@ SEXP get_rcvmore(SEXP socket_) {
   try {
     socket->getsockopt(ZMQ_RCVMORE, &option_value, &option_value_len);
   } catch(std::exception& e) {
-    REprintf("%s\n",e.what());
+    reportError(e);
     return R_NilValue;
   }
   SEXP ans; PROTECT(ans = Rf_allocVector(LGLSXP,1));
@@ -1119,8 +2048,51 @@ SEXP get_rcvmore(SEXP socket_) {
   return ans;
 }
 
+SEXP get_fd(SEXP socket_) {
+
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
+  if(!socket) { REprintf("bad socket object.\n");return R_NilValue; }
+#ifdef _WIN32
+  SOCKET option_value;
+#else
+  int option_value;
+#endif
+  size_t option_value_len = sizeof(option_value);
+  try {
+    socket->getsockopt(ZMQ_FD, &option_value, &option_value_len);
+  } catch(std::exception& e) {
+    reportError(e);
+    return R_NilValue;
+  }
+  SEXP ans; PROTECT(ans = Rf_allocVector(REALSXP,1));
+  REAL(ans)[0] = static_cast<double>(option_value);
+  UNPROTECT(1);
+  return ans;
+}
+
+SEXP get_events(SEXP socket_) {
+
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
+  if(!socket) { REprintf("bad socket object.\n");return R_NilValue; }
+  int option_value;
+  size_t option_value_len = sizeof(option_value);
+  try {
+    socket->getsockopt(ZMQ_EVENTS, &option_value, &option_value_len);
+  } catch(std::exception& e) {
+    reportError(e);
+    return R_NilValue;
+  }
+  SEXP ans; PROTECT(ans = Rf_allocVector(LGLSXP,2));
+  LOGICAL(ans)[0] = (option_value & ZMQ_POLLIN) != 0;
+  LOGICAL(ans)[1] = (option_value & ZMQ_POLLOUT) != 0;
+  SEXP names = PROTECT(Rf_allocVector(STRSXP,2));
+  SET_STRING_ELT(names, 0, Rf_mkChar("read"));
+  SET_STRING_ELT(names, 1, Rf_mkChar("write"));
+  Rf_setAttrib(ans, R_NamesSymbol, names);
+  UNPROTECT(2);
+  return ans;
+}
+
 // #define ZMQ_RCVMORE 13
-// #define ZMQ_FD 14
-// #define ZMQ_EVENTS 15
 // #define ZMQ_TYPE 16
 
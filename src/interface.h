@@ -20,24 +20,125 @@
 #ifndef INTERFACE_HPP
 #define INTERFACE_HPP
 
+#include <string>
+#include <vector>
 #include <Rinternals.h>
+#include <R_ext/Rdynload.h>
+
+namespace zmq {
+  class socket_t;
+  class message_t;
+}
 
-static void contextFinalizer(SEXP context_);
-static void socketFinalizer(SEXP socket_);
-static void messageFinalizer(SEXP msg_);
 SEXP rzmq_serialize(SEXP data, SEXP rho);
 SEXP rzmq_unserialize(SEXP data, SEXP rho);
+SEXP unserializeBytes(const unsigned char* data, size_t size);
+// compact codec, see codec.cpp; checkCompact does not use R
+bool isCompact(const unsigned char* data, size_t size);
+bool checkCompact(const unsigned char* data, size_t size, std::string* error);
+SEXP compactDecode(const unsigned char* data, size_t size);
+
+// a received columnar table, see columnar.cpp; parseColumnar checks the
+// frames and indexes the columns without using R, materializeColumnar
+// builds the data.frame
+struct columnarColumn {
+  int type;
+  std::string name;
+  const char* values;
+  // dictionary of string and factor columns
+  uint32_t count;
+  const uint32_t* offsets;
+  const char* text;
+};
+
+struct columnarTable {
+  ~columnarTable();
+  std::vector<zmq::message_t*> frames;
+  uint64_t nrow;
+  std::vector<columnarColumn> columns;
+};
+
+bool isColumnar(const unsigned char* data, size_t size);
+bool parseColumnar(columnarTable* table, std::string* error);
+SEXP materializeColumnar(const columnarTable& table);
+// handle tags, interned once at load time so handles compare by pointer
+extern SEXP rzmq_context_tag;
+extern SEXP rzmq_socket_tag;
+extern SEXP rzmq_message_tag;
+extern SEXP rzmq_rpc_client_tag;
+extern SEXP rzmq_broker_tag;
+extern SEXP rzmq_socket_handler_tag;
+extern SEXP rzmq_zap_handler_tag;
+extern SEXP rzmq_spill_queue_tag;
+extern SEXP rzmq_reliable_publisher_tag;
+extern SEXP rzmq_reliable_subscriber_tag;
+extern SEXP rzmq_liveness_tag;
+extern SEXP rzmq_capture_tag;
+extern SEXP rzmq_coalescer_tag;
+extern SEXP rzmq_pacer_tag;
+
+// the address behind a handle of the given type, or NULL for anything
+// else, including handles that have been closed
+inline void* checkExternalPointer(SEXP xp_, SEXP valid_tag) {
+  if(TYPEOF(xp_) != EXTPTRSXP || R_ExternalPtrTag(xp_) != valid_tag) {
+    return NULL;
+  }
+  return R_ExternalPtrAddr(xp_);
+}
+
+// handles owning sockets of a context, so the context can close them before
+// it terminates; the handle's prot slot must hold the context, and close
+// must clear the handle's address and unregister it
+void registerHandle(SEXP handle_, R_CFinalizer_t close);
+void unregisterHandle(SEXP handle_);
+void removeSocketHandlers(void* socket);
+void stopSpillQueues(void* socket);
+
+// frames sent or received through sockets attached to a capture are
+// appended to its file
+bool captureTapped(void* socket);
+void captureFrame(void* socket, const zmq::message_t& msg, bool more, bool received);
+void removeCaptureTaps(void* socket);
+void stopCoalescers(void* socket);
+void stopPacers(void* socket);
+void removeDeadlineCounts(void* socket);
+int pending_interrupt();
+
+// failures are recorded for zmq.errno() and printed unless
+// options(rzmq.quiet=TRUE); EAGAIN is recorded but never printed
+void reportError(const std::exception& e);
+void reportErrno();
+bool sendMessage(zmq::socket_t* socket, zmq::message_t& msg, int flags);
+bool receiveMessage(zmq::socket_t* socket, zmq::message_t* msg, int flags);
+// the same without any R call, for other threads and for code holding a
+// lock; a failure leaves its errno in error, for reportErrno on the R thread
+bool sendFrame(zmq::socket_t* socket, zmq::message_t& msg, int flags, int* error);
+bool receiveFrame(zmq::socket_t* socket, zmq::message_t* msg, int flags, int* error);
+double receivedFrames();
+SEXP statusResult(bool status);
+
+// lendVector keeps x alive and unmodified until a message built with
+// returnVector as its free function and x as its hint has been sent;
+// releaseReturnedVectors must only be called on the R thread
+void lendVector(SEXP x);
+void returnVector(void* data, void* hint);
+void releaseReturnedVectors();
 
 extern "C" {
   SEXP get_zmq_version();
+  SEXP compactSerialize(SEXP data_);
+  SEXP unserializeMessage(SEXP data_);
   SEXP get_zmq_errno();
   SEXP get_zmq_strerror();
   SEXP initContext(SEXP threads_);
   SEXP initSocket(SEXP context_, SEXP socket_type_);
+  SEXP closeSocket(SEXP socket_, SEXP linger_);
+  SEXP termContext(SEXP context_, SEXP linger_);
   SEXP bindSocket(SEXP socket_, SEXP address_);
   SEXP connectSocket(SEXP socket_, SEXP address_);
   SEXP disconnectSocket(SEXP socket_, SEXP address_);
   SEXP sendSocket(SEXP socket_, SEXP data_, SEXP send_more_);
+  SEXP sendGather(SEXP socket_, SEXP parts_, SEXP send_more_);
   SEXP sendNullMsg(SEXP socket_, SEXP send_more_);
   SEXP receiveNullMsg(SEXP socket_);
   SEXP sendRawString(SEXP socket_, SEXP data_, SEXP send_more_);
@@ -47,6 +148,27 @@ extern "C" {
   SEXP receiveString(SEXP socket_);
   SEXP receiveInt(SEXP socket_);
   SEXP receiveDouble(SEXP socket_);
+  SEXP sendChunked(SEXP socket_, SEXP data_, SEXP chunk_size_, SEXP xdr_, SEXP send_more_);
+  SEXP receiveChunked(SEXP socket_, SEXP dont_wait_);
+  SEXP sendFile(SEXP socket_, SEXP path_, SEXP offset_, SEXP length_, SEXP frame_size_, SEXP send_more_);
+  SEXP receiveInto(SEXP socket_, SEXP target_, SEXP offset_, SEXP dont_wait_);
+  SEXP sendShared(SEXP socket_, SEXP data_, SEXP serialize_, SEXP xdr_, SEXP threshold_, SEXP readers_, SEXP lease_, SEXP send_more_);
+  SEXP receiveShared(SEXP socket_, SEXP dont_wait_);
+  SEXP sendDataFrame(SEXP socket_, SEXP data_, SEXP send_more_);
+  SEXP receiveDataFrame(SEXP socket_, SEXP dont_wait_);
+  SEXP receiveBatch(SEXP socket_, SEXP max_, SEXP unserialize_, SEXP threads_, SEXP dont_wait_);
+  void rzmq_init_tags();
+  void rzmq_init_shared(DllInfo* info);
+  void rzmq_init_api(DllInfo* info);
+  SEXP initRpcClient(SEXP context_, SEXP address_);
+  SEXP rpcCall(SEXP client_, SEXP data_, SEXP timeout_);
+  SEXP rpcCollect(SEXP client_, SEXP timeout_);
+  SEXP rpcPending(SEXP client_);
+  SEXP initBroker(SEXP context_, SEXP address_, SEXP timeout_);
+  SEXP brokerSubmit(SEXP broker_, SEXP tasks_);
+  SEXP brokerCollect(SEXP broker_, SEXP timeout_, SEXP max_);
+  SEXP brokerStats(SEXP broker_);
+  SEXP serveSockets(SEXP sockets_, SEXP handlers_, SEXP batch_size_, SEXP timeout_, SEXP unserialize_);
   SEXP set_hwm(SEXP socket_, SEXP option_value_);
   SEXP set_swap(SEXP socket_, SEXP option_value_);
   SEXP set_affinity(SEXP socket_, SEXP option_value_);
@@ -63,9 +185,59 @@ extern "C" {
   SEXP set_reconnect_ivl(SEXP socket_, SEXP option_value_);
   SEXP set_zmq_backlog(SEXP socket_, SEXP option_value_);
   SEXP set_reconnect_ivl_max(SEXP socket_, SEXP option_value_);
+  SEXP set_heartbeat_ivl(SEXP socket_, SEXP option_value_);
+  SEXP set_heartbeat_timeout(SEXP socket_, SEXP option_value_);
+  SEXP set_heartbeat_ttl(SEXP socket_, SEXP option_value_);
   SEXP get_rcvmore(SEXP socket_);
+  SEXP get_fd(SEXP socket_);
+  SEXP get_events(SEXP socket_);
+  SEXP addSocketHandler(SEXP socket_, SEXP callback_);
+  SEXP removeSocketHandler(SEXP handler_);
   SEXP pollSocket(SEXP socket_, SEXP events_, SEXP timeout_);
   SEXP get_last_endpoint(SEXP socket_);
+  SEXP curveKeypair();
+  SEXP set_curve_server(SEXP socket_, SEXP option_value_);
+  SEXP set_curve_publickey(SEXP socket_, SEXP option_value_);
+  SEXP set_curve_secretkey(SEXP socket_, SEXP option_value_);
+  SEXP set_curve_serverkey(SEXP socket_, SEXP option_value_);
+  SEXP set_zap_domain(SEXP socket_, SEXP option_value_);
+  SEXP initZapHandler(SEXP context_, SEXP keys_, SEXP addresses_);
+  SEXP stopZapHandler(SEXP handler_);
+  SEXP zapStats(SEXP handler_);
+  SEXP joinGroup(SEXP socket_, SEXP group_);
+  SEXP leaveGroup(SEXP socket_, SEXP group_);
+  SEXP sendRouted(SEXP socket_, SEXP data_, SEXP routing_id_, SEXP group_);
+  SEXP receiveRouted(SEXP socket_, SEXP dont_wait_);
+  SEXP initSpillQueue(SEXP socket_, SEXP path_, SEXP max_bytes_, SEXP segment_size_, SEXP sync_);
+  SEXP spillSend(SEXP queue_, SEXP data_);
+  SEXP spillStats(SEXP queue_);
+  SEXP stopSpill(SEXP queue_);
+  SEXP initReliablePublisher(SEXP context_, SEXP address_, SEXP snapshot_address_, SEXP ring_size_);
+  SEXP reliablePublish(SEXP publisher_, SEXP topic_, SEXP data_);
+  SEXP initReliableSubscriber(SEXP context_, SEXP address_, SEXP snapshot_address_, SEXP topics_, SEXP catch_up_);
+  SEXP reliableReceive(SEXP subscriber_, SEXP dont_wait_, SEXP timeout_);
+  SEXP reliableStats(SEXP handle_);
+  SEXP initLiveness(SEXP socket_, SEXP timeout_, SEXP heartbeat_);
+  SEXP livenessReceive(SEXP table_, SEXP dont_wait_);
+  SEXP livenessPeers(SEXP table_);
+  SEXP livenessExpired(SEXP table_);
+  SEXP initCapture(SEXP path_);
+  SEXP captureSocket(SEXP capture_, SEXP socket_, SEXP id_, SEXP direction_);
+  SEXP stopCapture(SEXP capture_);
+  SEXP replayCapture(SEXP path_, SEXP sockets_, SEXP speed_, SEXP direction_);
+  SEXP initCoalescer(SEXP socket_, SEXP max_bytes_, SEXP max_delay_);
+  SEXP coalesceSend(SEXP coalescer_, SEXP data_);
+  SEXP coalesceFlush(SEXP coalescer_);
+  SEXP coalesceReceive(SEXP coalescer_, SEXP dont_wait_);
+  SEXP coalesceStats(SEXP coalescer_);
+  SEXP stopCoalesce(SEXP coalescer_);
+  SEXP initPacer(SEXP socket_, SEXP msg_rate_, SEXP byte_rate_, SEXP msg_burst_, SEXP byte_burst_, SEXP policy_, SEXP max_queue_);
+  SEXP paceSend(SEXP pacer_, SEXP data_);
+  SEXP paceStats(SEXP pacer_);
+  SEXP stopPace(SEXP pacer_);
+  SEXP sendDeadline(SEXP socket_, SEXP data_, SEXP ttl_, SEXP clock_, SEXP send_more_);
+  SEXP receiveFresh(SEXP socket_, SEXP dont_wait_);
+  SEXP deadlineStats(SEXP socket_);
   SEXP get_sndtimeo(SEXP socket_);
   SEXP set_sndtimeo(SEXP socket_, SEXP option_value_);
   SEXP get_rcvtimeo(SEXP socket_);
@@ -0,0 +1,210 @@
+///////////////////////////////////////////////////////////////////////////
+// Copyright (C) 2011  Whit Armstrong                                    //
+//                                                                       //
+// This program is free software: you can redistribute it and/or modify  //
+// it under the terms of the GNU General Public License as published by  //
+// the Free Software Foundation, either version 3 of the License, or     //
+// (at your option) any later version.                                   //
+//                                                                       //
+// This program is distributed in the hope that it will be useful,       //
+// but WITHOUT ANY WARRANTY; without even the implied warranty of        //
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         //
+// GNU General Public License for more details.                          //
+//                                                                       //
+// You should have received a copy of the GNU General Public License     //
+// along with this program.  If not, see <http://www.gnu.org/licenses/>. //
+///////////////////////////////////////////////////////////////////////////
+
+// Liveness of the peers of a ROUTER socket.
+//
+// Every message received through the table refreshes the last-seen time
+// of its sender's identity, and peers silent for longer than the timeout
+// are evicted whenever the table is used, so R needs no timers of its
+// own.  Messages whose body is just the heartbeat string only refresh
+// the sender and are not passed on.  The table holds the socket in its
+// prot slot and looks it up on every call, so a closed socket is noticed.
+
+#include <zmq.hpp>
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+#include "interface.h"
+
+typedef std::chrono::steady_clock Clock;
+
+struct livenessTable {
+  std::chrono::milliseconds timeout;
+  bool has_heartbeat;
+  std::string heartbeat;
+  std::map<std::string, Clock::time_point> peers;
+  // evicted since the last call to liveness.expired
+  std::vector<std::string> expired;
+};
+
+static void livenessFinalizer(SEXP table_) {
+  livenessTable* table = reinterpret_cast<livenessTable*>(R_ExternalPtrAddr(table_));
+  if(table) {
+    delete table;
+    R_ClearExternalPtr(table_);
+  }
+}
+
+static void evictPeers(livenessTable* table) {
+  Clock::time_point now = Clock::now();
+  std::map<std::string, Clock::time_point>::iterator it = table->peers.begin();
+  while(it != table->peers.end()) {
+    if(now - it->second > table->timeout) {
+      table->expired.push_back(it->first);
+      table->peers.erase(it++);
+    } else {
+      ++it;
+    }
+  }
+}
+
+static SEXP rawString(const std::string& value) {
+  SEXP ans = Rf_allocVector(RAWSXP, value.size());
+  memcpy(RAW(ans), value.data(), value.size());
+  return ans;
+}
+
+static bool isHeartbeat(livenessTable* table, const std::vector<zmq::message_t*>& parts) {
+  if(!table->has_heartbeat)
+    return false;
+  // [identity][heartbeat], or [identity][][heartbeat] from REQ peers
+  size_t body = parts.size() == 3 && parts[1]->size() == 0 ? 2 : 1;
+  return parts.size() == body + 1 && parts[body]->size() == table->heartbeat.size() &&
+    memcmp(parts[body]->data(), table->heartbeat.data(), table->heartbeat.size()) == 0;
+}
+
+SEXP initLiveness(SEXP socket_, SEXP timeout_, SEXP heartbeat_) {
+  SEXP table_;
+
+  int timeout = Rf_asInteger(timeout_);
+  if(timeout == NA_INTEGER || timeout < 0) {
+    REprintf("timeout must be a non-negative integer.\n");
+    return R_NilValue;
+  }
+  if(heartbeat_ != R_NilValue && TYPEOF(heartbeat_) != STRSXP) {
+    REprintf("heartbeat must be a string or NULL.\n");
+    return R_NilValue;
+  }
+  if(!checkExternalPointer(socket_,rzmq_socket_tag)) {
+    REprintf("bad socket object.\n");
+    return R_NilValue;
+  }
+
+  livenessTable* table = new livenessTable;
+  table->timeout = std::chrono::milliseconds(timeout);
+  table->has_heartbeat = heartbeat_ != R_NilValue;
+  if(table->has_heartbeat) table->heartbeat = CHAR(STRING_ELT(heartbeat_,0));
+
+  PROTECT(table_ = R_MakeExternalPtr(reinterpret_cast<void*>(table),rzmq_liveness_tag,socket_));
+  R_RegisterCFinalizerEx(table_, livenessFinalizer, TRUE);
+  UNPROTECT(1);
+  return table_;
+}
+
+SEXP livenessReceive(SEXP table_, SEXP dont_wait_) {
+  SEXP ans;
+
+  if(TYPEOF(dont_wait_) != LGLSXP) {
+    REprintf("dont_wait type must be logical (LGLSXP).\n");
+    return R_NilValue;
+  }
+  livenessTable* table = reinterpret_cast<livenessTable*>(checkExternalPointer(table_,rzmq_liveness_tag));
+  if(!table) {
+    REprintf("bad liveness object.\n");
+    return R_NilValue;
+  }
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(R_ExternalPtrProtected(table_),rzmq_socket_tag));
+  if(!socket) {
+    REprintf("bad socket object.\n");
+    return R_NilValue;
+  }
+
+  int flags = LOGICAL(dont_wait_)[0] ? ZMQ_DONTWAIT : 0;
+  std::vector<zmq::message_t*> parts;
+  while(true) {
+    zmq::message_t* part = new zmq::message_t;
+    parts.push_back(part);
+    if(!receiveMessage(socket, part, flags)) {
+      for(size_t i = 0; i < parts.size(); i++) delete parts[i];
+      evictPeers(table);
+      return R_NilValue;
+    }
+    bool complete = true;
+    while(complete && part->more()) {
+      part = new zmq::message_t;
+      parts.push_back(part);
+      complete = receiveMessage(socket, part, 0);
+    }
+
+    std::string identity(reinterpret_cast<const char*>(parts[0]->data()), parts[0]->size());
+    table->peers[identity] = Clock::now();
+    if(!complete || !isHeartbeat(table, parts))
+      break;
+    for(size_t i = 0; i < parts.size(); i++) delete parts[i];
+    parts.clear();
+  }
+  evictPeers(table);
+
+  PROTECT(ans = Rf_allocVector(VECSXP, parts.size()));
+  for(size_t i = 0; i < parts.size(); i++) {
+    SEXP frame = Rf_allocVector(RAWSXP, parts[i]->size());
+    SET_VECTOR_ELT(ans, i, frame);
+    memcpy(RAW(frame), parts[i]->data(), parts[i]->size());
+    delete parts[i];
+  }
+  UNPROTECT(1);
+  return ans;
+}
+
+SEXP livenessPeers(SEXP table_) {
+  SEXP ans, names;
+
+  livenessTable* table = reinterpret_cast<livenessTable*>(checkExternalPointer(table_,rzmq_liveness_tag));
+  if(!table) {
+    REprintf("bad liveness object.\n");
+    return R_NilValue;
+  }
+  evictPeers(table);
+
+  Clock::time_point now = Clock::now();
+  PROTECT(ans = Rf_allocVector(VECSXP, 2));
+  SEXP identity_ = Rf_allocVector(VECSXP, table->peers.size());
+  SET_VECTOR_ELT(ans, 0, identity_);
+  SEXP idle_ = Rf_allocVector(REALSXP, table->peers.size());
+  SET_VECTOR_ELT(ans, 1, idle_);
+  R_xlen_t i = 0;
+  for(std::map<std::string, Clock::time_point>::iterator it = table->peers.begin(); it != table->peers.end(); ++it, ++i) {
+    SET_VECTOR_ELT(identity_, i, rawString(it->first));
+    REAL(idle_)[i] = std::chrono::duration_cast<std::chrono::milliseconds>(now - it->second).count();
+  }
+  PROTECT(names = Rf_allocVector(STRSXP, 2));
+  SET_STRING_ELT(names, 0, Rf_mkChar("identity"));
+  SET_STRING_ELT(names, 1, Rf_mkChar("idle"));
+  Rf_setAttrib(ans, R_NamesSymbol, names);
+  UNPROTECT(2);
+  return ans;
+}
+
+SEXP livenessExpired(SEXP table_) {
+  SEXP ans;
+
+  livenessTable* table = reinterpret_cast<livenessTable*>(checkExternalPointer(table_,rzmq_liveness_tag));
+  if(!table) {
+    REprintf("bad liveness object.\n");
+    return R_NilValue;
+  }
+  evictPeers(table);
+
+  PROTECT(ans = Rf_allocVector(VECSXP, table->expired.size()));
+  for(size_t i = 0; i < table->expired.size(); i++) {
+    SET_VECTOR_ELT(ans, i, rawString(table->expired[i]));
+  }
+  table->expired.clear();
+  UNPROTECT(1);
+  return ans;
+}
@@ -0,0 +1,364 @@
+///////////////////////////////////////////////////////////////////////////
+// Copyright (C) 2011  Whit Armstrong                                    //
+//                                                                       //
+// This program is free software: you can redistribute it and/or modify  //
+// it under the terms of the GNU General Public License as published by  //
+// the Free Software Foundation, either version 3 of the License, or     //
+// (at your option) any later version.                                   //
+//                                                                       //
+// This program is distributed in the hope that it will be useful,       //
+// but WITHOUT ANY WARRANTY; without even the implied warranty of        //
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         //
+// GNU General Public License for more details.                          //
+//                                                                       //
+// You should have received a copy of the GNU General Public License     //
+// along with this program.  If not, see <http://www.gnu.org/licenses/>. //
+///////////////////////////////////////////////////////////////////////////
+
+// Token-bucket pacing of the sends to a socket.
+//
+// One bucket holds messages and one bytes; each refills at its rate up
+// to its burst size, and a send takes one message and its length.  A
+// message longer than the byte burst only needs a full bucket and leaves
+// it in debt, so it is still sent eventually.  A send over the budget
+// sleeps until the tokens are there, fails with EAGAIN, or is queued for
+// a thread that sends it when they are.  Only the queueing policy starts
+// a thread, which then shares the socket under the pacer's lock; with the
+// lock held, sends go through sendFrame, which makes no R calls, and
+// failures are reported once it is released.
+
+#include <zmq.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include "interface.h"
+
+typedef std::chrono::steady_clock Clock;
+
+enum pacerPolicy { PACE_BLOCK, PACE_QUEUE, PACE_EAGAIN };
+
+struct pacer {
+  pacer() : socket(NULL), sent(0), bytes(0), delayed(0), rejected(0), waited(0), stopping(false) {}
+  zmq::socket_t* socket;  // NULL once stopped
+  pacerPolicy policy;
+  double msg_rate, byte_rate, msg_burst, byte_burst;
+  size_t max_queue;
+  std::thread thread;
+
+  // guards everything below, and the socket while the thread runs
+  std::mutex lock;
+  std::condition_variable wake;
+  double msg_tokens, byte_tokens;
+  Clock::time_point refilled;
+  std::deque<zmq::message_t*> queue;
+  double sent, bytes, delayed, rejected, waited;
+  bool stopping;
+};
+
+// running pacers, so closing a socket can stop them
+static std::set<pacer*> active_pacers;
+
+static void refill(pacer* p, Clock::time_point now) {
+  double elapsed = std::chrono::duration<double>(now - p->refilled).count();
+  p->refilled = now;
+  if(!std::isinf(p->msg_rate))
+    p->msg_tokens = std::min(p->msg_burst, p->msg_tokens + elapsed * p->msg_rate);
+  if(!std::isinf(p->byte_rate))
+    p->byte_tokens = std::min(p->byte_burst, p->byte_tokens + elapsed * p->byte_rate);
+}
+
+// seconds until a message of this length may be sent
+static double tokenWait(pacer* p, size_t length) {
+  refill(p, Clock::now());
+  double wait = 0;
+  if(!std::isinf(p->msg_rate) && p->msg_tokens < 1)
+    wait = (1 - p->msg_tokens) / p->msg_rate;
+  double need = std::min(static_cast<double>(length), p->byte_burst);
+  if(!std::isinf(p->byte_rate) && p->byte_tokens < need)
+    wait = std::max(wait, (need - p->byte_tokens) / p->byte_rate);
+  return wait;
+}
+
+static void takeTokens(pacer* p, size_t length) {
+  if(!std::isinf(p->msg_rate)) p->msg_tokens -= 1;
+  if(!std::isinf(p->byte_rate)) p->byte_tokens -= length;
+  p->sent++;
+  p->bytes += length;
+}
+
+static void paceLoop(pacer* p) {
+  std::unique_lock<std::mutex> guard(p->lock);
+  int backoff = 1;
+  while(!p->stopping) {
+    if(p->queue.empty()) {
+      p->wake.wait(guard);
+      continue;
+    }
+    zmq::message_t* msg = p->queue.front();
+    double wait = tokenWait(p, msg->size());
+    if(wait > 0) {
+      p->wake.wait_for(guard, std::chrono::duration<double>(wait));
+      continue;
+    }
+    size_t length = msg->size();
+    int error;
+    if(sendFrame(p->socket, *msg, ZMQ_DONTWAIT, &error)) {
+      takeTokens(p, length);
+      delete msg;
+      p->queue.pop_front();
+      backoff = 1;
+      continue;
+    }
+    // anything but a full queue means the socket or its context is going away
+    if(error != EAGAIN)
+      break;
+    p->wake.wait_for(guard, std::chrono::milliseconds(backoff));
+    backoff = std::min(backoff * 2, 100);
+  }
+}
+
+static void stopPacer(pacer* p) {
+  if(!p->socket)
+    return;
+  if(p->thread.joinable()) {
+    {
+      std::lock_guard<std::mutex> guard(p->lock);
+      p->stopping = true;
+    }
+    p->wake.notify_one();
+    p->thread.join();
+  }
+  for(size_t i = 0; i < p->queue.size(); i++) delete p->queue[i];
+  p->queue.clear();
+  active_pacers.erase(p);
+  p->socket = NULL;
+}
+
+static void pacerFinalizer(SEXP pacer_) {
+  pacer* p = reinterpret_cast<pacer*>(R_ExternalPtrAddr(pacer_));
+  if(p) {
+    stopPacer(p);
+    delete p;
+    R_ClearExternalPtr(pacer_);
+  }
+}
+
+void stopPacers(void* socket) {
+  std::set<pacer*> pacers(active_pacers);
+  for(std::set<pacer*>::iterator it = pacers.begin(); it != pacers.end(); ++it) {
+    if((*it)->socket == socket) stopPacer(*it);
+  }
+}
+
+static bool checkRate(double rate, double burst, const char* what) {
+  if(ISNAN(rate) || rate <= 0 || ISNAN(burst) || burst < 1 || (std::isinf(burst) && !std::isinf(rate))) {
+    REprintf("%s rate must be positive and its burst finite and at least 1.\n", what);
+    return false;
+  }
+  return true;
+}
+
+SEXP initPacer(SEXP socket_, SEXP msg_rate_, SEXP byte_rate_, SEXP msg_burst_, SEXP byte_burst_, SEXP policy_, SEXP max_queue_) {
+  SEXP pacer_;
+
+  double msg_rate = Rf_asReal(msg_rate_), byte_rate = Rf_asReal(byte_rate_);
+  double msg_burst = Rf_asReal(msg_burst_), byte_burst = Rf_asReal(byte_burst_);
+  if(!checkRate(msg_rate, msg_burst, "message") || !checkRate(byte_rate, byte_burst, "byte"))
+    return R_NilValue;
+  int max_queue = Rf_asInteger(max_queue_);
+  if(max_queue == NA_INTEGER || max_queue < 0) {
+    REprintf("max.queue must be a non-negative integer.\n");
+    return R_NilValue;
+  }
+  if(TYPEOF(policy_) != STRSXP || LENGTH(policy_) < 1) {
+    REprintf("policy must be a string.\n");
+    return R_NilValue;
+  }
+  std::string policy(CHAR(STRING_ELT(policy_,0)));
+  if(policy != "block" && policy != "queue" && policy != "eagain") {
+    REprintf("policy must be one of block, queue or eagain.\n");
+    return R_NilValue;
+  }
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
+  if(!socket) {
+    REprintf("bad socket object.\n");
+    return R_NilValue;
+  }
+
+  pacer* p = new pacer;
+  p->policy = policy == "block" ? PACE_BLOCK : policy == "queue" ? PACE_QUEUE : PACE_EAGAIN;
+  p->msg_rate = msg_rate;
+  p->byte_rate = byte_rate;
+  p->msg_burst = msg_burst;
+  p->byte_burst = byte_burst;
+  p->max_queue = max_queue;
+  // the buckets start full
+  p->msg_tokens = msg_burst;
+  p->byte_tokens = byte_burst;
+  p->refilled = Clock::now();
+  p->socket = socket;
+  if(p->policy == PACE_QUEUE) {
+    try {
+      p->thread = std::thread(paceLoop, p);
+    } catch(std::exception& e) {
+      reportError(e);
+      delete p;
+      return R_NilValue;
+    }
+  }
+  active_pacers.insert(p);
+
+  // the pacer keeps its socket alive, and closing the socket stops it
+  PROTECT(pacer_ = R_MakeExternalPtr(reinterpret_cast<void*>(p),rzmq_pacer_tag,socket_));
+  R_RegisterCFinalizerEx(pacer_, pacerFinalizer, TRUE);
+  UNPROTECT(1);
+  return pacer_;
+}
+
+// sleeps until the tokens are there, waking for interrupts
+static bool paceBlock(pacer* p, size_t length) {
+  bool delayed = false;
+  Clock::time_point start = Clock::now();
+  double wait;
+  while((wait = tokenWait(p, length)) > 0) {
+    delayed = true;
+    std::this_thread::sleep_for(std::chrono::duration<double>(std::min(wait, 0.1)));
+    if(pending_interrupt()) {
+      errno = EINTR;
+      reportErrno();
+      return false;
+    }
+  }
+  if(delayed) {
+    p->delayed++;
+    p->waited += std::chrono::duration<double>(Clock::now() - start).count();
+  }
+  return true;
+}
+
+SEXP paceSend(SEXP pacer_, SEXP data_) {
+  if(TYPEOF(data_) != RAWSXP) {
+    REprintf("data type must be raw (RAWSXP).\n");
+    return R_NilValue;
+  }
+  pacer* p = reinterpret_cast<pacer*>(checkExternalPointer(pacer_,rzmq_pacer_tag));
+  if(!p || !p->socket) {
+    REprintf("bad pacer object.\n");
+    return R_NilValue;
+  }
+
+  size_t length = Rf_xlength(data_);
+  zmq::message_t* msg = new zmq::message_t(length);
+  memcpy(msg->data(), RAW(data_), length);
+
+  bool status = false;
+  if(p->policy != PACE_QUEUE) {
+    // no thread, so no lock
+    if(p->policy == PACE_BLOCK) {
+      status = paceBlock(p, length);
+    } else if(tokenWait(p, length) > 0) {
+      p->rejected++;
+      errno = EAGAIN;
+      reportErrno();
+    } else {
+      status = true;
+    }
+    if(status && (status = sendMessage(p->socket, *msg, 0)))
+      takeTokens(p, length);
+    delete msg;
+    return statusResult(status);
+  }
+
+  // no R calls while the lock is held, a failure is only recorded
+  int error = 0;
+  {
+    std::lock_guard<std::mutex> guard(p->lock);
+    // straight to the socket unless that would overtake queued messages
+    if(p->queue.empty() && tokenWait(p, length) == 0) {
+      if(sendFrame(p->socket, *msg, ZMQ_DONTWAIT, &error)) {
+        takeTokens(p, length);
+        status = true;
+        delete msg;
+        msg = NULL;
+      } else if(error == EAGAIN) {
+        // the socket is full, the thread sends it later
+        error = 0;
+      } else {
+        delete msg;
+        msg = NULL;
+      }
+    }
+    if(msg) {
+      if(p->queue.size() < p->max_queue) {
+        p->queue.push_back(msg);
+        p->delayed++;
+        p->wake.notify_one();
+        status = true;
+      } else {
+        p->rejected++;
+        delete msg;
+        error = ENOBUFS;
+      }
+    }
+  }
+  if(error) {
+    errno = error;
+    reportErrno();
+  }
+  return statusResult(status);
+}
+
+SEXP paceStats(SEXP pacer_) {
+  SEXP ans, names;
+
+  pacer* p = reinterpret_cast<pacer*>(checkExternalPointer(pacer_,rzmq_pacer_tag));
+  if(!p) {
+    REprintf("bad pacer object.\n");
+    return R_NilValue;
+  }
+  double values[8];
+  {
+    std::lock_guard<std::mutex> guard(p->lock);
+    refill(p, Clock::now());
+    values[0] = p->sent;
+    values[1] = p->bytes;
+    values[2] = p->delayed;
+    values[3] = p->rejected;
+    values[4] = p->queue.size();
+    values[5] = p->waited;
+    values[6] = p->msg_tokens;
+    values[7] = p->byte_tokens;
+  }
+  const char* fields[] = { "sent", "bytes", "delayed", "rejected", "queued", "waited", "msg.tokens", "byte.tokens" };
+  PROTECT(ans = Rf_allocVector(REALSXP,8));
+  PROTECT(names = Rf_allocVector(STRSXP,8));
+  for(int i = 0; i < 8; i++) {
+    REAL(ans)[i] = values[i];
+    SET_STRING_ELT(names, i, Rf_mkChar(fields[i]));
+  }
+  Rf_setAttrib(ans, R_NamesSymbol, names);
+  UNPROTECT(2);
+  return ans;
+}
+
+SEXP stopPace(SEXP pacer_) {
+  SEXP ans;
+  bool status(false);
+  pacer* p = reinterpret_cast<pacer*>(checkExternalPointer(pacer_,rzmq_pacer_tag));
+  if(p) {
+    status = p->socket != NULL;
+    stopPacer(p);
+  } else {
+    REprintf("bad pacer object.\n");
+  }
+  PROTECT(ans = Rf_allocVector(LGLSXP,1));
+  LOGICAL(ans)[0] = static_cast<int>(status);
+  UNPROTECT(1);
+  return ans;
+}
@@ -1,7 +1,248 @@
 #include <Rinternals.h>
 #include <R_ext/Rdynload.h>
 
+void rzmq_init_tags();
+void rzmq_init_shared(DllInfo* info);
+void rzmq_init_api(DllInfo* info);
+
+SEXP get_zmq_version(void);
+SEXP compactSerialize(SEXP);
+SEXP unserializeMessage(SEXP);
+SEXP get_zmq_errno(void);
+SEXP get_zmq_strerror(void);
+SEXP initContext(SEXP);
+SEXP initSocket(SEXP, SEXP);
+SEXP closeSocket(SEXP, SEXP);
+SEXP termContext(SEXP, SEXP);
+SEXP bindSocket(SEXP, SEXP);
+SEXP connectSocket(SEXP, SEXP);
+SEXP disconnectSocket(SEXP, SEXP);
+SEXP sendSocket(SEXP, SEXP, SEXP);
+SEXP sendGather(SEXP, SEXP, SEXP);
+SEXP sendNullMsg(SEXP, SEXP);
+SEXP receiveNullMsg(SEXP);
+SEXP sendRawString(SEXP, SEXP, SEXP);
+SEXP initMessage(SEXP);
+SEXP sendMessageObject(SEXP, SEXP, SEXP);
+SEXP receiveSocket(SEXP, SEXP);
+SEXP receiveString(SEXP);
+SEXP receiveInt(SEXP);
+SEXP receiveDouble(SEXP);
+SEXP sendChunked(SEXP, SEXP, SEXP, SEXP, SEXP);
+SEXP receiveChunked(SEXP, SEXP);
+SEXP sendFile(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+SEXP receiveInto(SEXP, SEXP, SEXP, SEXP);
+SEXP sendShared(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+SEXP receiveShared(SEXP, SEXP);
+SEXP sendDataFrame(SEXP, SEXP, SEXP);
+SEXP receiveDataFrame(SEXP, SEXP);
+SEXP receiveBatch(SEXP, SEXP, SEXP, SEXP, SEXP);
+SEXP initRpcClient(SEXP, SEXP);
+SEXP rpcCall(SEXP, SEXP, SEXP);
+SEXP rpcCollect(SEXP, SEXP);
+SEXP rpcPending(SEXP);
+SEXP initBroker(SEXP, SEXP, SEXP);
+SEXP brokerSubmit(SEXP, SEXP);
+SEXP brokerCollect(SEXP, SEXP, SEXP);
+SEXP brokerStats(SEXP);
+SEXP serveSockets(SEXP, SEXP, SEXP, SEXP, SEXP);
+SEXP set_hwm(SEXP, SEXP);
+SEXP set_swap(SEXP, SEXP);
+SEXP set_affinity(SEXP, SEXP);
+SEXP set_identity(SEXP, SEXP);
+SEXP subscribe(SEXP, SEXP);
+SEXP unsubscribe(SEXP, SEXP);
+SEXP set_rate(SEXP, SEXP);
+SEXP set_recovery_ivl(SEXP, SEXP);
+SEXP set_recovery_ivl_msec(SEXP, SEXP);
+SEXP set_mcast_loop(SEXP, SEXP);
+SEXP set_sndbuf(SEXP, SEXP);
+SEXP set_rcvbuf(SEXP, SEXP);
+SEXP set_linger(SEXP, SEXP);
+SEXP set_reconnect_ivl(SEXP, SEXP);
+SEXP set_zmq_backlog(SEXP, SEXP);
+SEXP set_reconnect_ivl_max(SEXP, SEXP);
+SEXP set_heartbeat_ivl(SEXP, SEXP);
+SEXP set_heartbeat_timeout(SEXP, SEXP);
+SEXP set_heartbeat_ttl(SEXP, SEXP);
+SEXP get_rcvmore(SEXP);
+SEXP get_fd(SEXP);
+SEXP get_events(SEXP);
+SEXP addSocketHandler(SEXP, SEXP);
+SEXP removeSocketHandler(SEXP);
+SEXP pollSocket(SEXP, SEXP, SEXP);
+SEXP get_last_endpoint(SEXP);
+SEXP curveKeypair(void);
+SEXP set_curve_server(SEXP, SEXP);
+SEXP set_curve_publickey(SEXP, SEXP);
+SEXP set_curve_secretkey(SEXP, SEXP);
+SEXP set_curve_serverkey(SEXP, SEXP);
+SEXP set_zap_domain(SEXP, SEXP);
+SEXP initZapHandler(SEXP, SEXP, SEXP);
+SEXP stopZapHandler(SEXP);
+SEXP zapStats(SEXP);
+SEXP joinGroup(SEXP, SEXP);
+SEXP leaveGroup(SEXP, SEXP);
+SEXP sendRouted(SEXP, SEXP, SEXP, SEXP);
+SEXP receiveRouted(SEXP, SEXP);
+SEXP initSpillQueue(SEXP, SEXP, SEXP, SEXP, SEXP);
+SEXP spillSend(SEXP, SEXP);
+SEXP spillStats(SEXP);
+SEXP stopSpill(SEXP);
+SEXP initReliablePublisher(SEXP, SEXP, SEXP, SEXP);
+SEXP reliablePublish(SEXP, SEXP, SEXP);
+SEXP initReliableSubscriber(SEXP, SEXP, SEXP, SEXP, SEXP);
+SEXP reliableReceive(SEXP, SEXP, SEXP);
+SEXP reliableStats(SEXP);
+SEXP initLiveness(SEXP, SEXP, SEXP);
+SEXP livenessReceive(SEXP, SEXP);
+SEXP livenessPeers(SEXP);
+SEXP livenessExpired(SEXP);
+SEXP initCapture(SEXP);
+SEXP captureSocket(SEXP, SEXP, SEXP, SEXP);
+SEXP stopCapture(SEXP);
+SEXP replayCapture(SEXP, SEXP, SEXP, SEXP);
+SEXP initCoalescer(SEXP, SEXP, SEXP);
+SEXP coalesceSend(SEXP, SEXP);
+SEXP coalesceFlush(SEXP);
+SEXP coalesceReceive(SEXP, SEXP);
+SEXP coalesceStats(SEXP);
+SEXP stopCoalesce(SEXP);
+SEXP initPacer(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+SEXP paceSend(SEXP, SEXP);
+SEXP paceStats(SEXP);
+SEXP stopPace(SEXP);
+SEXP sendDeadline(SEXP, SEXP, SEXP, SEXP, SEXP);
+SEXP receiveFresh(SEXP, SEXP);
+SEXP deadlineStats(SEXP);
+SEXP get_sndtimeo(SEXP);
+SEXP set_sndtimeo(SEXP, SEXP);
+SEXP get_rcvtimeo(SEXP);
+SEXP set_rcvtimeo(SEXP, SEXP);
+
+static const R_CallMethodDef CallEntries[] = {
+  {"get_zmq_version", (DL_FUNC) &get_zmq_version, 0},
+  {"compactSerialize", (DL_FUNC) &compactSerialize, 1},
+  {"unserializeMessage", (DL_FUNC) &unserializeMessage, 1},
+  {"get_zmq_errno", (DL_FUNC) &get_zmq_errno, 0},
+  {"get_zmq_strerror", (DL_FUNC) &get_zmq_strerror, 0},
+  {"initContext", (DL_FUNC) &initContext, 1},
+  {"initSocket", (DL_FUNC) &initSocket, 2},
+  {"closeSocket", (DL_FUNC) &closeSocket, 2},
+  {"termContext", (DL_FUNC) &termContext, 2},
+  {"bindSocket", (DL_FUNC) &bindSocket, 2},
+  {"connectSocket", (DL_FUNC) &connectSocket, 2},
+  {"disconnectSocket", (DL_FUNC) &disconnectSocket, 2},
+  {"sendSocket", (DL_FUNC) &sendSocket, 3},
+  {"sendGather", (DL_FUNC) &sendGather, 3},
+  {"sendNullMsg", (DL_FUNC) &sendNullMsg, 2},
+  {"receiveNullMsg", (DL_FUNC) &receiveNullMsg, 1},
+  {"sendRawString", (DL_FUNC) &sendRawString, 3},
+  {"initMessage", (DL_FUNC) &initMessage, 1},
+  {"sendMessageObject", (DL_FUNC) &sendMessageObject, 3},
+  {"receiveSocket", (DL_FUNC) &receiveSocket, 2},
+  {"receiveString", (DL_FUNC) &receiveString, 1},
+  {"receiveInt", (DL_FUNC) &receiveInt, 1},
+  {"receiveDouble", (DL_FUNC) &receiveDouble, 1},
+  {"sendChunked", (DL_FUNC) &sendChunked, 5},
+  {"receiveChunked", (DL_FUNC) &receiveChunked, 2},
+  {"sendFile", (DL_FUNC) &sendFile, 6},
+  {"receiveInto", (DL_FUNC) &receiveInto, 4},
+  {"sendShared", (DL_FUNC) &sendShared, 8},
+  {"receiveShared", (DL_FUNC) &receiveShared, 2},
+  {"sendDataFrame", (DL_FUNC) &sendDataFrame, 3},
+  {"receiveDataFrame", (DL_FUNC) &receiveDataFrame, 2},
+  {"receiveBatch", (DL_FUNC) &receiveBatch, 5},
+  {"initRpcClient", (DL_FUNC) &initRpcClient, 2},
+  {"rpcCall", (DL_FUNC) &rpcCall, 3},
+  {"rpcCollect", (DL_FUNC) &rpcCollect, 2},
+  {"rpcPending", (DL_FUNC) &rpcPending, 1},
+  {"initBroker", (DL_FUNC) &initBroker, 3},
+  {"brokerSubmit", (DL_FUNC) &brokerSubmit, 2},
+  {"brokerCollect", (DL_FUNC) &brokerCollect, 3},
+  {"brokerStats", (DL_FUNC) &brokerStats, 1},
+  {"serveSockets", (DL_FUNC) &serveSockets, 5},
+  {"set_hwm", (DL_FUNC) &set_hwm, 2},
+  {"set_swap", (DL_FUNC) &set_swap, 2},
+  {"set_affinity", (DL_FUNC) &set_affinity, 2},
+  {"set_identity", (DL_FUNC) &set_identity, 2},
+  {"subscribe", (DL_FUNC) &subscribe, 2},
+  {"unsubscribe", (DL_FUNC) &unsubscribe, 2},
+  {"set_rate", (DL_FUNC) &set_rate, 2},
+  {"set_recovery_ivl", (DL_FUNC) &set_recovery_ivl, 2},
+  {"set_recovery_ivl_msec", (DL_FUNC) &set_recovery_ivl_msec, 2},
+  {"set_mcast_loop", (DL_FUNC) &set_mcast_loop, 2},
+  {"set_sndbuf", (DL_FUNC) &set_sndbuf, 2},
+  {"set_rcvbuf", (DL_FUNC) &set_rcvbuf, 2},
+  {"set_linger", (DL_FUNC) &set_linger, 2},
+  {"set_reconnect_ivl", (DL_FUNC) &set_reconnect_ivl, 2},
+  {"set_zmq_backlog", (DL_FUNC) &set_zmq_backlog, 2},
+  {"set_reconnect_ivl_max", (DL_FUNC) &set_reconnect_ivl_max, 2},
+  {"set_heartbeat_ivl", (DL_FUNC) &set_heartbeat_ivl, 2},
+  {"set_heartbeat_timeout", (DL_FUNC) &set_heartbeat_timeout, 2},
+  {"set_heartbeat_ttl", (DL_FUNC) &set_heartbeat_ttl, 2},
+  {"get_rcvmore", (DL_FUNC) &get_rcvmore, 1},
+  {"get_fd", (DL_FUNC) &get_fd, 1},
+  {"get_events", (DL_FUNC) &get_events, 1},
+  {"addSocketHandler", (DL_FUNC) &addSocketHandler, 2},
+  {"removeSocketHandler", (DL_FUNC) &removeSocketHandler, 1},
+  {"pollSocket", (DL_FUNC) &pollSocket, 3},
+  {"get_last_endpoint", (DL_FUNC) &get_last_endpoint, 1},
+  {"curveKeypair", (DL_FUNC) &curveKeypair, 0},
+  {"set_curve_server", (DL_FUNC) &set_curve_server, 2},
+  {"set_curve_publickey", (DL_FUNC) &set_curve_publickey, 2},
+  {"set_curve_secretkey", (DL_FUNC) &set_curve_secretkey, 2},
+  {"set_curve_serverkey", (DL_FUNC) &set_curve_serverkey, 2},
+  {"set_zap_domain", (DL_FUNC) &set_zap_domain, 2},
+  {"initZapHandler", (DL_FUNC) &initZapHandler, 3},
+  {"stopZapHandler", (DL_FUNC) &stopZapHandler, 1},
+  {"zapStats", (DL_FUNC) &zapStats, 1},
+  {"joinGroup", (DL_FUNC) &joinGroup, 2},
+  {"leaveGroup", (DL_FUNC) &leaveGroup, 2},
+  {"sendRouted", (DL_FUNC) &sendRouted, 4},
+  {"receiveRouted", (DL_FUNC) &receiveRouted, 2},
+  {"initSpillQueue", (DL_FUNC) &initSpillQueue, 5},
+  {"spillSend", (DL_FUNC) &spillSend, 2},
+  {"spillStats", (DL_FUNC) &spillStats, 1},
+  {"stopSpill", (DL_FUNC) &stopSpill, 1},
+  {"initReliablePublisher", (DL_FUNC) &initReliablePublisher, 4},
+  {"reliablePublish", (DL_FUNC) &reliablePublish, 3},
+  {"initReliableSubscriber", (DL_FUNC) &initReliableSubscriber, 5},
+  {"reliableReceive", (DL_FUNC) &reliableReceive, 3},
+  {"reliableStats", (DL_FUNC) &reliableStats, 1},
+  {"initLiveness", (DL_FUNC) &initLiveness, 3},
+  {"livenessReceive", (DL_FUNC) &livenessReceive, 2},
+  {"livenessPeers", (DL_FUNC) &livenessPeers, 1},
+  {"livenessExpired", (DL_FUNC) &livenessExpired, 1},
+  {"initCapture", (DL_FUNC) &initCapture, 1},
+  {"captureSocket", (DL_FUNC) &captureSocket, 4},
+  {"stopCapture", (DL_FUNC) &stopCapture, 1},
+  {"replayCapture", (DL_FUNC) &replayCapture, 4},
+  {"initCoalescer", (DL_FUNC) &initCoalescer, 3},
+  {"coalesceSend", (DL_FUNC) &coalesceSend, 2},
+  {"coalesceFlush", (DL_FUNC) &coalesceFlush, 1},
+  {"coalesceReceive", (DL_FUNC) &coalesceReceive, 2},
+  {"coalesceStats", (DL_FUNC) &coalesceStats, 1},
+  {"stopCoalesce", (DL_FUNC) &stopCoalesce, 1},
+  {"initPacer", (DL_FUNC) &initPacer, 7},
+  {"paceSend", (DL_FUNC) &paceSend, 2},
+  {"paceStats", (DL_FUNC) &paceStats, 1},
+  {"stopPace", (DL_FUNC) &stopPace, 1},
+  {"sendDeadline", (DL_FUNC) &sendDeadline, 5},
+  {"receiveFresh", (DL_FUNC) &receiveFresh, 2},
+  {"deadlineStats", (DL_FUNC) &deadlineStats, 1},
+  {"get_sndtimeo", (DL_FUNC) &get_sndtimeo, 1},
+  {"set_sndtimeo", (DL_FUNC) &set_sndtimeo, 2},
+  {"get_rcvtimeo", (DL_FUNC) &get_rcvtimeo, 1},
+  {"set_rcvtimeo", (DL_FUNC) &set_rcvtimeo, 2},
+  {NULL, NULL, 0}
+};
+
 void R_init_rzmq(DllInfo* info) {
-  R_registerRoutines(info, NULL, NULL, NULL, NULL);
-  R_useDynamicSymbols(info, TRUE);
+  R_registerRoutines(info, NULL, CallEntries, NULL, NULL);
+  R_useDynamicSymbols(info, FALSE);
+  R_forceSymbols(info, TRUE);
+  rzmq_init_tags();
+  rzmq_init_shared(info);
+  rzmq_init_api(info);
 }
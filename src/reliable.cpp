@@ -0,0 +1,559 @@
+///////////////////////////////////////////////////////////////////////////
+// Copyright (C) 2011  Whit Armstrong                                    //
+//                                                                       //
+// This program is free software: you can redistribute it and/or modify  //
+// it under the terms of the GNU General Public License as published by  //
+// the Free Software Foundation, either version 3 of the License, or     //
+// (at your option) any later version.                                   //
+//                                                                       //
+// This program is distributed in the hope that it will be useful,       //
+// but WITHOUT ANY WARRANTY; without even the implied warranty of        //
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         //
+// GNU General Public License for more details.                          //
+//                                                                       //
+// You should have received a copy of the GNU General Public License     //
+// along with this program.  If not, see <http://www.gnu.org/licenses/>. //
+///////////////////////////////////////////////////////////////////////////
+
+// Reliable publish/subscribe, after the Clone pattern of the zguide.
+//
+// The publisher sends [topic][header][payload], the header holding the
+// publisher's epoch and the topic's sequence number as two uint64, and
+// keeps the last messages in a ring.  A thread answers recovery requests
+// on a ROUTER socket from that ring; as with the broker, R stops it
+// through an inproc PAIR.  Subscribers track the sequence of each topic,
+// and on a gap ask the publisher's ROUTER over a DEALER for
+//
+//   [request id][topic][first][last]
+//
+// and get back [request id] followed by a [header][payload] pair for
+// every message of the range still in the ring.  Recovered messages are
+// delivered before the one that revealed the gap, so the caller sees each
+// topic in order.  A new epoch means the publisher restarted and its
+// sequences start again from 1.
+
+#include <zmq.hpp>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "interface.h"
+
+static const size_t RELIABLE_HEADER = 2 * sizeof(uint64_t);
+
+struct reliableEntry {
+  std::string topic;
+  uint64_t seq;
+  zmq::message_t payload;
+};
+
+struct reliablePublisher {
+  reliablePublisher(zmq::context_t& context) :
+    pub(context, ZMQ_PUB), pipe(context, ZMQ_PAIR), inner(context, ZMQ_PAIR),
+    snapshot(context, ZMQ_ROUTER), published(0), requests(0), replayed(0) {}
+  ~reliablePublisher() {
+    for(size_t i = 0; i < ring.size(); i++) delete ring[i];
+  }
+  zmq::socket_t pub;       // used by R only
+  zmq::socket_t pipe;      // R side of the PAIR
+  zmq::socket_t inner;     // thread side of the PAIR
+  zmq::socket_t snapshot;  // owned by the thread
+  std::thread thread;
+  uint64_t epoch;
+  size_t ring_size;
+  std::map<std::string, uint64_t> sequences;  // R only
+
+  // shared with the thread
+  std::mutex lock;
+  std::deque<reliableEntry*> ring;
+  double published, requests, replayed;
+};
+
+struct reliableMessage {
+  std::string topic;
+  uint64_t seq;
+  zmq::message_t payload;
+};
+
+struct reliableTopic {
+  uint64_t epoch;
+  uint64_t seq;  // last delivered
+};
+
+struct reliableSubscriber {
+  reliableSubscriber(zmq::context_t& context) :
+    sub(context, ZMQ_SUB), snapshot(context, ZMQ_DEALER), next_request(1), catch_up(false),
+    received(0), recovered(0), lost(0), duplicates(0) {}
+  ~reliableSubscriber() {
+    for(size_t i = 0; i < pending.size(); i++) delete pending[i];
+  }
+  zmq::socket_t sub;
+  zmq::socket_t snapshot;
+  std::map<std::string, reliableTopic> topics;
+  // recovered messages and the one after them, waiting to be delivered
+  std::deque<reliableMessage*> pending;
+  uint64_t next_request;
+  bool catch_up;
+  double received, recovered, lost, duplicates;
+};
+
+static void writeHeader(zmq::message_t& header, uint64_t epoch, uint64_t seq) {
+  memcpy(header.data(), &epoch, sizeof(uint64_t));
+  memcpy(reinterpret_cast<char*>(header.data()) + sizeof(uint64_t), &seq, sizeof(uint64_t));
+}
+
+static bool readHeader(const zmq::message_t& header, uint64_t* epoch, uint64_t* seq) {
+  if(header.size() != RELIABLE_HEADER)
+    return false;
+  memcpy(epoch, header.data(), sizeof(uint64_t));
+  memcpy(seq, reinterpret_cast<const char*>(header.data()) + sizeof(uint64_t), sizeof(uint64_t));
+  return true;
+}
+
+static uint64_t frameUint64(const zmq::message_t* frame) {
+  uint64_t value = 0;
+  if(frame->size() == sizeof(uint64_t))
+    memcpy(&value, frame->data(), sizeof(uint64_t));
+  return value;
+}
+
+static std::vector<zmq::message_t*> receiveFrames(zmq::socket_t& socket) {
+  std::vector<zmq::message_t*> parts;
+  bool more = true;
+  while(more) {
+    zmq::message_t* part = new zmq::message_t;
+    parts.push_back(part);
+    socket.recv(part);
+    more = part->more();
+  }
+  return parts;
+}
+
+static void deleteFrames(std::vector<zmq::message_t*>& parts) {
+  for(size_t i = 0; i < parts.size(); i++) delete parts[i];
+  parts.clear();
+}
+
+// answers [identity][request id][topic][first][last] from the ring
+static void replayRange(reliablePublisher* p, const std::vector<zmq::message_t*>& parts) {
+  if(parts.size() != 5)
+    return;
+  std::string topic(reinterpret_cast<const char*>(parts[2]->data()), parts[2]->size());
+  uint64_t first = frameUint64(parts[3]), last = frameUint64(parts[4]);
+
+  // copies share the payloads, and sending happens outside the lock
+  std::vector<zmq::message_t*> replies;
+  {
+    std::lock_guard<std::mutex> guard(p->lock);
+    for(size_t i = 0; i < p->ring.size(); i++) {
+      reliableEntry* entry = p->ring[i];
+      if(entry->topic != topic || entry->seq < first || entry->seq > last)
+        continue;
+      zmq::message_t* header = new zmq::message_t(RELIABLE_HEADER);
+      writeHeader(*header, p->epoch, entry->seq);
+      zmq::message_t* payload = new zmq::message_t;
+      payload->copy(&entry->payload);
+      replies.push_back(header);
+      replies.push_back(payload);
+    }
+    p->requests++;
+    p->replayed += replies.size() / 2;
+  }
+
+  p->snapshot.send(*parts[0], ZMQ_SNDMORE);
+  p->snapshot.send(*parts[1], replies.empty() ? 0 : ZMQ_SNDMORE);
+  for(size_t i = 0; i < replies.size(); i++) {
+    p->snapshot.send(*replies[i], i + 1 < replies.size() ? ZMQ_SNDMORE : 0);
+  }
+  deleteFrames(replies);
+}
+
+static void snapshotLoop(reliablePublisher* p) {
+  zmq_pollitem_t items[] = {
+    { (void*)p->inner, 0, ZMQ_POLLIN, 0 },
+    { (void*)p->snapshot, 0, ZMQ_POLLIN, 0 }
+  };
+
+  try {
+    while(true) {
+      try {
+        zmq::poll(items, 2, -1);
+      } catch(zmq::error_t& e) {
+        if(e.num() != EINTR)
+          throw;
+        continue;
+      }
+      // anything on the pipe means stop
+      if(items[0].revents & ZMQ_POLLIN)
+        break;
+      if(items[1].revents & ZMQ_POLLIN) {
+        std::vector<zmq::message_t*> parts = receiveFrames(p->snapshot);
+        replayRange(p, parts);
+        deleteFrames(parts);
+      }
+    }
+  } catch(std::exception& e) {
+    // context terminated underneath us
+  }
+}
+
+static void reliablePublisherFinalizer(SEXP publisher_) {
+  reliablePublisher* p = reinterpret_cast<reliablePublisher*>(R_ExternalPtrAddr(publisher_));
+  if(p) {
+    unregisterHandle(publisher_);
+    try {
+      zmq::message_t stop(0);
+      p->pipe.send(stop);
+    } catch(std::exception& e) {
+    }
+    p->thread.join();
+    delete p;
+    R_ClearExternalPtr(publisher_);
+  }
+}
+
+static void reliableSubscriberFinalizer(SEXP subscriber_) {
+  reliableSubscriber* s = reinterpret_cast<reliableSubscriber*>(R_ExternalPtrAddr(subscriber_));
+  if(s) {
+    unregisterHandle(subscriber_);
+    delete s;
+    R_ClearExternalPtr(subscriber_);
+  }
+}
+
+SEXP initReliablePublisher(SEXP context_, SEXP address_, SEXP snapshot_address_, SEXP ring_size_) {
+  SEXP publisher_;
+
+  if(TYPEOF(address_) != STRSXP || TYPEOF(snapshot_address_) != STRSXP) {
+    REprintf("address and snapshot address must be strings.\n");
+    return R_NilValue;
+  }
+  int ring_size = Rf_asInteger(ring_size_);
+  if(ring_size == NA_INTEGER || ring_size < 1) {
+    REprintf("ring size must be a positive integer.\n");
+    return R_NilValue;
+  }
+
+  zmq::context_t* context = reinterpret_cast<zmq::context_t*>(checkExternalPointer(context_,rzmq_context_tag));
+  if(!context) {
+    REprintf("bad context object.\n");
+    return R_NilValue;
+  }
+
+  reliablePublisher* p(NULL);
+  try {
+    p = new reliablePublisher(*context);
+    p->ring_size = ring_size;
+    // a restarted publisher must not be mistaken for the old one
+    std::random_device device;
+    p->epoch = (static_cast<uint64_t>(device()) << 32) ^ device() ^
+      static_cast<uint64_t>(std::chrono::system_clock::now().time_since_epoch().count());
+
+    int linger = 0;
+    p->pipe.setsockopt(ZMQ_LINGER, &linger, sizeof(int));
+    p->inner.setsockopt(ZMQ_LINGER, &linger, sizeof(int));
+    p->snapshot.setsockopt(ZMQ_LINGER, &linger, sizeof(int));
+
+    std::stringstream endpoint;
+    endpoint << "inproc://rzmq-reliable-" << reinterpret_cast<void*>(p);
+    p->pipe.bind(endpoint.str().c_str());
+    p->inner.connect(endpoint.str().c_str());
+    p->pub.bind(CHAR(STRING_ELT(address_,0)));
+    p->snapshot.bind(CHAR(STRING_ELT(snapshot_address_,0)));
+    p->thread = std::thread(snapshotLoop, p);
+  } catch(std::exception& e) {
+    reportError(e);
+    delete p;
+    return R_NilValue;
+  }
+
+  // the publisher keeps its context alive
+  PROTECT(publisher_ = R_MakeExternalPtr(reinterpret_cast<void*>(p),rzmq_reliable_publisher_tag,context_));
+  R_RegisterCFinalizerEx(publisher_, reliablePublisherFinalizer, TRUE);
+  registerHandle(publisher_, reliablePublisherFinalizer);
+  UNPROTECT(1);
+  return publisher_;
+}
+
+SEXP reliablePublish(SEXP publisher_, SEXP topic_, SEXP data_) {
+  if(TYPEOF(topic_) != STRSXP) {
+    REprintf("topic must be a string.\n");
+    return R_NilValue;
+  }
+  if(TYPEOF(data_) != RAWSXP) {
+    REprintf("data type must be raw (RAWSXP).\n");
+    return R_NilValue;
+  }
+
+  reliablePublisher* p = reinterpret_cast<reliablePublisher*>(checkExternalPointer(publisher_,rzmq_reliable_publisher_tag));
+  if(!p) {
+    REprintf("bad reliable publisher object.\n");
+    return R_NilValue;
+  }
+
+  std::string topic(CHAR(STRING_ELT(topic_,0)));
+  uint64_t seq = ++p->sequences[topic];
+  zmq::message_t topic_msg(topic.size());
+  memcpy(topic_msg.data(), topic.data(), topic.size());
+  zmq::message_t header(RELIABLE_HEADER);
+  writeHeader(header, p->epoch, seq);
+  zmq::message_t payload(Rf_xlength(data_));
+  memcpy(payload.data(), RAW(data_), Rf_xlength(data_));
+
+  // into the ring first; a send lost on the way is still recoverable
+  reliableEntry* entry = new reliableEntry;
+  entry->topic = topic;
+  entry->seq = seq;
+  entry->payload.copy(&payload);
+  {
+    std::lock_guard<std::mutex> guard(p->lock);
+    p->ring.push_back(entry);
+    while(p->ring.size() > p->ring_size) {
+      delete p->ring.front();
+      p->ring.pop_front();
+    }
+    p->published++;
+  }
+
+  bool status = sendMessage(&p->pub, topic_msg, ZMQ_SNDMORE) &&
+    sendMessage(&p->pub, header, ZMQ_SNDMORE) &&
+    sendMessage(&p->pub, payload, 0);
+  return statusResult(status);
+}
+
+SEXP initReliableSubscriber(SEXP context_, SEXP address_, SEXP snapshot_address_, SEXP topics_, SEXP catch_up_) {
+  SEXP subscriber_;
+
+  if(TYPEOF(address_) != STRSXP || TYPEOF(snapshot_address_) != STRSXP) {
+    REprintf("address and snapshot address must be strings.\n");
+    return R_NilValue;
+  }
+  if(TYPEOF(topics_) != STRSXP) {
+    REprintf("topics must be a character vector.\n");
+    return R_NilValue;
+  }
+  if(TYPEOF(catch_up_) != LGLSXP) {
+    REprintf("catch.up must be logical.\n");
+    return R_NilValue;
+  }
+
+  zmq::context_t* context = reinterpret_cast<zmq::context_t*>(checkExternalPointer(context_,rzmq_context_tag));
+  if(!context) {
+    REprintf("bad context object.\n");
+    return R_NilValue;
+  }
+
+  reliableSubscriber* s(NULL);
+  try {
+    s = new reliableSubscriber(*context);
+    s->catch_up = LOGICAL(catch_up_)[0];
+    int linger = 0;
+    s->sub.setsockopt(ZMQ_LINGER, &linger, sizeof(int));
+    s->snapshot.setsockopt(ZMQ_LINGER, &linger, sizeof(int));
+    for(R_xlen_t i = 0; i < Rf_xlength(topics_); i++) {
+      const char* topic = CHAR(STRING_ELT(topics_, i));
+      s->sub.setsockopt(ZMQ_SUBSCRIBE, topic, strlen(topic));
+    }
+    s->sub.connect(CHAR(STRING_ELT(address_,0)));
+    s->snapshot.connect(CHAR(STRING_ELT(snapshot_address_,0)));
+  } catch(std::exception& e) {
+    reportError(e);
+    delete s;
+    return R_NilValue;
+  }
+
+  PROTECT(subscriber_ = R_MakeExternalPtr(reinterpret_cast<void*>(s),rzmq_reliable_subscriber_tag,context_));
+  R_RegisterCFinalizerEx(subscriber_, reliableSubscriberFinalizer, TRUE);
+  registerHandle(subscriber_, reliableSubscriberFinalizer);
+  UNPROTECT(1);
+  return subscriber_;
+}
+
+// asks the publisher for seqs first..last of topic and queues what comes
+// back, in order; whatever the ring no longer has is counted as lost
+static void recoverRange(reliableSubscriber* s, const std::string& topic, uint64_t epoch,
+                         uint64_t first, uint64_t last, int timeout) {
+  uint64_t request = s->next_request++;
+  uint64_t next = first;
+  try {
+    zmq::message_t request_msg(sizeof(uint64_t));
+    memcpy(request_msg.data(), &request, sizeof(uint64_t));
+    zmq::message_t topic_msg(topic.size());
+    memcpy(topic_msg.data(), topic.data(), topic.size());
+    zmq::message_t first_msg(sizeof(uint64_t));
+    memcpy(first_msg.data(), &first, sizeof(uint64_t));
+    zmq::message_t last_msg(sizeof(uint64_t));
+    memcpy(last_msg.data(), &last, sizeof(uint64_t));
+    s->snapshot.send(request_msg, ZMQ_SNDMORE);
+    s->snapshot.send(topic_msg, ZMQ_SNDMORE);
+    s->snapshot.send(first_msg, ZMQ_SNDMORE);
+    s->snapshot.send(last_msg);
+
+    zmq_pollitem_t item = { (void*)s->snapshot, 0, ZMQ_POLLIN, 0 };
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+    while(true) {
+      long remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+      if(remaining < 0 || zmq::poll(&item, 1, remaining) == 0)
+        break;
+      std::vector<zmq::message_t*> parts = receiveFrames(s->snapshot);
+      // replies to requests that already timed out are dropped
+      if(frameUint64(parts[0]) != request) {
+        deleteFrames(parts);
+        continue;
+      }
+      for(size_t i = 1; i + 1 < parts.size(); i += 2) {
+        uint64_t entry_epoch, seq;
+        if(!readHeader(*parts[i], &entry_epoch, &seq) || entry_epoch != epoch || seq < next || seq > last)
+          continue;
+        reliableMessage* msg = new reliableMessage;
+        msg->topic = topic;
+        msg->seq = seq;
+        msg->payload.move(parts[i + 1]);
+        s->pending.push_back(msg);
+        s->lost += seq - next;
+        s->recovered++;
+        next = seq + 1;
+      }
+      deleteFrames(parts);
+      break;
+    }
+  } catch(std::exception& e) {
+    reportError(e);
+  }
+  s->lost += last + 1 - next;
+}
+
+// the next message from the SUB socket, checked against its topic's
+// sequence; false when none is waiting or on error
+static bool receiveLive(reliableSubscriber* s, int flags, int timeout) {
+  zmq::message_t topic_msg;
+  if(!receiveMessage(&s->sub, &topic_msg, flags))
+    return false;
+  std::vector<zmq::message_t*> parts;
+  bool more = topic_msg.more(), complete = true;
+  while(more) {
+    zmq::message_t* part = new zmq::message_t;
+    parts.push_back(part);
+    if(!receiveMessage(&s->sub, part, 0)) {
+      complete = false;
+      break;
+    }
+    more = part->more();
+  }
+  // messages from a plain publisher have no header and are skipped
+  uint64_t epoch, seq;
+  if(!complete || parts.size() != 2 || !readHeader(*parts[0], &epoch, &seq)) {
+    deleteFrames(parts);
+    return complete;
+  }
+  reliableMessage* msg = new reliableMessage;
+  msg->payload.move(parts[1]);
+  deleteFrames(parts);
+  msg->topic.assign(reinterpret_cast<const char*>(topic_msg.data()), topic_msg.size());
+  msg->seq = seq;
+
+  std::map<std::string, reliableTopic>::iterator it = s->topics.find(msg->topic);
+  if(it == s->topics.end() || it->second.epoch != epoch) {
+    // a restarted publisher lost nothing before its first message only if
+    // that message is seq 1; a new topic is caught up only if asked to
+    uint64_t start = (it != s->topics.end() || s->catch_up) ? 1 : seq;
+    reliableTopic state = { epoch, start - 1 };
+    it = s->topics.insert(std::make_pair(msg->topic, state)).first;
+    it->second = state;
+  }
+  if(seq <= it->second.seq) {
+    s->duplicates++;
+    delete msg;
+    return true;
+  }
+  if(seq > it->second.seq + 1)
+    recoverRange(s, msg->topic, epoch, it->second.seq + 1, seq - 1, timeout);
+  it->second.seq = seq;
+  s->pending.push_back(msg);
+  s->received++;
+  return true;
+}
+
+SEXP reliableReceive(SEXP subscriber_, SEXP dont_wait_, SEXP timeout_) {
+  SEXP ans, names;
+
+  if(TYPEOF(dont_wait_) != LGLSXP) {
+    REprintf("dont_wait type must be logical (LGLSXP).\n");
+    return R_NilValue;
+  }
+  int timeout = Rf_asInteger(timeout_);
+  if(timeout == NA_INTEGER || timeout < 0) {
+    REprintf("timeout must be a non-negative integer.\n");
+    return R_NilValue;
+  }
+
+  reliableSubscriber* s = reinterpret_cast<reliableSubscriber*>(checkExternalPointer(subscriber_,rzmq_reliable_subscriber_tag));
+  if(!s) {
+    REprintf("bad reliable subscriber object.\n");
+    return R_NilValue;
+  }
+
+  int flags = LOGICAL(dont_wait_)[0] ? ZMQ_DONTWAIT : 0;
+  while(s->pending.empty()) {
+    if(!receiveLive(s, flags, timeout))
+      return R_NilValue;
+  }
+  reliableMessage* msg = s->pending.front();
+  s->pending.pop_front();
+
+  PROTECT(ans = Rf_allocVector(VECSXP,3));
+  SET_VECTOR_ELT(ans, 0, Rf_mkString(msg->topic.c_str()));
+  SET_VECTOR_ELT(ans, 1, Rf_ScalarReal(msg->seq));
+  SEXP data = Rf_allocVector(RAWSXP, msg->payload.size());
+  SET_VECTOR_ELT(ans, 2, data);
+  memcpy(RAW(data), msg->payload.data(), msg->payload.size());
+  delete msg;
+  PROTECT(names = Rf_allocVector(STRSXP,3));
+  SET_STRING_ELT(names, 0, Rf_mkChar("topic"));
+  SET_STRING_ELT(names, 1, Rf_mkChar("seq"));
+  SET_STRING_ELT(names, 2, Rf_mkChar("data"));
+  Rf_setAttrib(ans, R_NamesSymbol, names);
+  UNPROTECT(2);
+  return ans;
+}
+
+static SEXP namedStats(const char** names, const double* values, int n) {
+  SEXP ans = PROTECT(Rf_allocVector(REALSXP, n));
+  SEXP names_ = PROTECT(Rf_allocVector(STRSXP, n));
+  for(int i = 0; i < n; i++) {
+    REAL(ans)[i] = values[i];
+    SET_STRING_ELT(names_, i, Rf_mkChar(names[i]));
+  }
+  Rf_setAttrib(ans, R_NamesSymbol, names_);
+  UNPROTECT(2);
+  return ans;
+}
+
+SEXP reliableStats(SEXP handle_) {
+  reliablePublisher* p = reinterpret_cast<reliablePublisher*>(checkExternalPointer(handle_,rzmq_reliable_publisher_tag));
+  if(p) {
+    const char* names[] = { "published", "ring", "requests", "replayed" };
+    double values[4];
+    {
+      std::lock_guard<std::mutex> guard(p->lock);
+      values[0] = p->published;
+      values[1] = p->ring.size();
+      values[2] = p->requests;
+      values[3] = p->replayed;
+    }
+    return namedStats(names, values, 4);
+  }
+  reliableSubscriber* s = reinterpret_cast<reliableSubscriber*>(checkExternalPointer(handle_,rzmq_reliable_subscriber_tag));
+  if(s) {
+    const char* names[] = { "received", "recovered", "lost", "duplicates" };
+    double values[] = { s->received, s->recovered, s->lost, s->duplicates };
+    return namedStats(names, values, 4);
+  }
+  REprintf("bad reliable publisher or subscriber object.\n");
+  return R_NilValue;
+}
@@ -0,0 +1,253 @@
+///////////////////////////////////////////////////////////////////////////
+// Copyright (C) 2011  Whit Armstrong                                    //
+//                                                                       //
+// This program is free software: you can redistribute it and/or modify  //
+// it under the terms of the GNU General Public License as published by  //
+// the Free Software Foundation, either version 3 of the License, or     //
+// (at your option) any later version.                                   //
+//                                                                       //
+// This program is distributed in the hope that it will be useful,       //
+// but WITHOUT ANY WARRANTY; without even the implied warranty of        //
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         //
+// GNU General Public License for more details.                          //
+//                                                                       //
+// You should have received a copy of the GNU General Public License     //
+// along with this program.  If not, see <http://www.gnu.org/licenses/>. //
+///////////////////////////////////////////////////////////////////////////
+
+// Pipelined request/reply over a DEALER socket.
+//
+// Every request goes out as [id][empty][payload].  A REP server treats the
+// id frame as part of the envelope and echoes it back, so replies come
+// home as [id][empty][reply] and can be matched to their request in any
+// order.  ROUTER based servers must return the frames before the empty
+// delimiter unchanged.
+
+#include <zmq.hpp>
+#include <chrono>
+#include <map>
+#include <vector>
+#include "interface.h"
+
+typedef std::chrono::steady_clock Clock;
+
+struct rpcClient {
+  rpcClient(zmq::context_t& context) : socket(context, ZMQ_DEALER), next_id(1) {}
+  zmq::socket_t socket;
+  double next_id;
+  // outstanding request ids and their deadlines
+  std::map<double, Clock::time_point> pending;
+};
+
+static void rpcClientFinalizer(SEXP client_) {
+  rpcClient* client = reinterpret_cast<rpcClient*>(R_ExternalPtrAddr(client_));
+  if(client) {
+    unregisterHandle(client_);
+    delete client;
+    R_ClearExternalPtr(client_);
+  }
+}
+
+SEXP initRpcClient(SEXP context_, SEXP address_) {
+  SEXP client_;
+
+  if(TYPEOF(address_) != STRSXP) {
+    REprintf("address type must be a string.\n");
+    return R_NilValue;
+  }
+
+  zmq::context_t* context = reinterpret_cast<zmq::context_t*>(checkExternalPointer(context_,rzmq_context_tag));
+  if(!context) {
+    REprintf("bad context object.\n");
+    return R_NilValue;
+  }
+
+  rpcClient* client(NULL);
+  try {
+    client = new rpcClient(*context);
+    client->socket.connect(CHAR(STRING_ELT(address_,0)));
+  } catch(std::exception& e) {
+    reportError(e);
+    delete client;
+    return R_NilValue;
+  }
+
+  // the client keeps its context alive
+  PROTECT(client_ = R_MakeExternalPtr(reinterpret_cast<void*>(client),rzmq_rpc_client_tag,context_));
+  R_RegisterCFinalizerEx(client_, rpcClientFinalizer, TRUE);
+  registerHandle(client_, rpcClientFinalizer);
+  UNPROTECT(1);
+  return client_;
+}
+
+SEXP rpcCall(SEXP client_, SEXP data_, SEXP timeout_) {
+  if(TYPEOF(data_) != RAWSXP) {
+    REprintf("data type must be raw (RAWSXP).\n");
+    return R_NilValue;
+  }
+
+  rpcClient* client = reinterpret_cast<rpcClient*>(checkExternalPointer(client_,rzmq_rpc_client_tag));
+  if(!client) {
+    REprintf("bad rpc client object.\n");
+    return R_NilValue;
+  }
+
+  double id = client->next_id;
+  zmq::message_t id_msg(sizeof(double));
+  memcpy(id_msg.data(), &id, sizeof(double));
+  zmq::message_t delimiter(0);
+  zmq::message_t msg(Rf_xlength(data_));
+  memcpy(msg.data(), RAW(data_), Rf_xlength(data_));
+
+  bool status = sendMessage(&client->socket, id_msg, ZMQ_SNDMORE) &&
+    sendMessage(&client->socket, delimiter, ZMQ_SNDMORE) &&
+    sendMessage(&client->socket, msg, 0);
+  if(!status)
+    return R_NilValue;
+
+  // negative timeouts never expire
+  double timeout = Rf_asReal(timeout_);
+  client->pending[id] = timeout < 0 ? Clock::time_point::max() :
+    Clock::now() + std::chrono::microseconds(static_cast<long long>(timeout * 1e6));
+  client->next_id++;
+  return Rf_ScalarReal(id);
+}
+
+// drains every reply already queued on the socket; receiveFrame keeps the
+// replies in the capture and the receive count, and a failure other than
+// an empty queue is thrown as the zmq error it was
+static void rpcDrain(rpcClient* client, std::vector<double>& ids, std::vector<zmq::message_t*>& replies) {
+  int error;
+  while(true) {
+    zmq::message_t id_msg;
+    if(!receiveFrame(&client->socket, &id_msg, ZMQ_DONTWAIT, &error)) {
+      if(error == EAGAIN)
+        return;
+      errno = error;
+      throw zmq::error_t();
+    }
+    std::vector<zmq::message_t*> parts;
+    bool more = id_msg.more();
+    while(more) {
+      zmq::message_t* part = new zmq::message_t;
+      parts.push_back(part);
+      if(!receiveFrame(&client->socket, part, 0, &error)) {
+        for(size_t i = 0; i < parts.size(); i++) delete parts[i];
+        errno = error;
+        throw zmq::error_t();
+      }
+      more = part->more();
+    }
+
+    double id = 0;
+    std::map<double, Clock::time_point>::iterator it = client->pending.end();
+    if(id_msg.size() == sizeof(double) && parts.size() == 2 && parts[0]->size() == 0) {
+      memcpy(&id, id_msg.data(), sizeof(double));
+      it = client->pending.find(id);
+    }
+    if(it != client->pending.end()) {
+      // late replies to expired or unknown requests are dropped
+      client->pending.erase(it);
+      ids.push_back(id);
+      replies.push_back(parts[1]);
+      parts.pop_back();
+    }
+    for(size_t i = 0; i < parts.size(); i++) delete parts[i];
+  }
+}
+
+SEXP rpcCollect(SEXP client_, SEXP timeout_) {
+  SEXP ans;
+
+  if(TYPEOF(timeout_) != INTSXP) {
+    Rf_error("rpc timeout must be an integer.");
+  }
+
+  rpcClient* client = reinterpret_cast<rpcClient*>(checkExternalPointer(client_,rzmq_rpc_client_tag));
+  if(!client) {
+    REprintf("bad rpc client object.\n");
+    return R_NilValue;
+  }
+
+  std::vector<double> ids, expired;
+  std::vector<zmq::message_t*> replies;
+  int timeout = *INTEGER(timeout_);
+  Clock::time_point start = Clock::now();
+
+  try {
+    while(true) {
+      rpcDrain(client, ids, replies);
+
+      Clock::time_point now = Clock::now();
+      Clock::time_point next_deadline = Clock::time_point::max();
+      for(std::map<double, Clock::time_point>::iterator it = client->pending.begin(); it != client->pending.end();) {
+        if(it->second <= now) {
+          expired.push_back(it->first);
+          client->pending.erase(it++);
+        } else {
+          next_deadline = std::min(next_deadline, it->second);
+          ++it;
+        }
+      }
+      if(!ids.empty() || !expired.empty() || client->pending.empty())
+        break;
+
+      // wait for a reply, the next deadline or the caller's timeout
+      long wait = -1;
+      if(timeout >= 0) {
+        wait = timeout - std::chrono::duration_cast<std::chrono::milliseconds>(now - start).count();
+        if(wait <= 0)
+          break;
+      }
+      if(next_deadline != Clock::time_point::max()) {
+        long until = std::chrono::duration_cast<std::chrono::milliseconds>(next_deadline - now).count() + 1;
+        wait = wait < 0 ? until : std::min(wait, until);
+      }
+      zmq_pollitem_t item = { (void*)client->socket, 0, ZMQ_POLLIN, 0 };
+      try {
+        zmq::poll(&item, 1, wait);
+      } catch(zmq::error_t& e) {
+        if(errno != EINTR || pending_interrupt())
+          throw;
+      }
+    }
+  } catch(std::exception& e) {
+    for(size_t i = 0; i < replies.size(); i++) delete replies[i];
+    Rf_error("%s", e.what());
+  }
+
+  PROTECT(ans = Rf_allocVector(VECSXP, 3));
+  SEXP ids_ = Rf_allocVector(REALSXP, ids.size());
+  SET_VECTOR_ELT(ans, 0, ids_);
+  SEXP replies_ = Rf_allocVector(VECSXP, replies.size());
+  SET_VECTOR_ELT(ans, 1, replies_);
+  for(size_t i = 0; i < replies.size(); i++) {
+    REAL(ids_)[i] = ids[i];
+    SEXP reply = Rf_allocVector(RAWSXP, replies[i]->size());
+    SET_VECTOR_ELT(replies_, i, reply);
+    memcpy(RAW(reply), replies[i]->data(), replies[i]->size());
+    delete replies[i];
+  }
+  SEXP expired_ = Rf_allocVector(REALSXP, expired.size());
+  SET_VECTOR_ELT(ans, 2, expired_);
+  for(size_t i = 0; i < expired.size(); i++) {
+    REAL(expired_)[i] = expired[i];
+  }
+
+  SEXP names = PROTECT(Rf_allocVector(STRSXP, 3));
+  SET_STRING_ELT(names, 0, Rf_mkChar("id"));
+  SET_STRING_ELT(names, 1, Rf_mkChar("reply"));
+  SET_STRING_ELT(names, 2, Rf_mkChar("expired"));
+  Rf_setAttrib(ans, R_NamesSymbol, names);
+  UNPROTECT(2);
+  return ans;
+}
+
+SEXP rpcPending(SEXP client_) {
+  rpcClient* client = reinterpret_cast<rpcClient*>(checkExternalPointer(client_,rzmq_rpc_client_tag));
+  if(!client) {
+    REprintf("bad rpc client object.\n");
+    return R_NilValue;
+  }
+  return Rf_ScalarInteger(static_cast<int>(client->pending.size()));
+}
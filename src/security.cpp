@@ -0,0 +1,392 @@
+///////////////////////////////////////////////////////////////////////////
+// Copyright (C) 2011  Whit Armstrong                                    //
+//                                                                       //
+// This program is free software: you can redistribute it and/or modify  //
+// it under the terms of the GNU General Public License as published by  //
+// the Free Software Foundation, either version 3 of the License, or     //
+// (at your option) any later version.                                   //
+//                                                                       //
+// This program is distributed in the hope that it will be useful,       //
+// but WITHOUT ANY WARRANTY; without even the implied warranty of        //
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         //
+// GNU General Public License for more details.                          //
+//                                                                       //
+// You should have received a copy of the GNU General Public License     //
+// along with this program.  If not, see <http://www.gnu.org/licenses/>. //
+///////////////////////////////////////////////////////////////////////////
+
+// CURVE keys and options, and a ZAP handler run on its own thread.
+//
+// libzmq asks the socket bound to inproc://zeromq.zap.01 in a context to
+// authenticate every new connection to a socket with a security mechanism
+// or a ZAP domain set.  The handler answers those requests from an
+// allowlist of client addresses and CURVE public keys, so connections are
+// authenticated without the R interpreter.  As with the broker, R stops
+// the thread through an inproc PAIR.
+
+#include <zmq.hpp>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <thread>
+#include "interface.h"
+
+#if ZMQ_VERSION_MAJOR > 3
+static const char* ZAP_ENDPOINT = "inproc://zeromq.zap.01";
+static const size_t CURVE_KEY_SIZE = 32;
+static const size_t CURVE_Z85_SIZE = 40;
+
+struct zapHandler {
+  zapHandler(zmq::context_t& context) :
+    pipe(context, ZMQ_PAIR), inner(context, ZMQ_PAIR), zap(context, ZMQ_REP),
+    accepted(0), denied(0) {}
+  zmq::socket_t pipe;   // R side of the PAIR
+  zmq::socket_t inner;  // handler side of the PAIR, owned by the thread
+  zmq::socket_t zap;    // owned by the thread
+  std::thread thread;
+  // fixed before the thread starts
+  std::set<std::string> keys;
+  std::set<std::string> addresses;
+
+  // shared with the thread
+  std::mutex lock;
+  double accepted;
+  double denied;
+};
+
+static std::string frameString(zmq::message_t* frame) {
+  return std::string(reinterpret_cast<const char*>(frame->data()), frame->size());
+}
+
+static void sendString(zmq::socket_t& socket, const std::string& value, int flags) {
+  zmq::message_t msg(value.size());
+  memcpy(msg.data(), value.data(), value.size());
+  socket.send(msg, flags);
+}
+
+// answers one ZAP request, see https://rfc.zeromq.org/spec/27/
+static void zapReply(zapHandler* h, const std::vector<zmq::message_t*>& parts) {
+  std::string request_id = parts.size() > 1 ? frameString(parts[1]) : "";
+  std::string status_text, user_id;
+
+  if(parts.size() < 6 || frameString(parts[0]) != "1.0") {
+    status_text = "malformed request";
+  } else {
+    std::string address = frameString(parts[3]);
+    std::string mechanism = frameString(parts[5]);
+    if(!h->addresses.empty() && !h->addresses.count(address)) {
+      status_text = "address not allowed";
+    } else if(mechanism == "CURVE") {
+      if(parts.size() < 7 || parts[6]->size() != CURVE_KEY_SIZE) {
+        status_text = "malformed request";
+      } else {
+        char key[CURVE_Z85_SIZE + 1];
+        zmq_z85_encode(key, reinterpret_cast<const uint8_t*>(parts[6]->data()), CURVE_KEY_SIZE);
+        if(h->keys.empty() || h->keys.count(key)) {
+          user_id = key;
+        } else {
+          status_text = "key not allowed";
+        }
+      }
+    } else if(!h->keys.empty()) {
+      // a key allowlist admits CURVE clients only
+      status_text = "mechanism not allowed";
+    }
+  }
+
+  bool ok = status_text.empty();
+  {
+    std::lock_guard<std::mutex> guard(h->lock);
+    if(ok) h->accepted++; else h->denied++;
+  }
+  sendString(h->zap, "1.0", ZMQ_SNDMORE);
+  sendString(h->zap, request_id, ZMQ_SNDMORE);
+  sendString(h->zap, ok ? "200" : "400", ZMQ_SNDMORE);
+  sendString(h->zap, ok ? "OK" : status_text, ZMQ_SNDMORE);
+  sendString(h->zap, user_id, ZMQ_SNDMORE);
+  sendString(h->zap, "", 0);
+}
+
+static void zapLoop(zapHandler* h) {
+  zmq_pollitem_t items[] = {
+    { (void*)h->inner, 0, ZMQ_POLLIN, 0 },
+    { (void*)h->zap, 0, ZMQ_POLLIN, 0 }
+  };
+
+  try {
+    while(true) {
+      try {
+        zmq::poll(items, 2, -1);
+      } catch(zmq::error_t& e) {
+        if(e.num() != EINTR)
+          throw;
+        continue;
+      }
+      // anything on the pipe means stop
+      if(items[0].revents & ZMQ_POLLIN)
+        break;
+      if(items[1].revents & ZMQ_POLLIN) {
+        std::vector<zmq::message_t*> parts;
+        bool more = true;
+        while(more) {
+          zmq::message_t* part = new zmq::message_t;
+          parts.push_back(part);
+          h->zap.recv(part);
+          more = part->more();
+        }
+        zapReply(h, parts);
+        for(size_t i = 0; i < parts.size(); i++) delete parts[i];
+      }
+    }
+  } catch(std::exception& e) {
+    // context terminated underneath us
+  }
+}
+
+static void zapHandlerFinalizer(SEXP handler_) {
+  zapHandler* h = reinterpret_cast<zapHandler*>(R_ExternalPtrAddr(handler_));
+  if(h) {
+    unregisterHandle(handler_);
+    try {
+      zmq::message_t stop(0);
+      h->pipe.send(stop);
+    } catch(std::exception& e) {
+    }
+    h->thread.join();
+    delete h;
+    R_ClearExternalPtr(handler_);
+  }
+}
+
+static bool isZ85Key(SEXP key) {
+  return key != NA_STRING && strlen(CHAR(key)) == CURVE_Z85_SIZE;
+}
+
+// sets a CURVE key from a 40 character Z85 string or 32 raw bytes
+static SEXP setCurveKey(SEXP socket_, SEXP option_value_, int option) {
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
+  if(!socket) { REprintf("bad socket object.\n");return R_NilValue; }
+  const void* key;
+  size_t key_len;
+  if(TYPEOF(option_value_) == STRSXP && Rf_xlength(option_value_) == 1 && isZ85Key(STRING_ELT(option_value_,0))) {
+    key = CHAR(STRING_ELT(option_value_,0));
+    key_len = CURVE_Z85_SIZE;
+  } else if(TYPEOF(option_value_) == RAWSXP && Rf_xlength(option_value_) == static_cast<R_xlen_t>(CURVE_KEY_SIZE)) {
+    key = RAW(option_value_);
+    key_len = CURVE_KEY_SIZE;
+  } else {
+    REprintf("key must be a 40 character Z85 string or 32 raw bytes.\n");
+    return R_NilValue;
+  }
+  SEXP ans; PROTECT(ans = Rf_allocVector(LGLSXP,1)); LOGICAL(ans)[0] = 1;
+  try {
+    socket->setsockopt(option, key, key_len);
+  } catch(std::exception& e) {
+    reportError(e);
+    LOGICAL(ans)[0] = 0;
+  }
+  UNPROTECT(1);
+  return ans;
+}
+#endif
+
+SEXP curveKeypair() {
+#if ZMQ_VERSION_MAJOR > 3
+  char public_key[CURVE_Z85_SIZE + 1], secret_key[CURVE_Z85_SIZE + 1];
+  if(zmq_curve_keypair(public_key, secret_key) != 0) {
+    // ENOTSUP when libzmq was built without CURVE
+    reportError(zmq::error_t());
+    return R_NilValue;
+  }
+  SEXP ans, names;
+  PROTECT(ans = Rf_allocVector(STRSXP,2));
+  SET_STRING_ELT(ans, 0, Rf_mkChar(public_key));
+  SET_STRING_ELT(ans, 1, Rf_mkChar(secret_key));
+  PROTECT(names = Rf_allocVector(STRSXP,2));
+  SET_STRING_ELT(names, 0, Rf_mkChar("public"));
+  SET_STRING_ELT(names, 1, Rf_mkChar("secret"));
+  Rf_setAttrib(ans, R_NamesSymbol, names);
+  UNPROTECT(2);
+  return ans;
+#else
+  REprintf("CURVE requires libzmq 4.0 or later.\n");
+  return R_NilValue;
+#endif
+}
+
+SEXP set_curve_server(SEXP socket_, SEXP option_value_) {
+#if ZMQ_VERSION_MAJOR > 3
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
+  if(!socket) { REprintf("bad socket object.\n");return R_NilValue; }
+  if(TYPEOF(option_value_)!=LGLSXP) { REprintf("option value must be a logical.\n");return R_NilValue; }
+  SEXP ans; PROTECT(ans = Rf_allocVector(LGLSXP,1)); LOGICAL(ans)[0] = 1;
+
+  int option_value(LOGICAL(option_value_)[0]);
+  try {
+    socket->setsockopt(ZMQ_CURVE_SERVER, &option_value, sizeof(int));
+  } catch(std::exception& e) {
+    reportError(e);
+    LOGICAL(ans)[0] = 0;
+  }
+  UNPROTECT(1);
+  return ans;
+#else
+  REprintf("CURVE requires libzmq 4.0 or later.\n");
+  return R_NilValue;
+#endif
+}
+
+SEXP set_curve_publickey(SEXP socket_, SEXP option_value_) {
+#if ZMQ_VERSION_MAJOR > 3
+  return setCurveKey(socket_, option_value_, ZMQ_CURVE_PUBLICKEY);
+#else
+  REprintf("CURVE requires libzmq 4.0 or later.\n");
+  return R_NilValue;
+#endif
+}
+
+SEXP set_curve_secretkey(SEXP socket_, SEXP option_value_) {
+#if ZMQ_VERSION_MAJOR > 3
+  return setCurveKey(socket_, option_value_, ZMQ_CURVE_SECRETKEY);
+#else
+  REprintf("CURVE requires libzmq 4.0 or later.\n");
+  return R_NilValue;
+#endif
+}
+
+SEXP set_curve_serverkey(SEXP socket_, SEXP option_value_) {
+#if ZMQ_VERSION_MAJOR > 3
+  return setCurveKey(socket_, option_value_, ZMQ_CURVE_SERVERKEY);
+#else
+  REprintf("CURVE requires libzmq 4.0 or later.\n");
+  return R_NilValue;
+#endif
+}
+
+SEXP set_zap_domain(SEXP socket_, SEXP option_value_) {
+#if ZMQ_VERSION_MAJOR > 3
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
+  if(!socket) { REprintf("bad socket object.\n");return R_NilValue; }
+  if(TYPEOF(option_value_)!=STRSXP) { REprintf("option value must be a string.\n");return R_NilValue; }
+  SEXP ans; PROTECT(ans = Rf_allocVector(LGLSXP,1)); LOGICAL(ans)[0] = 1;
+  const char* option_value = CHAR(STRING_ELT(option_value_,0));
+  try {
+    socket->setsockopt(ZMQ_ZAP_DOMAIN, option_value,strlen(option_value));
+  } catch(std::exception& e) {
+    reportError(e);
+    LOGICAL(ans)[0] = 0;
+  }
+  UNPROTECT(1);
+  return ans;
+#else
+  REprintf("ZAP requires libzmq 4.0 or later.\n");
+  return R_NilValue;
+#endif
+}
+
+SEXP initZapHandler(SEXP context_, SEXP keys_, SEXP addresses_) {
+#if ZMQ_VERSION_MAJOR > 3
+  SEXP handler_;
+
+  if(TYPEOF(keys_) != STRSXP || TYPEOF(addresses_) != STRSXP) {
+    REprintf("keys and addresses must be character vectors.\n");
+    return R_NilValue;
+  }
+  for(R_xlen_t i = 0; i < Rf_xlength(keys_); i++) {
+    if(!isZ85Key(STRING_ELT(keys_, i))) {
+      REprintf("keys must be 40 character Z85 strings.\n");
+      return R_NilValue;
+    }
+  }
+
+  zmq::context_t* context = reinterpret_cast<zmq::context_t*>(checkExternalPointer(context_,rzmq_context_tag));
+  if(!context) {
+    REprintf("bad context object.\n");
+    return R_NilValue;
+  }
+
+  zapHandler* h(NULL);
+  try {
+    h = new zapHandler(*context);
+    for(R_xlen_t i = 0; i < Rf_xlength(keys_); i++) {
+      h->keys.insert(CHAR(STRING_ELT(keys_, i)));
+    }
+    for(R_xlen_t i = 0; i < Rf_xlength(addresses_); i++) {
+      if(STRING_ELT(addresses_, i) != NA_STRING) h->addresses.insert(CHAR(STRING_ELT(addresses_, i)));
+    }
+    int linger = 0;
+    h->pipe.setsockopt(ZMQ_LINGER, &linger, sizeof(int));
+    h->inner.setsockopt(ZMQ_LINGER, &linger, sizeof(int));
+    h->zap.setsockopt(ZMQ_LINGER, &linger, sizeof(int));
+
+    std::stringstream endpoint;
+    endpoint << "inproc://rzmq-zap-" << reinterpret_cast<void*>(h);
+    h->pipe.bind(endpoint.str().c_str());
+    h->inner.connect(endpoint.str().c_str());
+    // fails with EADDRINUSE if the context already has a handler
+    h->zap.bind(ZAP_ENDPOINT);
+    h->thread = std::thread(zapLoop, h);
+  } catch(std::exception& e) {
+    reportError(e);
+    delete h;
+    return R_NilValue;
+  }
+
+  // the handler keeps its context alive
+  PROTECT(handler_ = R_MakeExternalPtr(reinterpret_cast<void*>(h),rzmq_zap_handler_tag,context_));
+  R_RegisterCFinalizerEx(handler_, zapHandlerFinalizer, TRUE);
+  registerHandle(handler_, zapHandlerFinalizer);
+  UNPROTECT(1);
+  return handler_;
+#else
+  REprintf("ZAP requires libzmq 4.0 or later.\n");
+  return R_NilValue;
+#endif
+}
+
+SEXP stopZapHandler(SEXP handler_) {
+  SEXP ans;
+  bool status(false);
+  if(TYPEOF(handler_) == EXTPTRSXP && R_ExternalPtrTag(handler_) == rzmq_zap_handler_tag) {
+#if ZMQ_VERSION_MAJOR > 3
+    if(R_ExternalPtrAddr(handler_)) {
+      zapHandlerFinalizer(handler_);
+      status = true;
+    }
+#endif
+  } else {
+    REprintf("bad zap handler object.\n");
+  }
+  PROTECT(ans = Rf_allocVector(LGLSXP,1));
+  LOGICAL(ans)[0] = static_cast<int>(status);
+  UNPROTECT(1);
+  return ans;
+}
+
+SEXP zapStats(SEXP handler_) {
+#if ZMQ_VERSION_MAJOR > 3
+  SEXP ans, names;
+
+  zapHandler* h = reinterpret_cast<zapHandler*>(checkExternalPointer(handler_,rzmq_zap_handler_tag));
+  if(!h) {
+    REprintf("bad zap handler object.\n");
+    return R_NilValue;
+  }
+
+  PROTECT(ans = Rf_allocVector(REALSXP,2));
+  {
+    std::lock_guard<std::mutex> guard(h->lock);
+    REAL(ans)[0] = h->accepted;
+    REAL(ans)[1] = h->denied;
+  }
+  PROTECT(names = Rf_allocVector(STRSXP,2));
+  SET_STRING_ELT(names, 0, Rf_mkChar("accepted"));
+  SET_STRING_ELT(names, 1, Rf_mkChar("denied"));
+  Rf_setAttrib(ans, R_NamesSymbol, names);
+  UNPROTECT(2);
+  return ans;
+#else
+  REprintf("ZAP requires libzmq 4.0 or later.\n");
+  return R_NilValue;
+#endif
+}
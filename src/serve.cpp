@@ -0,0 +1,259 @@
+///////////////////////////////////////////////////////////////////////////
+// Copyright (C) 2011  Whit Armstrong                                    //
+//                                                                       //
+// This program is free software: you can redistribute it and/or modify  //
+// it under the terms of the GNU General Public License as published by  //
+// the Free Software Foundation, either version 3 of the License, or     //
+// (at your option) any later version.                                   //
+//                                                                       //
+// This program is distributed in the hope that it will be useful,       //
+// but WITHOUT ANY WARRANTY; without even the implied warranty of        //
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         //
+// GNU General Public License for more details.                          //
+//                                                                       //
+// You should have received a copy of the GNU General Public License     //
+// along with this program.  If not, see <http://www.gnu.org/licenses/>. //
+///////////////////////////////////////////////////////////////////////////
+
+// A receive loop that waits across many sockets in C and hands each R
+// handler a whole batch of payloads at a time.
+//
+// R code, and with it any error raised by a handler, only runs from
+// serveSockets itself, which holds nothing that needs a destructor.  All
+// zmq work happens in the helpers below, and received frames are kept
+// behind an external pointer while they are copied into R, so an
+// allocation error leaves them to a finalizer.
+
+#include <zmq.hpp>
+#include <chrono>
+#include <vector>
+#include "interface.h"
+#include <Rinterface.h>
+
+typedef std::chrono::steady_clock Clock;
+
+// longest wait between two interrupt checks, in milliseconds
+static const long SERVE_POLL_SLICE = 100;
+
+enum serveStatus { SERVE_READY, SERVE_TIMEOUT, SERVE_INTERRUPT, SERVE_ERROR };
+
+// waits until a socket is readable, the idle timeout expires or the user
+// interrupts
+static serveStatus serveWait(zmq_pollitem_t* items, int nsock, long timeout) {
+  Clock::time_point start = Clock::now();
+  try {
+    while(true) {
+      long wait = SERVE_POLL_SLICE;
+      if(timeout >= 0) {
+        long left = timeout - std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start).count();
+        if(left < 0)
+          return SERVE_TIMEOUT;
+        wait = std::min(wait, left);
+      }
+      int rc = 0;
+      try {
+        rc = zmq::poll(items, nsock, wait);
+      } catch(zmq::error_t& e) {
+        if(errno != EINTR)
+          throw;
+      }
+      if(rc > 0)
+        return SERVE_READY;
+      if(pending_interrupt())
+        return SERVE_INTERRUPT;
+    }
+  } catch(std::exception& e) {
+    reportError(e);
+  }
+  return SERVE_ERROR;
+}
+
+// frames of the message being copied into R
+struct serveFrames {
+  ~serveFrames() { clear(); }
+  void clear() {
+    for(size_t i = 0; i < parts.size(); i++) delete parts[i];
+    parts.clear();
+  }
+  std::vector<zmq::message_t*> parts;
+};
+
+static void serveFramesFinalizer(SEXP frames_) {
+  serveFrames* frames = reinterpret_cast<serveFrames*>(R_ExternalPtrAddr(frames_));
+  if(frames) {
+    delete frames;
+    R_ClearExternalPtr(frames_);
+  }
+}
+
+// receives the next pending message into frames, false if nothing is
+// pending; no R allocation happens here
+static bool serveReceive(zmq::socket_t* socket, serveFrames* frames, bool* failed) {
+  frames->clear();
+  try {
+    bool more = true;
+    while(more) {
+      frames->parts.push_back(new zmq::message_t);
+      zmq::message_t* part = frames->parts.back();
+      // multipart messages are atomic, so the rest is already here
+      if(!socket->recv(part, frames->parts.size() == 1 ? ZMQ_DONTWAIT : 0)) {
+        frames->clear();
+        return false;
+      }
+      captureFrame(socket, *part, part->more(), true);
+      more = part->more();
+    }
+  } catch(std::exception& e) {
+    frames->clear();
+    reportError(e);
+    *failed = true;
+    return false;
+  }
+  return true;
+}
+
+// the next pending message as a raw vector, or a list of raw vectors if it
+// has several frames; NULL if nothing is pending
+static SEXP servePayload(zmq::socket_t* socket, serveFrames* frames, bool* failed) {
+  if(!serveReceive(socket, frames, failed))
+    return R_NilValue;
+  SEXP ans;
+  size_t nparts = frames->parts.size();
+  if(nparts == 1) {
+    zmq::message_t* part = frames->parts[0];
+    ans = Rf_allocVector(RAWSXP, part->size());
+    memcpy(RAW(ans), part->data(), part->size());
+  } else {
+    ans = PROTECT(Rf_allocVector(VECSXP, nparts));
+    for(size_t i = 0; i < nparts; i++) {
+      zmq::message_t* part = frames->parts[i];
+      SEXP frame = Rf_allocVector(RAWSXP, part->size());
+      SET_VECTOR_ELT(ans, i, frame);
+      memcpy(RAW(frame), part->data(), part->size());
+    }
+    UNPROTECT(1);
+  }
+  frames->clear();
+  return ans;
+}
+
+static SEXP unserializePayload(SEXP payload) {
+  if(TYPEOF(payload) == RAWSXP)
+    return rzmq_unserialize(payload, R_GlobalEnv);
+  for(R_xlen_t i = 0; i < Rf_xlength(payload); i++) {
+    SET_VECTOR_ELT(payload, i, rzmq_unserialize(VECTOR_ELT(payload, i), R_GlobalEnv));
+  }
+  return payload;
+}
+
+SEXP serveSockets(SEXP sockets_, SEXP handlers_, SEXP batch_size_, SEXP timeout_, SEXP unserialize_) {
+  if(TYPEOF(sockets_) != VECSXP || LENGTH(sockets_) == 0) {
+    Rf_error("A non-empy list of sockets is required as first argument.");
+  }
+  int nsock = LENGTH(sockets_);
+  if(TYPEOF(handlers_) != VECSXP || LENGTH(handlers_) != nsock) {
+    Rf_error("handler list must be the same length as socket list.");
+  }
+  if(TYPEOF(timeout_) != INTSXP) {
+    Rf_error("serve timeout must be an integer.");
+  }
+  int batch_size = Rf_asInteger(batch_size_);
+  if(batch_size == NA_INTEGER || batch_size < 1) {
+    Rf_error("batch size must be a positive integer.");
+  }
+  if(TYPEOF(unserialize_) != LGLSXP) {
+    Rf_error("unserialize must be logical (LGLSXP).");
+  }
+  bool unserialize = LOGICAL(unserialize_)[0];
+
+  zmq_pollitem_t* items = (zmq_pollitem_t*)R_alloc(nsock, sizeof(zmq_pollitem_t));
+  zmq::socket_t** sockets = (zmq::socket_t**)R_alloc(nsock, sizeof(zmq::socket_t*));
+  for(int i = 0; i < nsock; i++) {
+    if(!Rf_isFunction(VECTOR_ELT(handlers_, i))) {
+      Rf_error("handler %d is not a function.", i + 1);
+    }
+    sockets[i] = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(VECTOR_ELT(sockets_, i),rzmq_socket_tag));
+    if(!sockets[i]) {
+      Rf_error("bad socket object.");
+    }
+    items[i].socket = (void*)*sockets[i];
+    items[i].fd = 0;
+    items[i].events = ZMQ_POLLIN;
+    items[i].revents = 0;
+  }
+
+  serveFrames* frames = new serveFrames;
+  SEXP frames_ = PROTECT(R_MakeExternalPtr(reinterpret_cast<void*>(frames),R_NilValue,R_NilValue));
+  R_RegisterCFinalizerEx(frames_, serveFramesFinalizer, TRUE);
+
+  SEXP counts = PROTECT(Rf_allocVector(INTSXP, nsock));
+  memset(INTEGER(counts), 0, nsock * sizeof(int));
+
+  bool running = true;
+  bool interrupted = false;
+  while(running) {
+    serveStatus status = serveWait(items, nsock, *INTEGER(timeout_));
+    if(status == SERVE_ERROR) {
+      Rf_error("serve failed to poll its sockets.");
+    }
+    if(status == SERVE_INTERRUPT)
+      interrupted = true;
+    if(status != SERVE_READY)
+      break;
+
+    for(int i = 0; i < nsock && running; i++) {
+      if(!(items[i].revents & ZMQ_POLLIN))
+        continue;
+
+      SEXP batch = PROTECT(Rf_allocVector(VECSXP, batch_size));
+      int n = 0;
+      bool failed = false;
+      while(n < batch_size) {
+        SEXP payload = servePayload(sockets[i], frames, &failed);
+        if(payload == R_NilValue)
+          break;
+        SET_VECTOR_ELT(batch, n++, payload);
+      }
+      if(failed) {
+        Rf_error("serve failed to receive from socket %d.", i + 1);
+      }
+      if(n < batch_size) {
+        batch = Rf_lengthgets(batch, n);
+      }
+      UNPROTECT(1);
+      PROTECT(batch);
+      if(unserialize) {
+        for(int j = 0; j < n; j++) {
+          SET_VECTOR_ELT(batch, j, unserializePayload(VECTOR_ELT(batch, j)));
+        }
+      }
+      INTEGER(counts)[i] += n;
+
+      if(n) {
+        SEXP call = PROTECT(Rf_lang2(VECTOR_ELT(handlers_, i), batch));
+        SEXP result = Rf_eval(call, R_GlobalEnv);
+        // a handler returning FALSE stops the loop
+        if(TYPEOF(result) == LGLSXP && Rf_xlength(result) == 1 && LOGICAL(result)[0] == FALSE)
+          running = false;
+        UNPROTECT(1);
+        // so does closing one of the sockets
+        for(int j = 0; j < nsock; j++) {
+          if(!checkExternalPointer(VECTOR_ELT(sockets_, j),rzmq_socket_tag))
+            running = false;
+        }
+      }
+      UNPROTECT(1);
+    }
+    if(running && pending_interrupt()) {
+      interrupted = true;
+      break;
+    }
+  }
+
+  UNPROTECT(2);
+  // the check above swallowed the interrupt, raise it again now that
+  // nothing is left to clean up
+  if(interrupted)
+    Rf_onintr();
+  return counts;
+}
@@ -0,0 +1,496 @@
+///////////////////////////////////////////////////////////////////////////
+// Copyright (C) 2011  Whit Armstrong                                    //
+//                                                                       //
+// This program is free software: you can redistribute it and/or modify  //
+// it under the terms of the GNU General Public License as published by  //
+// the Free Software Foundation, either version 3 of the License, or     //
+// (at your option) any later version.                                   //
+//                                                                       //
+// This program is distributed in the hope that it will be useful,       //
+// but WITHOUT ANY WARRANTY; without even the implied warranty of        //
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         //
+// GNU General Public License for more details.                          //
+//                                                                       //
+// You should have received a copy of the GNU General Public License     //
+// along with this program.  If not, see <http://www.gnu.org/licenses/>. //
+///////////////////////////////////////////////////////////////////////////
+
+// Same-host transfers of large payloads through POSIX shared memory.
+//
+// Each message is a single frame starting with a tag byte.  Payloads below
+// the threshold follow the tag inline.  Larger payloads are serialized once
+// straight into a fresh shared memory segment, which grows as needed, and
+// the frame only carries the payload size and the segment name.
+//
+// A segment starts with a header holding the number of readers still to
+// map it and the end of its lease.  Each receiver maps the segment and
+// counts itself off, and the last expected reader unlinks the name; the
+// memory itself is freed once the last mapping is gone.  Segments that are
+// never read by all their readers (dropped at the high water mark, sent to
+// a dead receiver, or fanned out with readers = 0) are unlinked once their
+// lease is over, by the next send.shared of any rzmq process on the host.
+// The received raw vector is an ALTREP view of the mapping where available.
+
+#include <zmq.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <Rversion.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#if R_VERSION >= R_Version(3, 6, 0)
+#include <R_ext/Altrep.h>
+#define RZMQ_HAVE_ALTRAW
+#endif
+#include "interface.h"
+
+static const unsigned char SHM_INLINE = 0;
+static const unsigned char SHM_SEGMENT = 1;
+
+#ifndef _WIN32
+static const char SEGMENT_PREFIX[] = "rzmq-";
+static const unsigned char SEGMENT_MAGIC[] = { 'R', 'Z', 'S', 'H' };
+
+// first bytes of every segment; the payload follows at SEGMENT_HEADER
+struct segmentHeader {
+  unsigned char magic[4];
+  // readers still to map the segment, or 0 when only the lease applies
+  uint32_t readers;
+  // end of the lease, in milliseconds since the epoch
+  int64_t expires;
+};
+static const size_t SEGMENT_HEADER = 64;
+
+static int64_t epochMillis() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+    std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+static std::string segmentName() {
+  static std::atomic<unsigned long> counter(0);
+  std::stringstream name;
+  name << "/" << SEGMENT_PREFIX << getpid() << "-" << counter++ << "-" << (rand() & 0xffff);
+  return name.str();
+}
+
+// unlinks the segment if it is an rzmq segment whose lease is over
+static void sweepSegment(const std::string& name, int64_t now) {
+  int fd = shm_open(name.c_str(), O_RDONLY, 0);
+  if(fd < 0)
+    return;
+  bool expired = false;
+  struct stat st;
+  if(fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= SEGMENT_HEADER) {
+    void* base = mmap(NULL, SEGMENT_HEADER, PROT_READ, MAP_SHARED, fd, 0);
+    if(base != MAP_FAILED) {
+      const segmentHeader* header = reinterpret_cast<const segmentHeader*>(base);
+      expired = memcmp(header->magic, SEGMENT_MAGIC, sizeof(SEGMENT_MAGIC)) == 0 && header->expires <= now;
+      munmap(base, SEGMENT_HEADER);
+    }
+  }
+  close(fd);
+  if(expired)
+    shm_unlink(name.c_str());
+}
+
+// segments this process sent, until their lease is over
+static std::vector<std::pair<std::string, int64_t> > leased_segments;
+static int64_t last_scan = 0;
+
+static void sweepSegments() {
+  int64_t now = epochMillis();
+  for(size_t i = 0; i < leased_segments.size(); ) {
+    if(leased_segments[i].second <= now) {
+      sweepSegment(leased_segments[i].first, now);
+      leased_segments[i] = leased_segments.back();
+      leased_segments.pop_back();
+    } else {
+      i++;
+    }
+  }
+  // segments left by other processes, dead ones included, where the
+  // segments can be listed
+  if(now - last_scan < 10000)
+    return;
+  last_scan = now;
+  DIR* dir = opendir("/dev/shm");
+  if(!dir)
+    return;
+  struct dirent* entry;
+  while((entry = readdir(dir)) != NULL) {
+    if(strncmp(entry->d_name, SEGMENT_PREFIX, sizeof(SEGMENT_PREFIX) - 1) == 0)
+      sweepSegment(std::string("/") + entry->d_name, now);
+  }
+  closedir(dir);
+}
+#endif
+
+// Serializes once, into a small buffer until the payload reaches the
+// threshold and into a growing shared memory segment from then on.  The
+// writer lives behind an external pointer, so a serialization error (which
+// longjmps) still unmaps and unlinks the segment at the next gc.
+struct sharedWriter {
+  size_t threshold;
+  std::vector<char> buffer;
+  bool failed;
+#ifndef _WIN32
+  std::string name;
+  int fd;
+  char* base;
+  size_t capacity;
+  size_t length;
+  bool sent;
+#endif
+};
+
+#ifndef _WIN32
+static void unmapWriter(sharedWriter* w) {
+  if(w->base) munmap(w->base, SEGMENT_HEADER + w->capacity);
+  w->base = NULL;
+  if(w->fd >= 0) close(w->fd);
+  w->fd = -1;
+}
+
+static bool growSegment(sharedWriter* w, size_t need) {
+  size_t capacity = std::max(need, 2 * w->capacity);
+  if(w->base) munmap(w->base, SEGMENT_HEADER + w->capacity);
+  w->base = NULL;
+  if(ftruncate(w->fd, SEGMENT_HEADER + capacity) != 0)
+    return false;
+  void* base = mmap(NULL, SEGMENT_HEADER + capacity, PROT_READ | PROT_WRITE, MAP_SHARED, w->fd, 0);
+  if(base == MAP_FAILED)
+    return false;
+  w->base = reinterpret_cast<char*>(base);
+  w->capacity = capacity;
+  return true;
+}
+
+static bool openSegment(sharedWriter* w, size_t need) {
+  w->name = segmentName();
+  w->fd = shm_open(w->name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+  if(w->fd < 0) {
+    REprintf("cannot create shared memory segment: %s\n", strerror(errno));
+    w->name.clear();
+    return false;
+  }
+  if(!growSegment(w, std::max(need, w->threshold))) {
+    REprintf("cannot map shared memory segment: %s\n", strerror(errno));
+    return false;
+  }
+  return true;
+}
+#endif
+
+static void writerAppend(sharedWriter* w, const void* data, size_t length) {
+  const char* bytes = reinterpret_cast<const char*>(data);
+  if(w->failed)
+    return;
+#ifndef _WIN32
+  if(!w->base) {
+    if(w->buffer.size() + length < w->threshold) {
+      w->buffer.insert(w->buffer.end(), bytes, bytes + length);
+      return;
+    }
+    if(!openSegment(w, w->buffer.size() + length)) {
+      w->failed = true;
+      return;
+    }
+    if(!w->buffer.empty()) memcpy(w->base + SEGMENT_HEADER, w->buffer.data(), w->buffer.size());
+    w->length = w->buffer.size();
+    std::vector<char>().swap(w->buffer);
+  }
+  if(w->length + length > w->capacity && !growSegment(w, w->length + length)) {
+    REprintf("cannot grow shared memory segment: %s\n", strerror(errno));
+    w->failed = true;
+    return;
+  }
+  memcpy(w->base + SEGMENT_HEADER + w->length, bytes, length);
+  w->length += length;
+#else
+  w->buffer.insert(w->buffer.end(), bytes, bytes + length);
+#endif
+}
+
+static void sharedOutBytes(R_outpstream_t stream, void* buf, int length) {
+  writerAppend(reinterpret_cast<sharedWriter*>(stream->data), buf, length);
+}
+
+static void sharedOutChar(R_outpstream_t stream, int c) {
+  char ch = static_cast<char>(c);
+  writerAppend(reinterpret_cast<sharedWriter*>(stream->data), &ch, 1);
+}
+
+static void sharedWriterFinalizer(SEXP writer_) {
+  sharedWriter* w = reinterpret_cast<sharedWriter*>(R_ExternalPtrAddr(writer_));
+  if(w) {
+#ifndef _WIN32
+    unmapWriter(w);
+    // nobody will ever map a segment that was not sent
+    if(!w->sent && !w->name.empty()) shm_unlink(w->name.c_str());
+#endif
+    delete w;
+    R_ClearExternalPtr(writer_);
+  }
+}
+
+#ifndef _WIN32
+struct sharedMapping {
+  void* base;
+  size_t length;
+};
+
+static void sharedMappingFinalizer(SEXP mapping_) {
+  sharedMapping* mapping = reinterpret_cast<sharedMapping*>(R_ExternalPtrAddr(mapping_));
+  if(mapping) {
+    if(mapping->base) munmap(mapping->base, SEGMENT_HEADER + mapping->length);
+    delete mapping;
+    R_ClearExternalPtr(mapping_);
+  }
+}
+#endif
+
+#ifdef RZMQ_HAVE_ALTRAW
+static R_altrep_class_t shared_raw_class;
+
+static R_xlen_t sharedRawLength(SEXP x) {
+  return static_cast<R_xlen_t>(REAL(R_altrep_data2(x))[0]);
+}
+
+static void* sharedRawDataptr(SEXP x, Rboolean writeable) {
+  sharedMapping* mapping = reinterpret_cast<sharedMapping*>(R_ExternalPtrAddr(R_altrep_data1(x)));
+  return reinterpret_cast<char*>(mapping->base) + SEGMENT_HEADER;
+}
+
+static const void* sharedRawDataptrOrNull(SEXP x) {
+  return sharedRawDataptr(x, FALSE);
+}
+#endif
+
+void rzmq_init_shared(DllInfo* info) {
+#ifdef RZMQ_HAVE_ALTRAW
+  shared_raw_class = R_make_altraw_class("shared_raw", "rzmq", info);
+  R_set_altrep_Length_method(shared_raw_class, sharedRawLength);
+  R_set_altvec_Dataptr_method(shared_raw_class, sharedRawDataptr);
+  R_set_altvec_Dataptr_or_null_method(shared_raw_class, sharedRawDataptrOrNull);
+#endif
+}
+
+SEXP sendShared(SEXP socket_, SEXP data_, SEXP serialize_, SEXP xdr_, SEXP threshold_, SEXP readers_, SEXP lease_, SEXP send_more_) {
+  bool status(false);
+
+  if(TYPEOF(serialize_) != LGLSXP || TYPEOF(xdr_) != LGLSXP) {
+    REprintf("serialize and xdr must be logical (LGLSXP).\n");
+    return R_NilValue;
+  }
+
+  if(TYPEOF(send_more_) != LGLSXP) {
+    REprintf("send.more type must be logical (LGLSXP).\n");
+    return R_NilValue;
+  }
+
+  bool serialize = LOGICAL(serialize_)[0];
+  bool xdr = LOGICAL(xdr_)[0];
+  if(!serialize && TYPEOF(data_) != RAWSXP) {
+    REprintf("data type must be raw (RAWSXP).\n");
+    return R_NilValue;
+  }
+
+  double threshold = Rf_asReal(threshold_);
+  int readers = Rf_asInteger(readers_);
+  double lease = Rf_asReal(lease_);
+  if(!(threshold >= 0) || readers == NA_INTEGER || readers < 0 || !(lease >= 0) || !(lease < 1e9)) {
+    REprintf("threshold, readers and lease must be non-negative.\n");
+    return R_NilValue;
+  }
+
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
+  if(!socket) {
+    REprintf("bad socket object.\n");
+    return R_NilValue;
+  }
+
+  sharedWriter* w = new sharedWriter;
+  w->threshold = threshold < 1e18 ? static_cast<size_t>(threshold) : static_cast<size_t>(-1);
+  w->failed = false;
+#ifndef _WIN32
+  w->fd = -1;
+  w->base = NULL;
+  w->capacity = 0;
+  w->length = 0;
+  w->sent = false;
+  sweepSegments();
+#endif
+  SEXP writer_ = PROTECT(R_MakeExternalPtr(reinterpret_cast<void*>(w),R_NilValue,R_NilValue));
+  R_RegisterCFinalizerEx(writer_, sharedWriterFinalizer, TRUE);
+
+  if(serialize) {
+    struct R_outpstream_st out;
+    R_InitOutPStream(&out, reinterpret_cast<R_pstream_data_t>(w),
+                     xdr ? R_pstream_xdr_format : R_pstream_binary_format, 3,
+                     sharedOutChar, sharedOutBytes, NULL, R_NilValue);
+    R_Serialize(data_, &out);
+  } else {
+    writerAppend(w, RAW(data_), Rf_xlength(data_));
+  }
+  if(w->failed) {
+    sharedWriterFinalizer(writer_);
+    UNPROTECT(1);
+    return R_NilValue;
+  }
+
+  int flags = LOGICAL(send_more_)[0] ? ZMQ_SNDMORE : 0;
+#ifndef _WIN32
+  if(w->fd >= 0) {
+    segmentHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SEGMENT_MAGIC, sizeof(SEGMENT_MAGIC));
+    header.readers = readers;
+    header.expires = epochMillis() + static_cast<int64_t>(lease * 1000);
+    memcpy(w->base, &header, sizeof(header));
+    munmap(w->base, SEGMENT_HEADER + w->capacity);
+    w->base = NULL;
+    // give back the slack of the last growth
+    if(ftruncate(w->fd, SEGMENT_HEADER + w->length) != 0) {
+      REprintf("cannot trim shared memory segment: %s\n", strerror(errno));
+    }
+    unmapWriter(w);
+
+    uint64_t length = w->length;
+    zmq::message_t msg(1 + sizeof(uint64_t) + w->name.size());
+    char* frame = reinterpret_cast<char*>(msg.data());
+    frame[0] = SHM_SEGMENT;
+    memcpy(frame + 1, &length, sizeof(uint64_t));
+    memcpy(frame + 1 + sizeof(uint64_t), w->name.data(), w->name.size());
+    status = sendMessage(socket, msg, flags);
+    if(status) {
+      w->sent = true;
+      leased_segments.push_back(std::make_pair(w->name, header.expires));
+    }
+  } else
+#endif
+  {
+    zmq::message_t msg(1 + w->buffer.size());
+    char* frame = reinterpret_cast<char*>(msg.data());
+    frame[0] = SHM_INLINE;
+    if(!w->buffer.empty()) memcpy(frame + 1, w->buffer.data(), w->buffer.size());
+    status = sendMessage(socket, msg, flags);
+  }
+  // unlinks the segment if it could not be sent
+  sharedWriterFinalizer(writer_);
+  UNPROTECT(1);
+
+  return statusResult(status);
+}
+
+SEXP receiveShared(SEXP socket_, SEXP dont_wait_) {
+  SEXP ans;
+  zmq::message_t msg;
+
+  if(TYPEOF(dont_wait_) != LGLSXP) {
+    REprintf("dont_wait type must be logical (LGLSXP).\n");
+    return R_NilValue;
+  }
+
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
+  if(!socket) {
+    REprintf("bad socket object.\n");
+    return R_NilValue;
+  }
+
+  bool status(false);
+  status = receiveMessage(socket, &msg, LOGICAL(dont_wait_)[0] ? ZMQ_DONTWAIT : 0);
+  if(!status)
+    return R_NilValue;
+
+  const char* frame = reinterpret_cast<const char*>(msg.data());
+  if(msg.size() >= 1 && frame[0] == SHM_INLINE) {
+    ans = Rf_allocVector(RAWSXP, msg.size() - 1);
+    memcpy(RAW(ans), frame + 1, msg.size() - 1);
+    return ans;
+  }
+  if(msg.size() <= 1 + sizeof(uint64_t) || frame[0] != SHM_SEGMENT) {
+    REprintf("not a shared memory message.\n");
+    return R_NilValue;
+  }
+
+#ifndef _WIN32
+  uint64_t length;
+  memcpy(&length, frame + 1, sizeof(uint64_t));
+  std::string name(frame + 1 + sizeof(uint64_t), msg.size() - 1 - sizeof(uint64_t));
+
+  int fd = shm_open(name.c_str(), O_RDWR, 0);
+  if(fd < 0) {
+    REprintf("cannot open shared memory segment %s: %s\n", name.c_str(), strerror(errno));
+    return R_NilValue;
+  }
+  struct stat st;
+  if(fstat(fd, &st) != 0 || static_cast<uint64_t>(st.st_size) < SEGMENT_HEADER + length) {
+    REprintf("shared memory segment %s is shorter than its payload.\n", name.c_str());
+    close(fd);
+    return R_NilValue;
+  }
+  // count this reader off; the last expected one removes the name, and the
+  // segment lives on as long as any mapping of it
+  void* shared = mmap(NULL, SEGMENT_HEADER, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if(shared == MAP_FAILED) {
+    REprintf("cannot map shared memory segment %s: %s\n", name.c_str(), strerror(errno));
+    close(fd);
+    return R_NilValue;
+  }
+  segmentHeader* header = reinterpret_cast<segmentHeader*>(shared);
+  if(memcmp(header->magic, SEGMENT_MAGIC, sizeof(SEGMENT_MAGIC)) != 0) {
+    REprintf("%s is not an rzmq shared memory segment.\n", name.c_str());
+    munmap(shared, SEGMENT_HEADER);
+    close(fd);
+    return R_NilValue;
+  }
+  // only a count above zero is decremented, so readers beyond the expected
+  // number cannot wrap it
+  uint32_t readers = __atomic_load_n(&header->readers, __ATOMIC_ACQUIRE);
+  while(readers > 0 &&
+        !__atomic_compare_exchange_n(&header->readers, &readers, readers - 1, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+  }
+  if(readers == 1) {
+    shm_unlink(name.c_str());
+  }
+  munmap(shared, SEGMENT_HEADER);
+
+  sharedMapping* mapping = new sharedMapping;
+  mapping->length = length;
+  // private mapping, so R may write to the vector without touching the segment
+  mapping->base = mmap(NULL, SEGMENT_HEADER + length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(mapping->base == MAP_FAILED) {
+    REprintf("cannot map shared memory segment %s: %s\n", name.c_str(), strerror(errno));
+    delete mapping;
+    return R_NilValue;
+  }
+
+  SEXP mapping_ = PROTECT(R_MakeExternalPtr(reinterpret_cast<void*>(mapping),R_NilValue,R_NilValue));
+  R_RegisterCFinalizerEx(mapping_, sharedMappingFinalizer, TRUE);
+#ifdef RZMQ_HAVE_ALTRAW
+  if(length) {
+    SEXP length_ = PROTECT(Rf_ScalarReal(static_cast<double>(length)));
+    ans = R_new_altrep(shared_raw_class, mapping_, length_);
+    UNPROTECT(2);
+    return ans;
+  }
+#endif
+  PROTECT(ans = Rf_allocVector(RAWSXP, length));
+  if(length) memcpy(RAW(ans), reinterpret_cast<char*>(mapping->base) + SEGMENT_HEADER, length);
+  sharedMappingFinalizer(mapping_);
+  UNPROTECT(2);
+  return ans;
+#else
+  REprintf("shared memory messages are not supported on Windows.\n");
+  return R_NilValue;
+#endif
+}
@@ -0,0 +1,496 @@
+///////////////////////////////////////////////////////////////////////////
+// Copyright (C) 2011  Whit Armstrong                                    //
+//                                                                       //
+// This program is free software: you can redistribute it and/or modify  //
+// it under the terms of the GNU General Public License as published by  //
+// the Free Software Foundation, either version 3 of the License, or     //
+// (at your option) any later version.                                   //
+//                                                                       //
+// This program is distributed in the hope that it will be useful,       //
+// but WITHOUT ANY WARRANTY; without even the implied warranty of        //
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         //
+// GNU General Public License for more details.                          //
+//                                                                       //
+// You should have received a copy of the GNU General Public License     //
+// along with this program.  If not, see <http://www.gnu.org/licenses/>. //
+///////////////////////////////////////////////////////////////////////////
+
+// Disk spill queue, standing in for the ZMQ_SWAP option libzmq3 removed.
+//
+// A send that would block on the high water mark is appended to a log of
+// memory-mapped segment files instead, and a thread sends the log back to
+// the socket in order as it becomes writable.  Once anything is spilled,
+// later sends go to the log too, so the order is kept.  The socket is
+// shared with that thread under the queue's lock, except that while
+// records are queued only the thread touches it, so it waits for ZMQ_POLLOUT
+// without holding the lock.
+//
+// Each record is [magic][unused][length] as uint32, uint32, uint64 in
+// host order, then the payload padded to 8 bytes.  The magic is written
+// last, and replaced by SPILL_DONE once the record has been sent, so a
+// queue opened on the same directory picks up whatever was left unsent.
+
+#include <zmq.hpp>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include "interface.h"
+
+#ifndef _WIN32
+static const uint32_t SPILL_LIVE = 0x51535a52;  // "RZSQ"
+static const uint32_t SPILL_DONE = 0x454e4f44;  // "DONE"
+static const size_t SPILL_HEADER = 16;
+// longest wait for the socket before checking for a stop, in milliseconds
+static const long SPILL_POLL_SLICE = 100;
+
+enum spillSync { SPILL_SYNC_NONE, SPILL_SYNC_SEGMENT, SPILL_SYNC_ALWAYS };
+
+struct spillSegment {
+  std::string path;
+  char* base;
+  size_t size;
+  size_t end;  // where the next record is written
+};
+
+struct spillQueue {
+  spillQueue() : socket(NULL), read_pos(0), next_seq(0), depth(0), bytes(0),
+                 direct(0), spilled(0), drained(0), rejected(0), stopping(false) {}
+  zmq::socket_t* socket;  // NULL once stopped
+  std::string dir;
+  double max_bytes;
+  size_t segment_size;
+  spillSync sync;
+  std::thread thread;
+
+  // guards the socket and everything below
+  std::mutex lock;
+  std::condition_variable wake;
+  std::deque<spillSegment*> segments;  // read from the front, written at the back
+  size_t read_pos;
+  uint64_t next_seq;
+  double depth, bytes;
+  double direct, spilled, drained, rejected;
+  bool stopping;
+};
+
+// running queues, so closing a socket can stop its queues
+static std::set<spillQueue*> active_queues;
+
+static size_t recordSize(size_t length) {
+  return SPILL_HEADER + ((length + 7) & ~static_cast<size_t>(7));
+}
+
+// msync needs a page aligned start
+static void syncRange(char* base, size_t from, size_t to) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t aligned = from - from % page;
+  msync(base + aligned, to - aligned, MS_SYNC);
+}
+
+static void closeSegment(spillSegment* segment, bool remove) {
+  munmap(segment->base, segment->size);
+  if(remove) unlink(segment->path.c_str());
+  delete segment;
+}
+
+static spillSegment* mapSegment(const std::string& path, size_t size, bool create) {
+  int fd = open(path.c_str(), create ? O_CREAT | O_EXCL | O_RDWR : O_RDWR, 0600);
+  if(fd < 0)
+    return NULL;
+  struct stat st;
+  void* base = MAP_FAILED;
+  if(create ? ftruncate(fd, size) == 0 : fstat(fd, &st) == 0) {
+    if(!create) size = st.st_size;
+    if(size >= SPILL_HEADER)
+      base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  int error = errno;
+  close(fd);
+  if(base == MAP_FAILED) {
+    if(create) unlink(path.c_str());
+    errno = error;
+    return NULL;
+  }
+  spillSegment* segment = new spillSegment;
+  segment->path = path;
+  segment->base = reinterpret_cast<char*>(base);
+  segment->size = size;
+  segment->end = 0;
+  return segment;
+}
+
+static std::string segmentPath(const std::string& dir, uint64_t seq) {
+  char name[32];
+  snprintf(name, sizeof(name), "spill-%016llx.log", static_cast<unsigned long long>(seq));
+  return dir + "/" + name;
+}
+
+// the record at pos, or false at the end of the written part
+static bool readRecord(const spillSegment* segment, size_t pos, uint32_t* magic, uint64_t* length) {
+  if(pos + SPILL_HEADER > segment->size)
+    return false;
+  memcpy(magic, segment->base + pos, sizeof(uint32_t));
+  memcpy(length, segment->base + pos + 8, sizeof(uint64_t));
+  return (*magic == SPILL_LIVE || *magic == SPILL_DONE) && *length <= segment->size - pos - SPILL_HEADER;
+}
+
+// maps the segments left in dir by an earlier queue, oldest first
+static bool recoverSegments(spillQueue* q) {
+  DIR* dir = opendir(q->dir.c_str());
+  if(!dir)
+    return false;
+  std::vector<unsigned long long> seqs;
+  struct dirent* entry;
+  while((entry = readdir(dir)) != NULL) {
+    unsigned long long seq;
+    char tail;
+    if(sscanf(entry->d_name, "spill-%16llx.lo%c", &seq, &tail) == 2 && tail == 'g')
+      seqs.push_back(seq);
+  }
+  closedir(dir);
+  std::sort(seqs.begin(), seqs.end());
+
+  for(size_t i = 0; i < seqs.size(); i++) {
+    spillSegment* segment = mapSegment(segmentPath(q->dir, seqs[i]), 0, false);
+    if(!segment) {
+      REprintf("cannot map spill segment %s: %s\n", segmentPath(q->dir, seqs[i]).c_str(), strerror(errno));
+      continue;
+    }
+    uint32_t magic;
+    uint64_t length;
+    while(readRecord(segment, segment->end, &magic, &length)) {
+      if(magic == SPILL_LIVE) {
+        q->depth++;
+        q->bytes += length;
+      }
+      segment->end += recordSize(length);
+    }
+    q->segments.push_back(segment);
+    q->next_seq = seqs[i] + 1;
+  }
+  return true;
+}
+
+// appends a record, starting a new segment when it does not fit; called
+// with the lock held, so failures are returned as an errno for the caller
+// to report once the lock is released
+static int appendRecord(spillQueue* q, const void* data, size_t length) {
+  if(q->bytes + length > q->max_bytes) {
+    q->rejected++;
+    return ENOBUFS;
+  }
+  size_t need = recordSize(length);
+  spillSegment* tail = q->segments.empty() ? NULL : q->segments.back();
+  if(!tail || tail->end + need > tail->size) {
+    if(tail && q->sync == SPILL_SYNC_SEGMENT)
+      syncRange(tail->base, 0, tail->end);
+    spillSegment* segment = mapSegment(segmentPath(q->dir, q->next_seq), std::max(q->segment_size, need), true);
+    if(!segment) {
+      q->rejected++;
+      return errno;
+    }
+    q->next_seq++;
+    q->segments.push_back(segment);
+    tail = segment;
+  }
+
+  char* record = tail->base + tail->end;
+  uint32_t unused = 0;
+  uint64_t length64 = length;
+  memcpy(record + 4, &unused, sizeof(uint32_t));
+  memcpy(record + 8, &length64, sizeof(uint64_t));
+  memcpy(record + SPILL_HEADER, data, length);
+  memcpy(record, &SPILL_LIVE, sizeof(uint32_t));
+  if(q->sync == SPILL_SYNC_ALWAYS)
+    syncRange(tail->base, tail->end, tail->end + need);
+  tail->end += need;
+  q->depth++;
+  q->bytes += length;
+  q->spilled++;
+  q->wake.notify_one();
+  return 0;
+}
+
+static void drainLoop(spillQueue* q) {
+  std::unique_lock<std::mutex> guard(q->lock);
+  while(!q->stopping) {
+    if(q->depth == 0) {
+      q->wake.wait(guard);
+      continue;
+    }
+    spillSegment* head = q->segments.front();
+    uint32_t magic;
+    uint64_t length;
+    if(q->read_pos >= head->end || !readRecord(head, q->read_pos, &magic, &length)) {
+      // a segment is only finished once writing has moved past it
+      if(head == q->segments.back()) {
+        q->wake.wait(guard);
+        continue;
+      }
+      q->segments.pop_front();
+      closeSegment(head, true);
+      q->read_pos = 0;
+      continue;
+    }
+    if(magic == SPILL_DONE) {
+      q->read_pos += recordSize(length);
+      continue;
+    }
+
+    zmq::message_t msg(length);
+    memcpy(msg.data(), head->base + q->read_pos + SPILL_HEADER, length);
+    bool sent = false;
+    try {
+      sent = q->socket->send(msg, ZMQ_DONTWAIT);
+    } catch(std::exception& e) {
+      // the socket or its context is going away, the log keeps the rest
+      break;
+    }
+    if(!sent) {
+      // depth stays above zero until this thread sends, so spillSend only
+      // appends to the log meanwhile and the socket can be polled unlocked
+      zmq_pollitem_t item = { (void*)*q->socket, 0, ZMQ_POLLOUT, 0 };
+      guard.unlock();
+      try {
+        zmq::poll(&item, 1, SPILL_POLL_SLICE);
+      } catch(zmq::error_t& e) {
+        if(e.num() != EINTR)
+          return;
+      }
+      guard.lock();
+      continue;
+    }
+    memcpy(head->base + q->read_pos, &SPILL_DONE, sizeof(uint32_t));
+    q->read_pos += recordSize(length);
+    q->depth--;
+    q->bytes -= length;
+    q->drained++;
+  }
+}
+
+// stops the thread; what is still queued stays on disk for the next queue
+static void stopSpillQueue(spillQueue* q) {
+  if(!q->socket)
+    return;
+  {
+    std::lock_guard<std::mutex> guard(q->lock);
+    q->stopping = true;
+  }
+  q->wake.notify_one();
+  q->thread.join();
+  active_queues.erase(q);
+  q->socket = NULL;
+
+  bool empty = q->depth == 0;
+  for(size_t i = 0; i < q->segments.size(); i++) {
+    spillSegment* segment = q->segments[i];
+    if(!empty && q->sync != SPILL_SYNC_NONE)
+      syncRange(segment->base, 0, segment->end);
+    closeSegment(segment, empty);
+  }
+  q->segments.clear();
+}
+
+static void spillQueueFinalizer(SEXP queue_) {
+  spillQueue* q = reinterpret_cast<spillQueue*>(R_ExternalPtrAddr(queue_));
+  if(q) {
+    stopSpillQueue(q);
+    delete q;
+    R_ClearExternalPtr(queue_);
+  }
+}
+#endif
+
+void stopSpillQueues(void* socket) {
+#ifndef _WIN32
+  std::set<spillQueue*> queues(active_queues);
+  for(std::set<spillQueue*>::iterator it = queues.begin(); it != queues.end(); ++it) {
+    if((*it)->socket == socket) stopSpillQueue(*it);
+  }
+#endif
+}
+
+SEXP initSpillQueue(SEXP socket_, SEXP path_, SEXP max_bytes_, SEXP segment_size_, SEXP sync_) {
+#ifndef _WIN32
+  SEXP queue_;
+
+  if(TYPEOF(path_) != STRSXP) {
+    REprintf("path must be a string.\n");
+    return R_NilValue;
+  }
+  double max_bytes = Rf_asReal(max_bytes_);
+  double segment_size = Rf_asReal(segment_size_);
+  if(ISNAN(max_bytes) || max_bytes <= 0 || ISNAN(segment_size) || segment_size < 4096) {
+    REprintf("max.bytes must be positive and segment.size at least 4096.\n");
+    return R_NilValue;
+  }
+  if(TYPEOF(sync_) != STRSXP) {
+    REprintf("fsync must be one of \"none\", \"segment\" or \"always\".\n");
+    return R_NilValue;
+  }
+  std::string sync(CHAR(STRING_ELT(sync_,0)));
+  if(sync != "none" && sync != "segment" && sync != "always") {
+    REprintf("fsync must be one of \"none\", \"segment\" or \"always\".\n");
+    return R_NilValue;
+  }
+
+  zmq::socket_t* socket = reinterpret_cast<zmq::socket_t*>(checkExternalPointer(socket_,rzmq_socket_tag));
+  if(!socket) {
+    REprintf("bad socket object.\n");
+    return R_NilValue;
+  }
+  for(std::set<spillQueue*>::iterator it = active_queues.begin(); it != active_queues.end(); ++it) {
+    if((*it)->socket == socket) {
+      REprintf("socket already has a spill queue.\n");
+      return R_NilValue;
+    }
+  }
+
+  spillQueue* q = new spillQueue;
+  q->dir = CHAR(STRING_ELT(path_,0));
+  q->max_bytes = max_bytes;
+  q->segment_size = static_cast<size_t>(segment_size);
+  q->sync = sync == "none" ? SPILL_SYNC_NONE : sync == "segment" ? SPILL_SYNC_SEGMENT : SPILL_SYNC_ALWAYS;
+  if(mkdir(q->dir.c_str(), 0700) != 0 && errno != EEXIST) {
+    REprintf("cannot create spill directory %s: %s\n", q->dir.c_str(), strerror(errno));
+    delete q;
+    return R_NilValue;
+  }
+  if(!recoverSegments(q)) {
+    REprintf("cannot read spill directory %s: %s\n", q->dir.c_str(), strerror(errno));
+    delete q;
+    return R_NilValue;
+  }
+  q->socket = socket;
+  try {
+    q->thread = std::thread(drainLoop, q);
+  } catch(std::exception& e) {
+    reportError(e);
+    q->socket = NULL;
+    for(size_t i = 0; i < q->segments.size(); i++) closeSegment(q->segments[i], false);
+    delete q;
+    return R_NilValue;
+  }
+  active_queues.insert(q);
+
+  // the queue keeps its socket alive, and closing the socket stops the queue
+  PROTECT(queue_ = R_MakeExternalPtr(reinterpret_cast<void*>(q),rzmq_spill_queue_tag,socket_));
+  R_RegisterCFinalizerEx(queue_, spillQueueFinalizer, TRUE);
+  UNPROTECT(1);
+  return queue_;
+#else
+  REprintf("spill queues are not supported on Windows.\n");
+  return R_NilValue;
+#endif
+}
+
+SEXP spillSend(SEXP queue_, SEXP data_) {
+#ifndef _WIN32
+  if(TYPEOF(data_) != RAWSXP) {
+    REprintf("data type must be raw (RAWSXP).\n");
+    return R_NilValue;
+  }
+
+  spillQueue* q = reinterpret_cast<spillQueue*>(checkExternalPointer(queue_,rzmq_spill_queue_tag));
+  if(!q || !q->socket) {
+    REprintf("bad spill queue object.\n");
+    return R_NilValue;
+  }
+
+  // no R calls while the lock is held, a failure is only recorded
+  int error = 0;
+  {
+    std::lock_guard<std::mutex> guard(q->lock);
+    bool sent = false;
+    // straight to the socket unless that would overtake spilled messages
+    if(q->depth == 0) {
+      try {
+        zmq::message_t msg(Rf_xlength(data_));
+        memcpy(msg.data(), RAW(data_), Rf_xlength(data_));
+        sent = q->socket->send(msg, ZMQ_DONTWAIT);
+        if(sent) q->direct++;
+      } catch(zmq::error_t& e) {
+        error = e.num();
+      } catch(std::exception& e) {
+        error = ENOMEM;
+      }
+    }
+    if(!sent && !error)
+      error = appendRecord(q, RAW(data_), Rf_xlength(data_));
+  }
+  if(error) {
+    errno = error;
+    reportError(zmq::error_t());
+  }
+  return statusResult(error == 0);
+#else
+  REprintf("spill queues are not supported on Windows.\n");
+  return R_NilValue;
+#endif
+}
+
+SEXP spillStats(SEXP queue_) {
+  SEXP ans;
+#ifndef _WIN32
+  spillQueue* q = reinterpret_cast<spillQueue*>(checkExternalPointer(queue_,rzmq_spill_queue_tag));
+  if(!q) {
+    REprintf("bad spill queue object.\n");
+    return R_NilValue;
+  }
+
+  double stats[7];
+  {
+    std::lock_guard<std::mutex> guard(q->lock);
+    stats[0] = q->depth;
+    stats[1] = q->bytes;
+    stats[2] = q->segments.size();
+    stats[3] = q->direct;
+    stats[4] = q->spilled;
+    stats[5] = q->drained;
+    stats[6] = q->rejected;
+  }
+  const char* names[] = { "depth", "bytes", "segments", "direct", "spilled", "drained", "rejected" };
+  PROTECT(ans = Rf_allocVector(REALSXP, 7));
+  SEXP names_ = PROTECT(Rf_allocVector(STRSXP, 7));
+  for(int i = 0; i < 7; i++) {
+    REAL(ans)[i] = stats[i];
+    SET_STRING_ELT(names_, i, Rf_mkChar(names[i]));
+  }
+  Rf_setAttrib(ans, R_NamesSymbol, names_);
+  UNPROTECT(2);
+  return ans;
+#else
+  REprintf("spill queues are not supported on Windows.\n");
+  return R_NilValue;
+#endif
+}
+
+SEXP stopSpill(SEXP queue_) {
+  SEXP ans;
+  bool status(false);
+#ifndef _WIN32
+  spillQueue* q = reinterpret_cast<spillQueue*>(checkExternalPointer(queue_,rzmq_spill_queue_tag));
+  if(q) {
+    status = q->socket != NULL;
+    stopSpillQueue(q);
+  } else {
+    REprintf("bad spill queue object.\n");
+  }
+#endif
+  PROTECT(ans = Rf_allocVector(LGLSXP,1));
+  LOGICAL(ans)[0] = static_cast<int>(status);
+  UNPROTECT(1);
+  return ans;
+}